@@ -116,19 +116,37 @@ typedef struct _DBB DBB;
 typedef struct _CBB CBB;
 typedef struct _Instr Instr;
 
-// allocate space for a given number of decoded instructions
+// allocate space for a given number of decoded instructions.
+// different rewriters can be used concurrently in separate threads
 Rewriter* dbrew_new(void);
 
 // free rewriter resources
 void dbrew_free(Rewriter*);
 
-// configure size of internal buffer space of a rewriter
+// configure size of internal buffer space of a rewriter.
+// code space grows on demand in chunks of at least <codeCapacity> bytes
 void dbrew_set_decoding_capacity(Rewriter* r,
                                  int instrCapacity, int bbCapacity);
 void dbrew_set_capture_capacity(Rewriter* r,
                                 int instrCapacity, int bbCapacity,
                                 int codeCapacity);
 
+// limits for capturing: maximal depth of inlined calls and number of
+// saved emulator states (0: no limit, default 32/10000). If exceeded,
+// rewriting fails and the original function is used
+void dbrew_set_capture_limits(Rewriter* r,
+                              int maxCallDepth, int maxSavedStates);
+
+// budget for capturing: maximal number of captured instructions, size of
+// generated code in bytes, emulation steps and wall time in milliseconds
+// (0: no limit, default). If exhausted, rewriting does not fail: remaining
+// paths are captured without specialization, keeping loops rolled. If the
+// generated code is too large, capturing is repeated with lower budget.
+// If it still is too large after a few retries, rewriting fails and the
+// original function is returned
+void dbrew_set_capture_budget(Rewriter* r, int maxInstrs, int maxCodeSize,
+                              uint64_t maxSteps, int maxMillis);
+
 // set function to rewrite
 // this clears any previously decoded/captured instructions
 void dbrew_set_function(Rewriter* rewriter, uint64_t f);
@@ -160,6 +178,13 @@ uint64_t dbrew_emulate_capture(Rewriter* r, ...);
 // buffer with regenerated code, captured from emulation
 uint64_t dbrew_generated_code(Rewriter* r);
 int dbrew_generated_size(Rewriter* r);
+// trailing bytes of generated code which are data (constants, counters)
+int dbrew_generated_data_size(Rewriter* r);
+
+// generated code stays valid until released or the rewriter is freed.
+// <code> is an address returned by dbrew_rewrite(). Other addresses and
+// code already released are ignored
+void dbrew_release_code(Rewriter* r, uint64_t code);
 
 // configure rewriter
 void dbrew_config_reset(Rewriter* r);
@@ -170,17 +195,73 @@ void dbrew_config_parcount(Rewriter* r, int parCount);
 void dbrew_config_force_unknown(Rewriter* r, int depth);
 // assume all branches to be fixed according to rewriter input parameters
 void dbrew_config_branches_known(Rewriter* r, bool);
+// track content of memory outside the stack written while rewriting, to
+// fold loads of data stored before (e.g. scratch buffers). Stores are
+// still done in the rewritten code
+void dbrew_config_trackmem(Rewriter* r, bool);
+
+// how to capture loops whose trip count is known at rewrite time
+typedef enum _DBrewLoopPolicy {
+    DBREW_LOOP_UNROLL = 0, // unroll completely (default)
+    DBREW_LOOP_ROLLED,     // keep rolled, body specialized on static data
+    DBREW_LOOP_PARTIAL,    // keep rolled, with <n> body copies per trip
+    DBREW_LOOP_PEEL        // <n> iterations separately before rolled loop
+} DBrewLoopPolicy;
+// Registers changing between the first back-edges of a loop become
+// dynamic: at least two iterations are captured separately before the
+// rolled loop, and loops with fewer iterations still get unrolled.
+// Data in memory and on stack is not generalized
+void dbrew_config_loops(Rewriter* r, DBrewLoopPolicy policy, int n);
+// how to handle calls to a function while rewriting
+typedef enum _DBrewCallPolicy {
+    DBREW_CALL_INLINE = 0, // inline, specialized on static data (default)
+    DBREW_CALL_KEEP,       // keep as call in the rewritten code
+    DBREW_CALL_REPLACE     // call <replacement> instead, using its policy
+} DBrewCallPolicy;
+// Only calls to functions configured to be kept are kept, calls to
+// unknown targets and beyond the call depth limit still make rewriting
+// fail. Functions kept must get all arguments in registers: arguments on
+// the stack (more than 6 integer arguments, structs passed by value) are
+// not supported. A call with an address of stack data in an argument
+// register gets inlined instead
+void dbrew_config_function_setcall(Rewriter* r, uint64_t f,
+                                   DBrewCallPolicy policy,
+                                   uint64_t replacement);
 // provide a name for a function (for debug)
 void dbrew_config_function_setname(Rewriter* r, uint64_t f, const char* name);
 // provide a code length in bytes for a function (for debugging)
 void dbrew_config_function_setsize(Rewriter* r, uint64_t f, int len);
 // provide a name for a parameter of the function to rewrite (for debug)
 void dbrew_config_par_setname(Rewriter* c, int par, char* name);
-// register a valid memory range with permission and name (for debug)
+// register a valid memory range with permission and name. Loads via
+// static addresses from read-only ranges are folded to constants
 void dbrew_config_set_memrange(Rewriter* r, char* name, bool isWritable,
                                uint64_t start, int size);
 
-// convenience functions, using default rewriter
+// specialization cache: reuse code for same function, config, values of
+// static parameters and data read via static pointers (checked by hash).
+// <entries>/<codeCapacity> bound the cache (0: default); it gets flushed
+// when full, invalidating code pointers returned before
+void dbrew_cache_enable(Rewriter* r, int entries, int codeCapacity);
+// use a global cache shared with other rewriters instead
+void dbrew_cache_enable_global(Rewriter* r);
+void dbrew_cache_disable(Rewriter* r);
+void dbrew_cache_flush(Rewriter* r);
+// get number of entries and lookup statistics; pointers can be 0
+void dbrew_cache_stats(Rewriter* r, int* entries,
+                       uint64_t* hits, uint64_t* misses);
+
+// profile-guided block layout: with <instrument> set, rewritten code
+// counts the directions taken at conditional branches. After running it
+// with representative input, dbrew_profile_relayout regenerates the code
+// of the last rewrite with hot paths as fall-through and cold blocks
+// at the end, and returns it. The specialization cache is bypassed.
+// The instrumented code is not released by the relayout, as it may still
+// be running: release it with dbrew_release_code when not used anymore
+void dbrew_profile_enable(Rewriter* r, bool instrument);
+uint64_t dbrew_profile_relayout(Rewriter* r);
+
+// convenience functions, using default rewriter (one per thread)
 void dbrew_def_verbose(bool decode, bool emuState, bool emuSteps);
 
 // Act as drop-in replacement assuming the function is returning an integer
@@ -189,6 +270,14 @@ uint64_t dbrew_emulate(Rewriter* r, ...);
 // rewrite configured function, return pointer to rewritten code
 uint64_t dbrew_rewrite(Rewriter* r, ...);
 
+// rewrite configured function in a background thread. Immediately
+// returns a trampoline jumping to the original function, switched to
+// the rewritten code when finished. Until dbrew_rewrite_wait is called,
+// <r> must not be used otherwise (dbrew_rewrite/dbrew_free wait first)
+uint64_t dbrew_rewrite_async(Rewriter* r, ...);
+// wait for background rewrite, return code the trampoline jumps to
+uint64_t dbrew_rewrite_wait(Rewriter* r);
+
 // rewrite <f> using default config, return pointer to rewritten code
 uint64_t dbrew_rewrite_func(uint64_t f, ...);
 
@@ -0,0 +1,40 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Arena: memory for transient data of one rewrite
+ *
+ * Saved emulator states, captured BBs and instructions and expression
+ * nodes are only needed until the next rewrite starts. They are allocated
+ * from a chain of blocks by bumping a pointer, and all are released at
+ * once by resetting the arena. Blocks are kept for reuse.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+typedef struct _Arena Arena;
+
+Arena* arena_new(int blockSize);
+void arena_free(Arena* a);
+// release all allocations in O(1)
+void arena_reset(Arena* a);
+// return memory of <size> bytes, aligned to 16 bytes
+void* arena_alloc(Arena* a, int size);
+
+#endif // ARENA_H
@@ -0,0 +1,44 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Asynchronous rewriting
+ *
+ * A rewrite request can be run by a background thread. The caller
+ * immediately gets a trampoline: a small code stub jumping indirectly
+ * via a target slot next to it. The slot points to the original function
+ * first. When the rewrite finishes, the slot is switched atomically to
+ * the rewritten code (or stays at the original if rewriting failed).
+ *
+ * A rewriter runs at most one background rewrite at a time; it must not
+ * be used otherwise until the rewrite is waited for.
+ */
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <stdint.h>
+
+#include "common.h"
+
+// start rewriting with parameters <par>, return trampoline
+uint64_t async_start(Rewriter* r, uint64_t* par);
+// wait for a pending background rewrite, return its resulting code
+uint64_t async_wait(Rewriter* r);
+
+#endif // ASYNC_H
@@ -20,14 +20,33 @@
 #ifndef BUFFERS_H
 #define BUFFERS_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
-// XXX: Move Struct in C file after removing all direct dependencies!
-struct _CodeStorage {
-    int size;
+/* Code storage: a growable code heap for generated functions.
+ *
+ * It consists of a list of mmap'ed chunks. New code is always put into
+ * the current (first) chunk; if that gets full, a new chunk is added.
+ * Each chunk counts the functions committed into it. Releasing all code
+ * of a chunk unmaps it (or makes it reusable if it is the current one).
+ */
+
+typedef struct _CodeChunk CodeChunk;
+struct _CodeChunk {
     int fullsize; /* rounded to multiple of a page size */
     int used;
+    int live; /* number of committed functions not yet released */
+    int startCapacity;
+    uint64_t* start; /* start addresses of these functions */
     uint8_t* buf;
+    CodeChunk* next; /* older chunk */
+};
+
+// XXX: Move Struct in C file after removing all direct dependencies!
+struct _CodeStorage {
+    int size; /* minimal size of a new chunk */
+    int chunkCount;
+    CodeChunk* chunk; /* current chunk, chained to older ones */
 };
 
 typedef struct _CodeStorage CodeStorage;
@@ -35,10 +54,21 @@ typedef struct _CodeStorage CodeStorage;
 CodeStorage* initCodeStorage(int size);
 void freeCodeStorage(CodeStorage* cs);
 
-/* this checks whether enough storage is available, but does
- * not change <used>.
+/* this checks whether enough storage is available in the current chunk,
+ * but does not change <used>. If not, a new chunk is started.
  */
 uint8_t* reserveCodeStorage(CodeStorage* cs, int size);
 uint8_t* useCodeStorage(CodeStorage* cs, int size);
+/* set start of unused space in current chunk back to <p> */
+void resetCodeStorage(CodeStorage* cs, uint8_t* p);
+
+/* mark code of a function starting at <start> in current chunk as being
+ * in use
+ */
+void commitCodeStorage(CodeStorage* cs, uint64_t start);
+/* release a function committed before, given by its start address.
+ * Returns false if <addr> is not the start of a function in use.
+ */
+bool releaseCodeStorage(CodeStorage* cs, uint64_t addr);
 
 #endif // BUFFERS_H
@@ -0,0 +1,60 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Specialization cache
+ *
+ * Allows to reuse code generated by a previous rewrite request for the
+ * same function, capture configuration and values of static parameters.
+ * As static pointers make the rewriter read memory as known data, the
+ * ranges read this way are logged during emulation, and a hash of their
+ * content is stored with each entry. On lookup, the hash is recalculated
+ * to detect modified data.
+ *
+ * The cache is bounded by number of entries and code space. As with
+ * translation caches of other binary translators, it is flushed as
+ * a whole when full. Each cache has a lock, as the global cache may be
+ * used by rewriters running in different threads.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+
+SpecCache* cache_new(int entries, int codeCapacity);
+void cache_free(SpecCache* sc);
+void cache_flush(SpecCache* sc);
+void cache_stats(SpecCache* sc, int* entries,
+                 uint64_t* hits, uint64_t* misses);
+
+// cache shared among rewriters, allocated on first use
+SpecCache* cache_global(void);
+
+// can the result of the next rewrite of <r> use the cache?
+bool cache_enabled(Rewriter* r);
+// on hit, sets generated code of rewriter and returns true
+bool cache_lookup(Rewriter* r, uint64_t* par);
+// store code generated by last rewrite with parameters <par>.
+// this moves the code into cache space and updates the rewriter
+void cache_insert(Rewriter* r, uint64_t* par);
+
+#endif // CACHE_H
@@ -21,7 +21,9 @@
 #define COMMON_H
 
 #include "dbrew.h"
+#include "arena.h"
 #include "buffers.h"
+#include "error.h"
 #include "expr.h"
 #include "instr.h"
 
@@ -32,6 +34,8 @@
 typedef struct _MemRangeConfig MemRangeConfig;
 typedef struct _FunctionConfig FunctionConfig;
 typedef struct _CaptureConfig CaptureConfig;
+typedef struct _SpecCache SpecCache;
+typedef struct _AsyncJob AsyncJob;
 
 // a decoded basic block
 struct _DBB {
@@ -63,10 +67,20 @@ struct _CBB {
     // a hint for conditional branches whether branching is more likely
     bool preferBranch;
 
+    // liveness at start of BB: registers/flags as bit set, and offset from
+    // stack pointer below which stack bytes are dead (see opt.c)
+    uint32_t liveIn;
+    int64_t deadStackBelow;
+
+    // edge counts of conditional branch from a profiling run
+    uint64_t countBranch, countFallThrough;
+
     // for DBrew's own code generation backend
     int size;
     uint64_t addr1, addr2;
-    bool genJcc8, genJump;
+    bool genJcc8, genJump, genJmp8;
+    bool genInvert;       // Jcc with inverted condition to fall-through
+    uint64_t* genCounter; // with profiling: taken/not-taken counters
 
     // allow to store CBB-specific data for other backends (eg. via LLVM JIT)
     void* generatorData;
@@ -76,8 +90,8 @@ char* cbb_prettyName(CBB* bb);
 
 
 
+// x86-64 ABI: parameters beyond 6 are passed on stack, not supported
 #define CC_MAXPARAM     6
-#define CC_MAXCALLDEPTH 5
 
 // emulator capture states
 typedef enum _CaptureState {
@@ -99,6 +113,13 @@ typedef struct _MetaState {
 
 void initMetaState(MetaState* ms, CaptureState cs);
 
+// memory range read via a static address (CS_STATIC2) while emulating.
+// Code specialized for static values depends on the content of such ranges
+typedef struct _StaticRead {
+    uint64_t addr;
+    int len;
+} StaticRead;
+
 
 //
 // Rewriter Configuration
@@ -133,9 +154,16 @@ struct _FunctionConfig
     uint64_t start;
     int size;
 
-    // TODO: extended config for functions
+    // how to handle calls to this function
+    DBrewCallPolicy callPolicy;
+    uint64_t replacement;
 };
 
+// address interval [start, end[ of constant data
+typedef struct _MemInterval {
+    uint64_t start, end;
+} MemInterval;
+
 struct _CaptureConfig
 {
     // specialise for some parameters to be constant?
@@ -147,13 +175,22 @@ struct _CaptureConfig
     bool hasReturnFP;
     // number of parameters passed to function to rewrite
     int parCount;
-    // avoid unrolling at call depths
-    bool force_unknown[CC_MAXCALLDEPTH];
+    // avoid unrolling at call depths (growing on demand)
+    int forceUnknownCount;
+    bool* force_unknown;
     // all branches forced known
     bool branches_known;
+    // loop capturing, <loopCount> is factor for partial unrolling/peeling
+    DBrewLoopPolicy loopPolicy;
+    int loopCount;
+    // track content of non-stack memory written while emulating
+    bool trackMemory;
 
     // linked list of memory range and function configurations
     MemRangeConfig* range_configs;
+    // index of constant data ranges: sorted, merged intervals
+    int constRangeCount;
+    MemInterval* constRange;
 
 };
 
@@ -172,6 +209,9 @@ typedef enum _VectorizeReq {
 
 
 FunctionConfig* config_find_function(Rewriter* r, uint64_t f);
+bool config_force_unknown(CaptureConfig* cc, int depth);
+bool config_is_constant(CaptureConfig* cc, uint64_t addr, int len);
+void config_free(CaptureConfig* cc);
 
 
 
@@ -206,10 +246,26 @@ typedef struct _EmuValue {
 } EmuValue;
 
 
-#define MAX_CALLDEPTH 5
-
 // emulator state. for memory, use the real memory apart from stack
 
+// stack of emulator state is split into pages, shared copy-on-write
+#define STACKPAGE_SIZE 64
+
+// expression info of a stack byte, only kept where set
+typedef struct _StackExprInfo {
+    int off; // within page
+    ExprNode* range;
+    ExprNode* parDep;
+} StackExprInfo;
+
+typedef struct _StackPage {
+    int refCount;
+    uint8_t data[STACKPAGE_SIZE];
+    uint8_t cState[STACKPAGE_SIZE]; // CaptureState per byte
+    int infoCount, infoCapacity;
+    StackExprInfo* info; // 0 if infoCapacity is 0
+} StackPage;
+
 struct _EmuState;
 typedef struct _EmuState EmuState;
 
@@ -222,6 +278,11 @@ struct _EmuState {
     uint64_t reg[RI_GPMax];
     MetaState reg_state[RI_GPMax];
 
+    // vector registers xmm0 - xmm15: two lanes of 64 bit each.
+    // Upper halves of ymm registers are not tracked
+    uint64_t vreg[RI_XMMMax][2];
+    MetaState vreg_state[RI_XMMMax][2];
+
     // instruction pointer
     uint64_t regIP;
     MetaState regIP_state;
@@ -232,36 +293,100 @@ struct _EmuState {
     MetaState flag_state[FT_Max];
 
     // stack
-    int stackSize;
-    uint8_t* stack; // real memory backing
+    int stackSize; // multiple of STACKPAGE_SIZE
+    uint8_t* stackMem; // reserves address range, only in live state
     uint64_t stackStart, stackAccessed, stackTop; // virtual stack boundaries
-    // capture state of stack
-    MetaState *stackState;
-
-    // own return stack
-    uint64_t ret_stack[MAX_CALLDEPTH];
-    int depth;
+    // stack content with capture state, in pages shared among saved states.
+    // a page not yet written is 0 (zero bytes, DEAD)
+    StackPage** stackPage;
+    // running fingerprints of stack/shadow content, see esFingerprint()
+    uint64_t stackHash, memHash;
+    Arena* arena; // for new pages, pages live until the arena is reset
+
+    // shadow of non-stack memory written via static addresses (optional):
+    // hash table of copy-on-write pages keyed by page address
+    bool trackMem;
+    int memPageCount, memHashSize, memHashCapacity;
+    uint64_t* memPageAddr;
+    StackPage** memPage;
+
+    // own return stack, growing on demand
+    int depth, retStackCapacity;
+    uint64_t* ret_stack;
+
+    // log of memory reads via static addresses, for specialization cache.
+    // only used in the current state, not copied on save/restore
+    bool logStaticReads;
+    int staticReadCount, staticReadCapacity;
+    StaticRead* staticRead;
+    // false if captured code depends on data not in the log
+    bool staticReadsComplete;
+    // configuration to check for constant data, only in the current state
+    CaptureConfig* cc;
 
+    // body copy of a partially unrolled loop, 0 outside of such loops
+    int loopCopy;
 };
 
+// loop found while capturing: back-edge jumps to <head>, with the
+// jump instruction ending before <tail>
+typedef struct _LoopInfo {
+    uint64_t head, tail;
+    int backEdges; // taken since last entering the loop
+    bool rolled;   // kept rolled, registers changed in loop made dynamic
+    // static register values at last back-edge
+    bool regStatic[RI_GPMax];
+    uint64_t reg[RI_GPMax];
+    bool vregStatic[RI_XMMMax][2];
+    uint64_t vreg[RI_XMMMax][2];
+} LoopInfo;
+
+// constant in the pool behind generated code, loaded RIP-relative
+typedef struct _PoolConst {
+    uint64_t v[2];
+    int len; // 8 or 16 bytes
+    int off; // offset in pool, set when placing the pool
+} PoolConst;
+
+// reference from code of <cbb> to pool constant <idx>: offsets of the
+// 32-bit displacement and of the end of the referencing instruction
+typedef struct _PoolRef {
+    CBB* cbb;
+    int dispOff, endOff;
+    int idx;
+} PoolRef;
 
 struct _Rewriter {
 
-    // decoded instructions
+    // decoded instructions, in chunks growing on demand.
+    // decInstr is the current chunk, instructions of a BB stay together
     int decInstrCount, decInstrCapacity;
     Instr* decInstr;
-
-    // decoded basic blocks
-    int decBBCount, decBBCapacity;
-    DBB* decBB;
-
-    // captured instructions
-    int capInstrCount, capInstrCapacity;
+    int decInstrChunkCount;
+    Instr** decInstrChunk; // previous chunks
+
+    // decoded basic blocks in decoding order, growing on demand
+    int decBBCount, decBBCapacity, decBBAllocated;
+    DBB** decBB;
+    // hash index from address to decoded BB (open addressing)
+    int decBBHashSize;
+    DBB** decBBHash;
+
+    // transient data of the current rewrite: saved emulator states,
+    // captured BBs and instructions, expressions
+    Arena* arena;
+
+    // captured instructions, in arena chunks growing on demand.
+    // capInstr is the current chunk, instructions of a CBB stay together
+    int capInstrCount, capInstrCapacity, capInstrChunkSize;
     Instr* capInstr;
 
-    // captured basic blocks
+    // captured basic blocks in capture order, growing on demand
     int capBBCount, capBBCapacity;
-    CBB* capBB;
+    CBB** capBB;
+    // hash index from (address, esID) to captured BB (open addressing)
+    int capBBHashSize;
+    CBB** capBBHash;
     CBB* currentCapBB;
 
     // expressions for analysis
@@ -275,6 +400,15 @@ struct _Rewriter {
     CodeStorage* cs;
     uint64_t generatedCodeAddr;
     int generatedCodeSize;
+    // trailing part of generated code used for data (counters, constants)
+    int generatedDataSize;
+
+    // specialization cache (own one, or shared global one)
+    SpecCache* cache;
+    bool useGlobalCache;
+
+    // pending background rewrite, or 0
+    AsyncJob* job;
 
     // vectorization config
     VectorizeReq vreq;
@@ -283,24 +417,65 @@ struct _Rewriter {
     // structs for emulator & capture config
     CaptureConfig* cc;
     EmuState* es;
-    // saved emulator states
-#define SAVEDSTATE_MAX 20
-    int savedStateCount;
-    EmuState* savedState[SAVEDSTATE_MAX];
-
-    // stack of unfinished BBs to capture
-#define CAPTURESTACK_LEN 20
-    int capStackTop;
-    CBB* capStack[CAPTURESTACK_LEN];
-
-    // capture order
-#define GENORDER_MAX 20
-    int genOrderCount;
-    CBB* genOrder[GENORDER_MAX];
+    // saved emulator states, growing on demand
+    int savedStateCount, savedStateCapacity;
+    EmuState** savedState;
+    uint64_t* savedStateHash; // fingerprints of saved states
+    // hash index from fingerprint to esID+1 (open addressing, 0: empty)
+    int esHashSize;
+    int* esHash;
+
+    // stack of unfinished BBs to capture, growing on demand
+    int capStackTop, capStackCapacity;
+    CBB** capStack;
+
+    // loops found while capturing, growing on demand
+    int loopCount, loopCapacity;
+    LoopInfo* loop;
+
+    // capture order, growing on demand
+    int genOrderCount, genOrderCapacity;
+    CBB** genOrder;
+
+    // constant pool of the generated function, growing on demand
+    int poolCount, poolCapacity;
+    PoolConst* pool;
+    int poolRefCount, poolRefCapacity;
+    PoolRef* poolRef;
+
+    // profile-guided block layout: instrument generated code to count
+    // branch directions. <profiledCode> is the instrumented code of the
+    // last rewrite, 0 if none
+    bool doProfile;
+    uint64_t profiledCode;
+
+    // limits for capturing, no limit if 0
+    int maxCallDepth, maxSavedStates;
+
+    // budget for capturing, no limit if 0. When exhausted, the remaining
+    // paths are captured without further specialization.
+    // <budgetInstrs> is the instruction budget of the current capture run,
+    // lowered when retrying to meet <maxCodeSize>
+    int maxCapInstrs, maxCodeSize, maxMillis;
+    uint64_t maxEmuSteps;
+    int budgetInstrs, capturedInstrs;
+    uint64_t emuSteps, captureStart;
+    bool budgetExceeded;
+
+    // error of the current rewrite step. Kept per rewriter (instead of
+    // static storage) so that independent rewriters can run concurrently
+    Error error;
+    GenerateError generateError;
+    char errorDesc[100];
 
     // for optimization passes
     bool addInliningHints;
     bool doCopyPass; // test pass
+    bool doInlinedFramePass;
+    bool doStackToRegPass;
+    bool doStrengthReducePass;
+    bool doDeadCodePass;
+    bool doPeepholePass;
 
     // debug output
     bool showDecoding, showEmuState, showEmuSteps, showOptSteps;
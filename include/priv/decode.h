@@ -26,6 +26,10 @@
 
 typedef struct _DContext DContext;
 
+// allocate buffers for decoding if needed, and forget decoded BBs
+void resetDecoding(Rewriter* r);
+void freeDecoding(Rewriter* r);
+
 Instr* nextInstr(Rewriter* r, uint64_t a, int len);
 Instr* addSimple(Rewriter* r, DContext* c, InstrType it, ValType vt);
 Instr* addUnaryOp(Rewriter* r, DContext* c, InstrType it, Operand* o);
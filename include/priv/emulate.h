@@ -42,10 +42,10 @@
  * saving emulator state. After emulating one path, we roll back and
  * go the other path. As this may happen recursively, we do a kind of
  * back-tracking, with emulator states stored as stacks.
- * To allow for fast saving/restoring of emulator states, each part of
- * the emulation state (registers, bytes on stack) is given by a
- * EmuStateEntry (linked) list with the current value/state in front.
- * Saving copies the complete EmuState, inheriting the individual states.
+ * To allow for fast saving/restoring of emulator states, the stack is
+ * split into pages with reference counts, shared among the current and
+ * saved states. Saving/restoring only copies registers and page pointers,
+ * and a page is copied on first write to it while shared.
  */
 
 // exported functions
@@ -62,12 +62,17 @@ void printEmuState(EmuState* es);
 void printStaticEmuState(EmuState* es, int esID);
 
 void resetCapturing(Rewriter* r);
+void freeCapturing(Rewriter* r);
 CBB* getCaptureBB(RContext* c, uint64_t f, int esID);
 int pushCaptureBB(RContext *c, CBB* bb);
 CBB* popCaptureBB(Rewriter* r);
-Instr* newCapInstr(RContext *c);
+// space for <count> consecutive instructions
+Instr* newCapInstrs(Rewriter* r, int count);
 void capture(RContext* c, Instr* instr);
 void captureRet(RContext* c, Instr* orig, EmuState* es);
+// on static back-edge of a loop kept rolled, end CBB and return true
+bool captureBackEdge(RContext* c, Instr* instr, uint64_t target);
+void checkBudget(RContext* c);
 
 // clone a decoded BB as a CBB
 CBB* createCBBfromDBB(Rewriter* r, DBB* src);
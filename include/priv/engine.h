@@ -40,8 +40,14 @@ void initRewriter(Rewriter* r);
 void freeRewriter(Rewriter* r);
 
 // Rewrite engine
+Error* vGetParameters(Rewriter* r, va_list args, uint64_t* par);
+Error* emulateAndCapture(Rewriter* r, int parCount, uint64_t* par);
 Error* vEmulateAndCapture(Rewriter* r, va_list args);
 void runOptsOnCaptured(RContext *c);
 void generateBinaryFromCaptured(RContext* c);
+// regenerate last rewrite using edge counts from its profiled code
+void relayoutCaptured(RContext* c);
+// all steps of a rewrite, return generated code or original function
+uint64_t rewriteWithParameters(Rewriter* r, uint64_t* par);
 
 #endif // ENGINE_H
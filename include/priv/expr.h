@@ -15,6 +15,8 @@
 
 #include <stdint.h>
 
+#include "arena.h"
+
 typedef enum _NodeType {
     NT_Invalid, NT_Const, NT_Sum, NT_Scaled, NT_Par, NT_Ref
 } NodeType;
@@ -40,8 +42,8 @@ struct _ExprPool {
     ExprNode n[1];
 };
 
-ExprPool* expr_allocPool(int s);
-void expr_freePool(ExprPool* p);
+// pool with space for <s> nodes, living as long as arena <a>
+ExprPool* expr_allocPool(Arena* a, int s);
 ExprNode* expr_newNode(ExprPool* p, NodeType t);
 int expr_nodeIndex(ExprPool* p, ExprNode* n);
 
@@ -29,4 +29,11 @@ typedef struct _GContext GContext;
 // returns 0 on success
 GenerateError* generate(Rewriter* r, CBB* cbb);
 
+// maximal number of bytes generated for an instruction
+int generateMaxSize(Instr* instr);
+
+// constant pool behind generated code
+void resetConstPool(Rewriter* r);
+uint64_t placeConstPool(Rewriter* r, uint64_t addr);
+
 #endif // GENERATE_H
@@ -260,6 +260,13 @@ typedef enum _StateChange {
     SC_dstDyn // operand dst is valid, should change to dynamic
 } StateChange;
 
+// stack access of a captured instruction, annotated on capturing
+typedef enum _StackAccess {
+    SA_Unknown = 0, // not annotated: may access any stack byte
+    SA_None,        // no access to the stack of the rewritten function
+    SA_Slot         // memory operand or push/pop access a known slot
+} StackAccess;
+
 struct _Instr {
     InstrType type;
 
@@ -282,6 +289,10 @@ struct _Instr {
 
 
     ExprNode* info_memAddr; // annotate memory reference of instr
+
+    // with SA_Slot: offset from emulator stack start and length in bytes
+    StackAccess info_stack;
+    int info_stackOff, info_stackLen;
 };
 
 RegType getGPRegType(ValType vt);
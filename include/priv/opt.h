@@ -0,0 +1,51 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Optimization passes on captured code
+ *
+ * Passes run after capturing over all CBBs of a rewrite, before code
+ * generation. They may modify, add or delete captured instructions.
+ */
+
+#ifndef OPT_H
+#define OPT_H
+
+#include "common.h"
+#include "engine.h"
+
+// liveness analysis over the CBB graph for GP registers, flags and
+// stack bytes below a known offset from the stack pointer.
+// Deletes instructions whose results are never used
+void optPassDeadCode(RContext* c);
+
+// keep values of stack slots in free GP/XMM registers instead of memory,
+// using stack offsets annotated on capturing
+void optPassStackToReg(RContext* c);
+
+// remove saving/restoring of frame pointer in prologue/epilogue of
+// inlined functions, using the call/return hints
+void optPassInlinedFrames(RContext* c);
+
+// replace multiplication/division by constants with cheaper sequences
+void optPassStrengthReduce(RContext* c);
+
+// rewrite short instruction sequences using a table of rules
+void optPassPeephole(RContext* c);
+
+#endif // OPT_H
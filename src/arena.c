@@ -0,0 +1,118 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arena.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct _ArenaBlock ArenaBlock;
+
+struct _ArenaBlock {
+    int size, used;
+    ArenaBlock* next;
+    uint8_t* data;
+};
+
+struct _Arena {
+    int blockSize; // minimal size of a block
+    ArenaBlock* first;
+    ArenaBlock* current;
+};
+
+// largest size of a block when growing automatically
+#define BLOCK_MAXGROW (1 << 20)
+
+static
+ArenaBlock* allocArenaBlock(int size, ArenaBlock* next)
+{
+    ArenaBlock* b;
+
+    b = (ArenaBlock*) malloc(sizeof(ArenaBlock));
+    b->size = size;
+    b->used = 0;
+    b->next = next;
+    b->data = (uint8_t*) malloc(size);
+
+    return b;
+}
+
+Arena* arena_new(int blockSize)
+{
+    Arena* a;
+
+    assert(blockSize > 0);
+    a = (Arena*) malloc(sizeof(Arena));
+    a->blockSize = blockSize;
+    a->first = allocArenaBlock(blockSize, 0);
+    a->current = a->first;
+
+    return a;
+}
+
+void arena_free(Arena* a)
+{
+    ArenaBlock *b, *next;
+
+    if (!a) return;
+
+    for(b = a->first; b; b = next) {
+        next = b->next;
+        free(b->data);
+        free(b);
+    }
+    free(a);
+}
+
+void arena_reset(Arena* a)
+{
+    // following blocks are reset when getting current
+    a->current = a->first;
+    a->current->used = 0;
+}
+
+void* arena_alloc(Arena* a, int size)
+{
+    ArenaBlock* b = a->current;
+    int newSize;
+
+    size = (size + 15) & ~15;
+    if (b->used + size <= b->size) {
+        b->used += size;
+        return b->data + b->used - size;
+    }
+
+    // reuse next block if large enough, otherwise insert a new one
+    if (b->next && (b->next->size >= size)) {
+        b = b->next;
+    }
+    else {
+        newSize = 2 * b->size;
+        if (newSize > BLOCK_MAXGROW) newSize = BLOCK_MAXGROW;
+        if (newSize < a->blockSize) newSize = a->blockSize;
+        if (newSize < size) newSize = size;
+        b->next = allocArenaBlock(newSize, b->next);
+        b = b->next;
+    }
+    a->current = b;
+    b->used = size;
+
+    return b->data;
+}
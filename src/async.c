@@ -0,0 +1,109 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "async.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffers.h"
+#include "common.h"
+#include "engine.h"
+
+struct _AsyncJob {
+    Rewriter* r;
+    pthread_t thread;
+    uint64_t par[CC_MAXPARAM];
+    uint64_t* target; // jump target slot of the trampoline
+};
+
+// trampoline layout (16 bytes, aligned):
+//   0: jmp *2(%rip)    ; jump via slot at offset 8
+//   6: ud2             ; never reached
+//   8: target address
+#define TRAMPOLINE_SIZE 16
+
+static
+uint64_t* newTrampoline(Rewriter* r, uint64_t func)
+{
+    static const uint8_t code[8] = { 0xff, 0x25, 0x02, 0, 0, 0, 0x0f, 0x0b };
+    uint8_t* buf;
+    int off;
+
+    assert(r->cs != 0);
+    buf = reserveCodeStorage(r->cs, 2 * TRAMPOLINE_SIZE);
+    off = (uint64_t) buf & (TRAMPOLINE_SIZE - 1);
+    if (off > 0)
+        useCodeStorage(r->cs, TRAMPOLINE_SIZE - off);
+    buf = useCodeStorage(r->cs, TRAMPOLINE_SIZE);
+    commitCodeStorage(r->cs, (uint64_t) buf);
+
+    memcpy(buf, code, 8);
+    *((uint64_t*) (buf + 8)) = func;
+
+    return (uint64_t*) (buf + 8);
+}
+
+static
+void* runJob(void* arg)
+{
+    AsyncJob* job = (AsyncJob*) arg;
+    uint64_t code = rewriteWithParameters(job->r, job->par);
+
+    // aligned 8-byte stores are atomic: callers jumping via the
+    // trampoline see either the original or the new code
+    __atomic_store_n(job->target, code, __ATOMIC_RELEASE);
+    return 0;
+}
+
+uint64_t async_start(Rewriter* r, uint64_t* par)
+{
+    AsyncJob* job;
+    uint64_t trampoline;
+
+    async_wait(r);
+
+    job = (AsyncJob*) malloc(sizeof(AsyncJob));
+    job->r = r;
+    memcpy(job->par, par, sizeof(job->par));
+    job->target = newTrampoline(r, r->func);
+    trampoline = (uint64_t) job->target - 8;
+
+    if (pthread_create(&(job->thread), 0, runJob, job) != 0) {
+        // no thread available: rewrite synchronously
+        runJob(job);
+        free(job);
+        return trampoline;
+    }
+    r->job = job;
+
+    return trampoline;
+}
+
+uint64_t async_wait(Rewriter* r)
+{
+    if (r->job) {
+        pthread_join(r->job->thread, 0);
+        free(r->job);
+        r->job = 0;
+    }
+    return r->generatedCodeAddr;
+}
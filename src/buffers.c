@@ -26,11 +26,15 @@
 #include <sys/mman.h>
 
 
-CodeStorage* initCodeStorage(int size)
+// largest size of a chunk when growing automatically
+#define CHUNK_MAXGROW (1 << 20)
+
+static
+CodeChunk* allocCodeChunk(int size)
 {
     int fullsize;
     uint8_t* buf;
-    CodeStorage* cs;
+    CodeChunk* cc;
 
     /* round up size to multiple of a page size */
     fullsize = (size + 4095) & ~4095;
@@ -46,42 +50,157 @@ CodeStorage* initCodeStorage(int size)
         exit(1);
     }
 
+    cc = (CodeChunk*) malloc(sizeof(CodeChunk));
+    cc->fullsize = fullsize;
+    cc->used = 0;
+    cc->live = 0;
+    cc->startCapacity = 0;
+    cc->start = 0;
+    cc->buf = buf;
+    cc->next = 0;
+
+    //fprintf(stderr, "Allocated Code Chunk (size %d)\n", fullsize);
+
+    return cc;
+}
+
+static
+void freeCodeChunk(CodeChunk* cc)
+{
+    munmap(cc->buf, cc->fullsize);
+    free(cc->start);
+    free(cc);
+}
+
+CodeStorage* initCodeStorage(int size)
+{
+    CodeStorage* cs;
+
     cs = (CodeStorage*) malloc(sizeof(CodeStorage));
     cs->size = size;
-    cs->fullsize = fullsize;
-    cs->buf = buf;
-    cs->used = 0;
-
-    //fprintf(stderr, "Allocated Code Storage (size %d)\n", fullsize);
+    cs->chunk = allocCodeChunk(size);
+    cs->chunkCount = 1;
 
     return cs;
 }
 
 void freeCodeStorage(CodeStorage* cs)
 {
-    if (cs)
-        munmap(cs->buf, cs->fullsize);
+    CodeChunk *cc, *next;
+
+    if (!cs) return;
+
+    for(cc = cs->chunk; cc; cc = next) {
+        next = cc->next;
+        freeCodeChunk(cc);
+    }
     free(cs);
 }
 
-/* this checks whether enough storage is available, but does
- * not change <used>.
+/* this checks whether enough storage is available in the current chunk,
+ * but does not change <used>. If not, a new chunk is started.
  */
 uint8_t* reserveCodeStorage(CodeStorage* cs, int size)
 {
-    if (cs->fullsize - cs->used < size) {
-        fprintf(stderr,
-                "Error: CodeStorage (size %d) too small: used %d, need %d\n",
-                cs->fullsize, cs->used, size);
-        exit(1);
+    CodeChunk* cc = cs->chunk;
+    int newSize;
+
+    if (cc->fullsize - cc->used >= size)
+        return cc->buf + cc->used;
+
+    if (cc->live == 0) {
+        // nothing in use: reuse or replace current chunk
+        cc->used = 0;
+        if (cc->fullsize >= size)
+            return cc->buf;
+        cs->chunk = cc->next;
+        cs->chunkCount--;
+        freeCodeChunk(cc);
+        cc = cs->chunk;
     }
-    return cs->buf + cs->used;
+
+    // grow chunk sizes with number of chunks in use
+    newSize = cs->size;
+    if (cc && (2 * cc->fullsize > newSize))
+        newSize = 2 * cc->fullsize;
+    if (newSize > CHUNK_MAXGROW)
+        newSize = (cs->size > CHUNK_MAXGROW) ? cs->size : CHUNK_MAXGROW;
+    if (newSize < size)
+        newSize = size;
+
+    cc = allocCodeChunk(newSize);
+    cc->next = cs->chunk;
+    cs->chunk = cc;
+    cs->chunkCount++;
+
+    return cc->buf;
 }
 
 uint8_t* useCodeStorage(CodeStorage* cs, int size)
 {
-    uint8_t* p = cs->buf + cs->used;
-    assert(cs->fullsize - cs->used >= size);
-    cs->used += size;
+    CodeChunk* cc = cs->chunk;
+    uint8_t* p = cc->buf + cc->used;
+    assert(cc->fullsize - cc->used >= size);
+    cc->used += size;
     return p;
 }
+
+/* set start of unused space in current chunk back to <p> */
+void resetCodeStorage(CodeStorage* cs, uint8_t* p)
+{
+    CodeChunk* cc = cs->chunk;
+    assert((p >= cc->buf) && (p <= cc->buf + cc->used));
+    cc->used = p - cc->buf;
+}
+
+/* mark code of a function starting at <start> in current chunk as being
+ * in use
+ */
+void commitCodeStorage(CodeStorage* cs, uint64_t start)
+{
+    CodeChunk* cc = cs->chunk;
+
+    assert((start >= (uint64_t) cc->buf) &&
+           (start < (uint64_t) cc->buf + cc->used));
+    if (cc->live == cc->startCapacity) {
+        cc->startCapacity = cc->startCapacity ? 2 * cc->startCapacity : 16;
+        cc->start = (uint64_t*) realloc(cc->start,
+                                        sizeof(uint64_t) * cc->startCapacity);
+    }
+    cc->start[cc->live++] = start;
+}
+
+/* release a function committed before, given by its start address.
+ * Returns false if <addr> is not the start of a function in use.
+ */
+bool releaseCodeStorage(CodeStorage* cs, uint64_t addr)
+{
+    CodeChunk *cc, **prev;
+    int i;
+
+    prev = &(cs->chunk);
+    for(cc = cs->chunk; cc; prev = &(cc->next), cc = cc->next) {
+        if ((addr < (uint64_t) cc->buf) ||
+            (addr >= (uint64_t) cc->buf + cc->used)) continue;
+
+        // ignore addresses within functions and functions released before
+        for(i = 0; i < cc->live; i++)
+            if (cc->start[i] == addr) break;
+        if (i == cc->live) return false;
+
+        cc->start[i] = cc->start[--cc->live];
+        if (cc->live > 0) return true;
+
+        if (cc == cs->chunk) {
+            // current chunk: reuse space
+            cc->used = 0;
+        }
+        else {
+            *prev = cc->next;
+            cs->chunkCount--;
+            freeCodeChunk(cc);
+        }
+        return true;
+    }
+    return false;
+}
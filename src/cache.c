@@ -0,0 +1,422 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cache.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffers.h"
+#include "common.h"
+
+typedef struct _CacheEntry CacheEntry;
+
+struct _CacheEntry {
+    // key: function, config and values of static parameters
+    uint64_t func;
+    uint64_t configHash;
+    uint64_t par[CC_MAXPARAM];
+    uint64_t keyHash;
+
+    // memory ranges read via static addresses, with hash over content
+    int readCount;
+    StaticRead* read;
+    uint64_t readHash;
+
+    // code in cache storage
+    uint64_t code;
+    int codeSize, dataSize;
+
+    CacheEntry* next; // chain in hash bucket
+};
+
+struct _SpecCache {
+    // the global cache is shared among rewriters in different threads
+    pthread_mutex_t lock;
+
+    int entryCount, entryCapacity;
+    int staleCount; // entries dropped, but space not reclaimed
+    CacheEntry* entry;
+
+    // hash table, bucketCount is power of 2
+    int bucketCount;
+    CacheEntry** bucket;
+
+    // code storage, with bytes used by entries bounded
+    CodeStorage* cs;
+    int codeUsed, codeCapacity;
+
+    // statistics
+    uint64_t hits, misses, inserts, invalidations, flushes;
+};
+
+static SpecCache* globalCache = 0;
+static pthread_once_t globalCacheOnce = PTHREAD_ONCE_INIT;
+
+// FNV-1a, 8 bytes at once
+static
+uint64_t hashAdd(uint64_t h, uint64_t v)
+{
+    int i;
+
+    for(i = 0; i < 8; i++) {
+        h ^= v & 0xff;
+        h *= 0x100000001b3ULL;
+        v = v >> 8;
+    }
+    return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+static
+uint64_t hashReads(int count, StaticRead* read)
+{
+    uint64_t h = HASH_INIT;
+    int i, j;
+
+    for(i = 0; i < count; i++) {
+        uint8_t* p = (uint8_t*) read[i].addr;
+
+        h = hashAdd(h, read[i].addr);
+        h = hashAdd(h, read[i].len);
+        for(j = 0; j < read[i].len; j++) {
+            h ^= p[j];
+            h *= 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+
+// hash over configuration options influencing generated code
+static
+uint64_t configHash(Rewriter* r)
+{
+    CaptureConfig* cc = r->cc;
+    MemRangeConfig* mrc;
+    uint64_t h = HASH_INIT;
+    int i;
+
+    h = hashAdd(h, r->vreq);
+    h = hashAdd(h, r->vectorsize);
+    h = hashAdd(h, cc->parCount);
+    h = hashAdd(h, cc->hasReturnFP);
+    for(i = 0; i < CC_MAXPARAM; i++)
+        h = hashAdd(h, cc->par_state[i].cState);
+    for(i = 0; i < cc->forceUnknownCount; i++)
+        h = hashAdd(h, cc->force_unknown[i]);
+    h = hashAdd(h, cc->loopPolicy);
+    h = hashAdd(h, cc->loopCount);
+    h = hashAdd(h, cc->trackMemory);
+    for(mrc = cc->range_configs; mrc; mrc = mrc->next) {
+        FunctionConfig* fc = (FunctionConfig*) mrc;
+        if ((mrc->type != MR_Function) ||
+            (fc->callPolicy == DBREW_CALL_INLINE)) continue;
+        h = hashAdd(h, fc->start);
+        h = hashAdd(h, fc->callPolicy);
+        h = hashAdd(h, fc->replacement);
+    }
+    h = hashAdd(h, r->maxCallDepth);
+    h = hashAdd(h, r->maxCapInstrs);
+    h = hashAdd(h, r->maxCodeSize);
+    h = hashAdd(h, r->maxEmuSteps);
+    h = hashAdd(h, r->maxMillis);
+
+    return h;
+}
+
+// only values of static parameters are part of the key
+static
+void keyPars(Rewriter* r, uint64_t* par, uint64_t* key)
+{
+    CaptureConfig* cc = r->cc;
+    int i;
+
+    for(i = 0; i < CC_MAXPARAM; i++) {
+        CaptureState s = cc->par_state[i].cState;
+        if ((i < cc->parCount) && ((s == CS_STATIC) || (s == CS_STATIC2)))
+            key[i] = par[i];
+        else
+            key[i] = 0;
+    }
+}
+
+static
+uint64_t keyHash(uint64_t func, uint64_t cHash, uint64_t* key)
+{
+    uint64_t h = HASH_INIT;
+    int i;
+
+    h = hashAdd(h, func);
+    h = hashAdd(h, cHash);
+    for(i = 0; i < CC_MAXPARAM; i++)
+        h = hashAdd(h, key[i]);
+
+    return h;
+}
+
+static
+int cmpStaticRead(const void* p1, const void* p2)
+{
+    const StaticRead* r1 = (const StaticRead*) p1;
+    const StaticRead* r2 = (const StaticRead*) p2;
+
+    if (r1->addr < r2->addr) return -1;
+    if (r1->addr > r2->addr) return 1;
+    return 0;
+}
+
+// sort and merge overlapping ranges in-place, return new count
+static
+int normalizeReads(int count, StaticRead* read)
+{
+    int i, j;
+
+    if (count == 0) return 0;
+
+    qsort(read, count, sizeof(StaticRead), cmpStaticRead);
+    j = 0;
+    for(i = 1; i < count; i++) {
+        uint64_t end = read[j].addr + read[j].len;
+        if (read[i].addr <= end) {
+            if (read[i].addr + read[i].len > end)
+                read[j].len = read[i].addr + read[i].len - read[j].addr;
+            continue;
+        }
+        j++;
+        read[j] = read[i];
+    }
+    return j + 1;
+}
+
+SpecCache* cache_new(int entries, int codeCapacity)
+{
+    SpecCache* sc;
+    int i;
+
+    // defaults
+    if (entries <= 0) entries = 64;
+    if (codeCapacity <= 0) codeCapacity = 65536;
+
+    sc = (SpecCache*) malloc(sizeof(SpecCache));
+    pthread_mutex_init(&(sc->lock), 0);
+    sc->entryCapacity = entries;
+    sc->entryCount = 0;
+    sc->staleCount = 0;
+    sc->entry = (CacheEntry*) malloc(sizeof(CacheEntry) * entries);
+
+    sc->bucketCount = 16;
+    while(sc->bucketCount < 2 * entries)
+        sc->bucketCount *= 2;
+    sc->bucket = (CacheEntry**) malloc(sizeof(CacheEntry*) * sc->bucketCount);
+    for(i = 0; i < sc->bucketCount; i++)
+        sc->bucket[i] = 0;
+
+    sc->cs = initCodeStorage(codeCapacity);
+    sc->codeUsed = 0;
+    sc->codeCapacity = codeCapacity;
+
+    sc->hits = 0;
+    sc->misses = 0;
+    sc->inserts = 0;
+    sc->invalidations = 0;
+    sc->flushes = 0;
+
+    return sc;
+}
+
+// requires lock to be held
+static
+void flushEntries(SpecCache* sc)
+{
+    int i;
+
+    for(i = 0; i < sc->entryCount; i++) {
+        free(sc->entry[i].read);
+        releaseCodeStorage(sc->cs, sc->entry[i].code);
+    }
+    sc->entryCount = 0;
+    sc->staleCount = 0;
+    for(i = 0; i < sc->bucketCount; i++)
+        sc->bucket[i] = 0;
+    sc->codeUsed = 0;
+    sc->flushes++;
+}
+
+void cache_flush(SpecCache* sc)
+{
+    pthread_mutex_lock(&(sc->lock));
+    flushEntries(sc);
+    pthread_mutex_unlock(&(sc->lock));
+}
+
+void cache_free(SpecCache* sc)
+{
+    int i;
+
+    if (!sc) return;
+
+    for(i = 0; i < sc->entryCount; i++)
+        free(sc->entry[i].read);
+    free(sc->entry);
+    free(sc->bucket);
+    freeCodeStorage(sc->cs);
+    pthread_mutex_destroy(&(sc->lock));
+    free(sc);
+}
+
+void cache_stats(SpecCache* sc, int* entries,
+                 uint64_t* hits, uint64_t* misses)
+{
+    if (sc) pthread_mutex_lock(&(sc->lock));
+    if (entries) *entries = sc ? sc->entryCount - sc->staleCount : 0;
+    if (hits) *hits = sc ? sc->hits : 0;
+    if (misses) *misses = sc ? sc->misses : 0;
+    if (sc) pthread_mutex_unlock(&(sc->lock));
+}
+
+static
+void initGlobalCache(void)
+{
+    globalCache = cache_new(256, 1 << 20);
+}
+
+SpecCache* cache_global(void)
+{
+    pthread_once(&globalCacheOnce, initGlobalCache);
+
+    return globalCache;
+}
+
+bool cache_enabled(Rewriter* r)
+{
+    if (!r->cache || !r->cc) return false;
+    // branch directions may depend on values of dynamic data
+    if (r->cc->branches_known) return false;
+    // instrumented code must not be shared, and gets replaced on relayout
+    if (r->doProfile) return false;
+
+    return true;
+}
+
+bool cache_lookup(Rewriter* r, uint64_t* par)
+{
+    SpecCache* sc = r->cache;
+    CacheEntry *e, **prev;
+    uint64_t key[CC_MAXPARAM];
+    uint64_t cHash, kHash;
+    int i;
+
+    assert(cache_enabled(r));
+
+    cHash = configHash(r);
+    keyPars(r, par, key);
+    kHash = keyHash(r->func, cHash, key);
+
+    pthread_mutex_lock(&(sc->lock));
+    prev = &(sc->bucket[kHash & (sc->bucketCount - 1)]);
+    for(e = *prev; e; prev = &(e->next), e = e->next) {
+        if ((e->keyHash != kHash) || (e->func != r->func) ||
+            (e->configHash != cHash))
+            continue;
+        for(i = 0; i < CC_MAXPARAM; i++)
+            if (e->par[i] != key[i]) break;
+        if (i < CC_MAXPARAM) continue;
+
+        if (hashReads(e->readCount, e->read) != e->readHash) {
+            // data read via static pointers changed: drop entry.
+            // its code may still be in use, so release it on next flush
+            *prev = e->next;
+            sc->staleCount++;
+            sc->invalidations++;
+            break;
+        }
+
+        sc->hits++;
+        r->generatedCodeAddr = e->code;
+        r->generatedCodeSize = e->codeSize;
+        r->generatedDataSize = e->dataSize;
+        pthread_mutex_unlock(&(sc->lock));
+        if (r->showEmuSteps)
+            printf("Specialization cache hit for %lx\n", r->func);
+        return true;
+    }
+    sc->misses++;
+    pthread_mutex_unlock(&(sc->lock));
+
+    return false;
+}
+
+void cache_insert(Rewriter* r, uint64_t* par)
+{
+    SpecCache* sc = r->cache;
+    EmuState* es = r->es;
+    CacheEntry* e;
+    uint8_t* buf;
+    int size, b;
+
+    assert(cache_enabled(r));
+    if (!es->staticReadsComplete) return;
+    if (r->generatedCodeAddr == r->func) return; // rewriting failed
+
+    // keep alignment of generated code
+    size = (r->generatedCodeSize + 63) & ~63;
+    if (size > sc->codeCapacity) return;
+
+    pthread_mutex_lock(&(sc->lock));
+    if ((sc->entryCount == sc->entryCapacity) ||
+        (sc->codeUsed + size > sc->codeCapacity))
+        flushEntries(sc);
+
+    e = &(sc->entry[sc->entryCount++]);
+    e->func = r->func;
+    e->configHash = configHash(r);
+    keyPars(r, par, e->par);
+    e->keyHash = keyHash(e->func, e->configHash, e->par);
+
+    e->readCount = normalizeReads(es->staticReadCount, es->staticRead);
+    e->read = (StaticRead*) malloc(sizeof(StaticRead) * e->readCount);
+    memcpy(e->read, es->staticRead, sizeof(StaticRead) * e->readCount);
+    e->readHash = hashReads(e->readCount, e->read);
+
+    // generated code only uses relative jumps, absolute data addresses and
+    // RIP-relative access to its own trailing data, so it can be moved.
+    // Cache-owned code survives its rewriter
+    reserveCodeStorage(sc->cs, size);
+    buf = useCodeStorage(sc->cs, size);
+    commitCodeStorage(sc->cs, (uint64_t) buf);
+    sc->codeUsed += size;
+    memcpy(buf, (void*) r->generatedCodeAddr, r->generatedCodeSize);
+    e->code = (uint64_t) buf;
+    e->codeSize = r->generatedCodeSize;
+    e->dataSize = r->generatedDataSize;
+
+    // original code is not used any more
+    releaseCodeStorage(r->cs, r->generatedCodeAddr);
+
+    b = e->keyHash & (sc->bucketCount - 1);
+    e->next = sc->bucket[b];
+    sc->bucket[b] = e;
+    sc->inserts++;
+    r->generatedCodeAddr = e->code;
+    pthread_mutex_unlock(&(sc->lock));
+}
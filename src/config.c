@@ -30,13 +30,17 @@ void cc_init(CaptureConfig* cc)
         initMetaState(&(cc->par_state[i]), CS_DYNAMIC);
     for(int i=0; i < CC_MAXPARAM; i++)
         cc->par_name[i] = 0;
-    for(int i=0; i < CC_MAXCALLDEPTH; i++)
-        cc->force_unknown[i] = false;
+    cc->forceUnknownCount = 0;
+    cc->force_unknown = 0;
     cc->hasReturnFP = false;
     cc->parCount = -1; // unknown
     cc->branches_known = false;
+    cc->loopPolicy = DBREW_LOOP_UNROLL;
+    cc->loopCount = 1;
+    cc->trackMemory = false;
     cc->range_configs = 0;
-
+    cc->constRangeCount = 0;
+    cc->constRange = 0;
 }
 
 static
@@ -46,6 +50,7 @@ void cc_free(CaptureConfig* cc)
 
     for(int i=0; i < CC_MAXPARAM; i++)
         free(cc->par_name[i]);
+    free(cc->force_unknown);
 
     MemRangeConfig* fc = cc->range_configs;
     while(fc) {
@@ -53,6 +58,7 @@ void cc_free(CaptureConfig* cc)
         free(fc);
         fc = next;
     }
+    free(cc->constRange);
     free(cc);
 }
 
@@ -86,6 +92,8 @@ MemRangeConfig* mrc_new(MemRangeType type, char* name,
 
     if (type == MR_Function) {
         FunctionConfig* fc = (FunctionConfig*) malloc(sizeof(FunctionConfig));
+        fc->callPolicy = DBREW_CALL_INLINE;
+        fc->replacement = 0;
         mrc = (MemRangeConfig*) fc;
     }
     else
@@ -120,6 +128,50 @@ MemRangeConfig* mrc_find(CaptureConfig* cc, MemRangeType type, uint64_t addr)
     return 0;
 }
 
+static
+int cmpInterval(const void* a, const void* b)
+{
+    const MemInterval* i1 = (const MemInterval*) a;
+    const MemInterval* i2 = (const MemInterval*) b;
+
+    if (i1->start != i2->start) return (i1->start < i2->start) ? -1 : 1;
+    return 0;
+}
+
+// rebuild index of constant data ranges: sorted by start address,
+// with overlapping and adjacent ranges merged
+static
+void mrc_index(CaptureConfig* cc)
+{
+    MemRangeConfig* mrc;
+    int i, n = 0;
+
+    for(mrc = cc->range_configs; mrc; mrc = mrc->next)
+        if ((mrc->type == MR_ConstantData) && (mrc->size > 0)) n++;
+
+    free(cc->constRange);
+    cc->constRange = (MemInterval*) malloc(sizeof(MemInterval) * (n + 1));
+    n = 0;
+    for(mrc = cc->range_configs; mrc; mrc = mrc->next) {
+        if ((mrc->type != MR_ConstantData) || (mrc->size <= 0)) continue;
+        cc->constRange[n].start = mrc->start;
+        cc->constRange[n].end = mrc->start + mrc->size;
+        n++;
+    }
+    qsort(cc->constRange, n, sizeof(MemInterval), cmpInterval);
+
+    cc->constRangeCount = (n > 0) ? 1 : 0;
+    for(i = 1; i < n; i++) {
+        MemInterval* last = &(cc->constRange[cc->constRangeCount - 1]);
+        if (cc->constRange[i].start <= last->end) {
+            if (cc->constRange[i].end > last->end)
+                last->end = cc->constRange[i].end;
+            continue;
+        }
+        cc->constRange[cc->constRangeCount++] = cc->constRange[i];
+    }
+}
+
 static
 FunctionConfig* fc_get(CaptureConfig* cc, uint64_t func)
 {
@@ -147,6 +199,38 @@ FunctionConfig* config_find_function(Rewriter* r, uint64_t f)
     return 0;
 }
 
+bool config_force_unknown(CaptureConfig* cc, int depth)
+{
+    if (depth >= cc->forceUnknownCount) return false;
+    return cc->force_unknown[depth];
+}
+
+// is [addr, addr+len[ completely inside of registered constant data?
+bool config_is_constant(CaptureConfig* cc, uint64_t addr, int len)
+{
+    int lo, hi, mid;
+
+    if (!cc || (cc->constRangeCount == 0)) return false;
+
+    // binary search for last interval starting at or before <addr>
+    lo = 0;
+    hi = cc->constRangeCount;
+    while(hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (cc->constRange[mid].start <= addr)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (addr < cc->constRange[lo].start) return false;
+    return (addr + len <= cc->constRange[lo].end);
+}
+
+void config_free(CaptureConfig* cc)
+{
+    cc_free(cc);
+}
+
 
 //---------------------------------------------------------------------
 // DBrew API functions for configuration
@@ -187,7 +271,15 @@ void dbrew_config_force_unknown(Rewriter* r, int depth)
 {
     CaptureConfig* cc = cc_get(r);
 
-    assert((depth >= 0) && (depth < CC_MAXCALLDEPTH));
+    assert(depth >= 0);
+    if (depth >= cc->forceUnknownCount) {
+        int count = depth + 1;
+        cc->force_unknown = (bool*) realloc(cc->force_unknown,
+                                            sizeof(bool) * count);
+        for(int i = cc->forceUnknownCount; i < count; i++)
+            cc->force_unknown[i] = false;
+        cc->forceUnknownCount = count;
+    }
     cc->force_unknown[depth] = true;
 }
 
@@ -209,6 +301,33 @@ void dbrew_config_branches_known(Rewriter* r, bool b)
     cc->branches_known = b;
 }
 
+void dbrew_config_trackmem(Rewriter* r, bool b)
+{
+    CaptureConfig* cc = cc_get(r);
+    cc->trackMemory = b;
+}
+
+void dbrew_config_loops(Rewriter* r, DBrewLoopPolicy policy, int n)
+{
+    CaptureConfig* cc = cc_get(r);
+
+    assert(n > 0);
+    cc->loopPolicy = policy;
+    cc->loopCount = n;
+}
+
+void dbrew_config_function_setcall(Rewriter* r, uint64_t f,
+                                   DBrewCallPolicy policy,
+                                   uint64_t replacement)
+{
+    CaptureConfig* cc = cc_get(r);
+    FunctionConfig* fc = fc_get(cc, f);
+
+    assert((policy != DBREW_CALL_REPLACE) || (replacement != 0));
+    fc->callPolicy = policy;
+    fc->replacement = replacement;
+}
+
 void dbrew_config_function_setname(Rewriter* r, uint64_t f, const char* name)
 {
     CaptureConfig* cc = cc_get(r);
@@ -234,4 +353,6 @@ void dbrew_config_set_memrange(Rewriter* r, char* name, bool isWritable,
     mrc = mrc_new(isWritable ? MR_MutableData : MR_ConstantData,
                   name, start, size, cc->range_configs, cc);
     cc->range_configs = mrc;
+    if (!isWritable)
+        mrc_index(cc);
 }
@@ -24,7 +24,9 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include "async.h"
 #include "buffers.h"
+#include "cache.h"
 #include "common.h"
 #include "instr.h"
 #include "printer.h"
@@ -60,7 +62,7 @@ void dbrew_decode_print(Rewriter* r, uint64_t f, int count)
     DBB* dbb;
     int decoded = 0;
 
-    r->decBBCount = 0;
+    resetDecoding(r);
     while(decoded < count) {
         dbb = dbrew_decode(r, f + decoded);
         decoded += dbb->size;
@@ -72,31 +74,42 @@ void dbrew_decode_print(Rewriter* r, uint64_t f, int count)
 void dbrew_set_decoding_capacity(Rewriter* r,
                                  int instrCapacity, int bbCapacity)
 {
+    // capacities are initial sizes, buffers grow on demand
+    freeDecoding(r);
     r->decInstrCapacity = instrCapacity;
-    free(r->decInstr);
-    r->decInstr = 0;
-
     r->decBBCapacity = bbCapacity;
-    free(r->decBB);
-    r->decBB = 0;
 }
 
 void dbrew_set_capture_capacity(Rewriter* r,
                                 int instrCapacity, int bbCapacity,
                                 int codeCapacity)
 {
+    // capacities are initial sizes, buffers grow on demand
     r->capInstrCapacity = instrCapacity;
-    free(r->capInstr);
-    r->capInstr = 0;
 
+    freeCapturing(r);
     r->capBBCapacity = bbCapacity;
-    free(r->capBB);
-    r->capBB = 0;
 
-    if (r->cs)
-        freeCodeStorage(r->cs);
-    r->cs = 0;
+    // code generated before stays valid, new chunks use the new size
     r->capCodeCapacity = codeCapacity;
+    if (r->cs && (codeCapacity > 0))
+        r->cs->size = codeCapacity;
+}
+
+void dbrew_set_capture_limits(Rewriter* r,
+                              int maxCallDepth, int maxSavedStates)
+{
+    r->maxCallDepth = maxCallDepth;
+    r->maxSavedStates = maxSavedStates;
+}
+
+void dbrew_set_capture_budget(Rewriter* r, int maxInstrs, int maxCodeSize,
+                              uint64_t maxSteps, int maxMillis)
+{
+    r->maxCapInstrs = maxInstrs;
+    r->maxCodeSize = maxCodeSize;
+    r->maxEmuSteps = maxSteps;
+    r->maxMillis = maxMillis;
 }
 
 
@@ -139,6 +152,18 @@ int dbrew_generated_size(Rewriter* r)
     return r->generatedCodeSize;
 }
 
+int dbrew_generated_data_size(Rewriter* r)
+{
+    return r->generatedDataSize;
+}
+
+void dbrew_release_code(Rewriter* r, uint64_t code)
+{
+    // ignore original functions and code owned by specialization cache
+    if (r->cs)
+        releaseCodeStorage(r->cs, code);
+}
+
 int dbrew_set_vectorsize(Rewriter* r, int s)
 {
     int m = maxVectorBytes();
@@ -149,10 +174,70 @@ int dbrew_set_vectorsize(Rewriter* r, int s)
     return s;
 }
 
+void dbrew_cache_enable(Rewriter* r, int entries, int codeCapacity)
+{
+    dbrew_cache_disable(r);
+    r->cache = cache_new(entries, codeCapacity);
+}
+
+void dbrew_cache_enable_global(Rewriter* r)
+{
+    dbrew_cache_disable(r);
+    r->cache = cache_global();
+    r->useGlobalCache = true;
+}
+
+void dbrew_cache_disable(Rewriter* r)
+{
+    if (!r->useGlobalCache)
+        cache_free(r->cache);
+    r->cache = 0;
+    r->useGlobalCache = false;
+}
+
+void dbrew_cache_flush(Rewriter* r)
+{
+    if (r->cache)
+        cache_flush(r->cache);
+}
+
+void dbrew_cache_stats(Rewriter* r, int* entries,
+                       uint64_t* hits, uint64_t* misses)
+{
+    cache_stats(r->cache, entries, hits, misses);
+}
+
+void dbrew_profile_enable(Rewriter* r, bool instrument)
+{
+    r->doProfile = instrument;
+}
+
+uint64_t dbrew_profile_relayout(Rewriter* r)
+{
+    RContext c;
+
+    async_wait(r);
+    if (r->profiledCode == 0)
+        return r->generatedCodeAddr;
+
+    c.r = r;
+    c.e = 0;
+    relayoutCaptured(&c);
+    if (c.e) {
+        // keep using the instrumented code
+        logError(c.e, (char*) "Stopped relayout; return profiled code");
+        r->generatedCodeAddr = r->profiledCode;
+    }
+    r->profiledCode = 0;
+
+    return r->generatedCodeAddr;
+}
+
 //-----------------------------------------------------------------
 // convenience functions, using defaults
 
-Rewriter* defaultRewriter = 0;
+// one default rewriter per thread
+static __thread Rewriter* defaultRewriter = 0;
 
 static
 Rewriter* getDefaultRewriter(void)
@@ -186,32 +271,48 @@ uint64_t dbrew_rewrite(Rewriter* r, ...)
 {
     va_list argptr;
     Error* e;
+    uint64_t par[CC_MAXPARAM];
+
+    async_wait(r);
 
     va_start(argptr, r);
-    e = vEmulateAndCapture(r, argptr);
+    e = vGetParameters(r, argptr, par);
     va_end(argptr);
 
-    if (!e) {
-        RContext c;
-        c.r = r;
-        c.e = 0;
-
-        if (r->vreq != VR_None)
-            runVectorization(&c);
-        if (!c.e)
-            runOptsOnCaptured(&c);
-        if (!c.e)
-            generateBinaryFromCaptured(&c);
-        e = c.e;
+    if (e) {
+        // on error, return original function
+        logError(e, (char*) "Stopped rewriting; return original");
+        r->generatedCodeAddr = r->func;
+        return r->func;
     }
 
+    return rewriteWithParameters(r, par);
+}
+
+uint64_t dbrew_rewrite_async(Rewriter* r, ...)
+{
+    va_list argptr;
+    Error* e;
+    uint64_t par[CC_MAXPARAM];
+
+    async_wait(r);
+
+    va_start(argptr, r);
+    e = vGetParameters(r, argptr, par);
+    va_end(argptr);
+
     if (e) {
-        // on error, return original function
         logError(e, (char*) "Stopped rewriting; return original");
         r->generatedCodeAddr = r->func;
+        return r->func;
     }
 
-    return r->generatedCodeAddr;
+    return async_start(r, par);
+}
+
+uint64_t dbrew_rewrite_wait(Rewriter* r)
+{
+    return async_wait(r);
 }
 
 uint64_t dbrew_rewrite_func(uint64_t f, ...)
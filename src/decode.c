@@ -31,7 +31,9 @@
 #include "decode.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -72,14 +74,171 @@ struct _DContext {
     // decoding result
     bool exit;   // control flow change instruction detected
     DecodeError error; // if not-null, an decoding error was detected
+    char errorDesc[64]; // description referenced by error
 };
 
-// returns 0 if decoding buffer full
+//---------------------------------------------------------------
+// buffers for decoded instructions and BBs
+
+static
+void resetDecodedBBHash(Rewriter* r, int size)
+{
+    int i;
+
+    if (r->decBBHashSize != size) {
+        free(r->decBBHash);
+        r->decBBHashSize = size;
+        r->decBBHash = (DBB**) malloc(sizeof(DBB*) * size);
+    }
+    for(i = 0; i < size; i++)
+        r->decBBHash[i] = 0;
+}
+
+void resetDecoding(Rewriter* r)
+{
+    int i, size;
+
+    if (r->decInstr == 0) {
+        // default
+        if (r->decInstrCapacity == 0) r->decInstrCapacity = 500;
+        r->decInstr = (Instr*) malloc(sizeof(Instr) * r->decInstrCapacity);
+    }
+    r->decInstrCount = 0;
+    // the current chunk is the largest one, drop previous chunks
+    for(i = 0; i < r->decInstrChunkCount; i++)
+        free(r->decInstrChunk[i]);
+    r->decInstrChunkCount = 0;
+
+    if (r->decBB == 0) {
+        // default
+        if (r->decBBCapacity == 0) r->decBBCapacity = 50;
+        r->decBB = (DBB**) malloc(sizeof(DBB*) * r->decBBCapacity);
+        r->decBBAllocated = 0;
+    }
+    r->decBBCount = 0;
+
+    // hash table at most half full
+    size = 16;
+    while(size < 2 * r->decBBCapacity) size *= 2;
+    resetDecodedBBHash(r, size);
+}
+
+void freeDecoding(Rewriter* r)
+{
+    int i;
+
+    free(r->decInstr);
+    r->decInstr = 0;
+    r->decInstrCount = 0;
+    for(i = 0; i < r->decInstrChunkCount; i++)
+        free(r->decInstrChunk[i]);
+    free(r->decInstrChunk);
+    r->decInstrChunk = 0;
+    r->decInstrChunkCount = 0;
+
+    for(i = 0; i < r->decBBAllocated; i++)
+        free(r->decBB[i]);
+    free(r->decBB);
+    r->decBB = 0;
+    r->decBBCount = 0;
+    r->decBBAllocated = 0;
+
+    free(r->decBBHash);
+    r->decBBHash = 0;
+    r->decBBHashSize = 0;
+}
+
+// start a new chunk of decoded instructions with double size.
+// already decoded instructions of BB <dbb> are moved to the new chunk
+static
+void growDecodedInstrs(Rewriter* r, DBB* dbb)
+{
+    Instr* chunk;
+    int cap, n;
+
+    cap = 2 * r->decInstrCapacity;
+    chunk = (Instr*) malloc(sizeof(Instr) * cap);
+    n = r->decInstr + r->decInstrCount - dbb->instr;
+    assert((n >= 0) && (n <= r->decInstrCount));
+    memcpy(chunk, dbb->instr, sizeof(Instr) * n);
+
+    r->decInstrChunk = (Instr**) realloc(r->decInstrChunk,
+                         sizeof(Instr*) * (r->decInstrChunkCount + 1));
+    r->decInstrChunk[r->decInstrChunkCount++] = r->decInstr;
+
+    r->decInstr = chunk;
+    r->decInstrCount = n;
+    r->decInstrCapacity = cap;
+    dbb->instr = chunk;
+}
+
+static
+int decodedBBHashIndex(Rewriter* r, uint64_t f)
+{
+    uint64_t h = (f ^ (f >> 17)) * 0x9E3779B97F4A7C15ULL;
+    return (int) (h >> 32) & (r->decBBHashSize - 1);
+}
+
+// return 0 if not found
+static
+DBB* findDecodedBB(Rewriter* r, uint64_t f)
+{
+    int i = decodedBBHashIndex(r, f);
+
+    while(r->decBBHash[i]) {
+        if (r->decBBHash[i]->addr == f) return r->decBBHash[i];
+        i = (i + 1) & (r->decBBHashSize - 1);
+    }
+    return 0;
+}
+
+static
+void insertDecodedBB(Rewriter* r, DBB* dbb)
+{
+    int i;
+
+    i = decodedBBHashIndex(r, dbb->addr);
+    while(r->decBBHash[i])
+        i = (i + 1) & (r->decBBHashSize - 1);
+    r->decBBHash[i] = dbb;
+}
+
+// allocate a new decoded BB, growing space as needed
+static
+DBB* newDecodedBB(Rewriter* r, uint64_t f)
+{
+    DBB* dbb;
+    int i;
+
+    if (r->decBBCount == r->decBBCapacity) {
+        r->decBBCapacity *= 2;
+        r->decBB = (DBB**) realloc(r->decBB, sizeof(DBB*) * r->decBBCapacity);
+    }
+    // DBBs are allocated one by one as pointers to them must stay valid
+    if (r->decBBCount == r->decBBAllocated) {
+        r->decBB[r->decBBAllocated++] = (DBB*) malloc(sizeof(DBB));
+    }
+    dbb = r->decBB[r->decBBCount++];
+    dbb->addr = f;
+
+    if (2 * r->decBBCount > r->decBBHashSize) {
+        // rehash with double size
+        resetDecodedBBHash(r, 2 * r->decBBHashSize);
+        for(i = 0; i < r->decBBCount; i++)
+            insertDecodedBB(r, r->decBB[i]);
+    }
+    else
+        insertDecodedBB(r, dbb);
+
+    return dbb;
+}
+
+// space has to be available, see growDecodedInstrs()
 Instr* nextInstr(Rewriter* r, uint64_t a, int len)
 {
     Instr* i;
 
-    if (r->decInstrCount >= r->decInstrCapacity) return 0;
+    assert(r->decInstrCount < r->decInstrCapacity);
 
     i = r->decInstr + r->decInstrCount;
     r->decInstrCount++;
@@ -93,33 +252,25 @@ Instr* nextInstr(Rewriter* r, uint64_t a, int len)
     i->dst.type = OT_None;
     i->src.type = OT_None;
     i->src2.type = OT_None;
+    i->info_stack = SA_Unknown;
 
     return i;
 }
 
-// on error, return 0 and capture error information in context
+// the decoding buffer grows as needed
 static
 Instr* nextInstrForDContext(Rewriter* r, DContext* c)
 {
     uint64_t len = (uint64_t)(c->f + c->off) - c->iaddr;
-    Instr* i = nextInstr(r, c->iaddr, len);
-
-    if (!i) {
-        static char buf[64];
-
-        sprintf(buf, "decode buffer full (size: %d instrs)",
-                    r->decInstrCapacity);
-        setDecodeError(&(c->error), c->r, buf, ET_BufferOverflow,
-                       c->dbb, c->off);
-    }
 
-    return i;
+    if (r->decInstrCount >= r->decInstrCapacity)
+        growDecodedInstrs(r, c->dbb);
+    return nextInstr(r, c->iaddr, len);
 }
 
 Instr* addSimple(Rewriter* r, DContext* c, InstrType it, ValType vt)
 {
     Instr* i = nextInstrForDContext(r, c);
-    if (!i) return 0;
 
     i->type = it;
     i->vtype = vt;
@@ -131,7 +282,6 @@ Instr* addSimple(Rewriter* r, DContext* c, InstrType it, ValType vt)
 Instr* addUnaryOp(Rewriter* r, DContext* c, InstrType it, Operand* o)
 {
     Instr* i = nextInstrForDContext(r, c);
-    if (!i) return 0;
 
     i->type = it;
     i->form = OF_1;
@@ -151,7 +301,6 @@ Instr* addBinaryOp(Rewriter* r, DContext* c,
     }
 
     Instr* i = nextInstrForDContext(r, c);
-    if (!i) return 0;
 
     i->type = it;
     i->form = OF_2;
@@ -173,7 +322,6 @@ Instr* addTernaryOp(Rewriter* r, DContext* c,
     }
 
     Instr* i = nextInstrForDContext(r, c);
-    if (!i) return 0;
 
     i->type = it;
     i->form = OF_3;
@@ -548,6 +696,9 @@ static OpcInfo opcTable0F_V256[256];
 #define OPCENTRY_SIZE 1000
 static OpcEntry opcEntry[OPCENTRY_SIZE];
 
+// tables are filled once, then only read (concurrently by rewriters)
+static pthread_once_t decodeTablesOnce = PTHREAD_ONCE_INIT;
+
 // set type for opcode, allocate space in opcEntry table
 // if type already set, only check
 // returns start offset into opcEntry table
@@ -714,9 +865,11 @@ OpcEntry* setOpcGH(int opc, int digit, DecHandler h)
 static
 void markDecodeError(DContext* c, bool showDigit, ErrorType et)
 {
-    static char buf[64];
+    char* buf = c->errorDesc;
     int o = 0;
 
+    addSimple(c->r, c, IT_Invalid, VT_None);
+
     switch(et) {
     case ET_BadOpcode:
         o = sprintf(buf, "unsupported opcode"); break;
@@ -740,7 +893,6 @@ void markDecodeError(DContext* c, bool showDigit, ErrorType et)
     if (c->opc2 >= 0) o += sprintf(buf+o, " 0x%02x", c->opc2);
     if (showDigit) sprintf(buf+o, " / %d", c->digit);
 
-    addSimple(c->r, c, IT_Invalid, VT_None);
     setDecodeError(&(c->error), c->r, buf, et, c->dbb, c->off);
 }
 
@@ -1911,14 +2063,10 @@ void decode_FF(DContext* c)
     }
 }
 
+// fills the opcode tables, run only once (see dbrew_decode)
 static
 void initDecodeTables(void)
 {
-    static bool done = false;
-    // initialize only once
-    if (done) return;
-    done = true;
-
     for(int i = 0; i<256; i++) {
         opcTable[i].t        = OT_Invalid;
         opcTable0F[i].t      = OT_Invalid;
@@ -2515,27 +2663,23 @@ void initDecodeTables(void)
 DBB* dbrew_decode(Rewriter* r, uint64_t f)
 {
     DContext cxt;
-    int i, old_icount;
     DBB* dbb;
 
     if (f == 0) return 0; // nothing to decode
     if (r->decBB == 0) initRewriter(r);
-    initDecodeTables();
+    // opcode tables are shared among all rewriters
+    pthread_once(&decodeTablesOnce, initDecodeTables);
 
     // already decoded?
-    for(i = 0; i < r->decBBCount; i++)
-        if (r->decBB[i].addr == f) return &(r->decBB[i]);
+    dbb = findDecodedBB(r, f);
+    if (dbb) return dbb;
 
     // start decoding of new BB beginning at f
-    assert(r->decBBCount < r->decBBCapacity);
-    dbb = &(r->decBB[r->decBBCount]);
-    r->decBBCount++;
-    dbb->addr = f;
+    dbb = newDecodedBB(r, f);
     dbb->fc = config_find_function(r, f);
     dbb->count = 0;
     dbb->size = 0;
     dbb->instr = r->decInstr + r->decInstrCount;
-    old_icount = r->decInstrCount;
 
     if (r->showDecoding)
         printf("Decoding BB %s ...\n", prettyAddress(f, dbb->fc));
@@ -2576,7 +2720,8 @@ DBB* dbrew_decode(Rewriter* r, uint64_t f)
     }
 
     assert(dbb->addr == dbb->instr->addr);
-    dbb->count = r->decInstrCount - old_icount;
+    // instructions may have been moved to a new chunk while decoding
+    dbb->count = r->decInstr + r->decInstrCount - dbb->instr;
     dbb->size = cxt.off;
 
     if (r->showDecoding)
@@ -25,6 +25,8 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+#include <emmintrin.h>
 
 #include "common.h"
 #include "decode.h"
@@ -51,10 +53,10 @@
  * saving emulator state. After emulating one path, we roll back and
  * go the other path. As this may happen recursively, we do a kind of
  * back-tracking, with emulator states stored as stacks.
- * To allow for fast saving/restoring of emulator states, each part of
- * the emulation state (registers, bytes on stack) is given by a
- * EmuStateEntry (linked) list with the current value/state in front.
- * Saving copies the complete EmuState, inheriting the individual states.
+ * To allow for fast saving/restoring of emulator states, the stack is
+ * split into pages with reference counts, shared among the current and
+ * saved states. Saving/restoring only copies registers and page pointers,
+ * and a page is copied on first write to it while shared.
  */
 
 void initMetaState(MetaState* ms, CaptureState cs)
@@ -116,6 +118,306 @@ EmuValue staticEmuValue(uint64_t v, ValType t)
     return ev;
 }
 
+// stack pages, copy-on-write.
+// Capture state is stored as one byte per stack byte, range/parDep
+// expressions only for bytes where set.
+// Pages are allocated in the rewriter arena. The reference count only
+// tells whether a page is shared; memory is freed when resetting the arena
+
+// forget all pages. They may already be released by an arena reset
+static
+void dropStackPages(EmuState* es)
+{
+    int i;
+
+    for(i = 0; i < es->stackSize / STACKPAGE_SIZE; i++)
+        es->stackPage[i] = 0;
+    es->stackHash = 0;
+}
+
+// contribution of a byte at stack offset or address <pos> to the running
+// fingerprint of stack or shadowed memory, updated on every change. Must
+// match csIsEqual: CS_STATIC2 is hashed as CS_STATIC, and values only are
+// included for static and stack-relative bytes. DEAD and DYNAMIC bytes do
+// not contribute, so new pages do not change the fingerprint
+static
+uint64_t byteHash(uint64_t pos, CaptureState cs, uint8_t v)
+{
+    uint64_t h;
+
+    if ((cs == CS_DEAD) || (cs == CS_DYNAMIC)) return 0;
+    if (cs == CS_STATIC2) cs = CS_STATIC;
+    h = (pos * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t) cs << 8) ^ v;
+    return (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ULL;
+}
+
+static
+uint8_t stackByte(EmuState* es, int off)
+{
+    StackPage* p = es->stackPage[off / STACKPAGE_SIZE];
+
+    return p ? p->data[off % STACKPAGE_SIZE] : 0;
+}
+
+// meta state of byte at offset <off> in page <p>, DEAD without page
+static
+MetaState pageMeta(StackPage* p, int off)
+{
+    MetaState ms;
+    int i;
+
+    if (!p) {
+        initMetaState(&ms, CS_DEAD);
+        return ms;
+    }
+
+    initMetaState(&ms, (CaptureState) p->cState[off]);
+    for(i = 0; i < p->infoCount; i++) {
+        if (p->info[i].off != off) continue;
+        ms.range = p->info[i].range;
+        ms.parDep = p->info[i].parDep;
+        break;
+    }
+    return ms;
+}
+
+static
+MetaState stackMeta(EmuState* es, int off)
+{
+    return pageMeta(es->stackPage[off / STACKPAGE_SIZE], off % STACKPAGE_SIZE);
+}
+
+// return page to replace <p> which is owned exclusively by the caller:
+// <p> itself if not shared, otherwise a copy. Without <p>, a new page
+// with zero bytes (DEAD)
+static
+StackPage* pageForWrite(Arena* a, StackPage* p)
+{
+    StackPage* np;
+    int i;
+
+    if (p && (p->refCount == 1)) return p;
+
+    np = (StackPage*) arena_alloc(a, sizeof(StackPage));
+    np->refCount = 1;
+    np->infoCount = 0;
+    np->infoCapacity = 0;
+    np->info = 0;
+    if (p) {
+        memcpy(np->data, p->data, STACKPAGE_SIZE);
+        memcpy(np->cState, p->cState, STACKPAGE_SIZE);
+        if (p->infoCount > 0) {
+            // copy only used entries, grown again on demand
+            np->infoCount = p->infoCount;
+            np->infoCapacity = p->infoCount;
+            np->info = (StackExprInfo*) arena_alloc(a, sizeof(StackExprInfo) *
+                                                       p->infoCount);
+            memcpy(np->info, p->info, sizeof(StackExprInfo) * p->infoCount);
+        }
+        p->refCount--;
+    }
+    else {
+        memset(np->data, 0, STACKPAGE_SIZE);
+        for(i = 0; i < STACKPAGE_SIZE; i++)
+            np->cState[i] = CS_DEAD;
+    }
+
+    return np;
+}
+
+// return page of stack offset <off> owned exclusively by <es>
+static
+StackPage* stackPageForWrite(EmuState* es, int off)
+{
+    StackPage** pp = &(es->stackPage[off / STACKPAGE_SIZE]);
+
+    *pp = pageForWrite(es->arena, *pp);
+    return *pp;
+}
+
+static
+void setStackByte(EmuState* es, int off, uint8_t v)
+{
+    StackPage* p = stackPageForWrite(es, off);
+    int o = off % STACKPAGE_SIZE;
+    CaptureState cs = (CaptureState) p->cState[o];
+
+    es->stackHash += byteHash(off, cs, v) - byteHash(off, cs, p->data[o]);
+    p->data[o] = v;
+}
+
+// set meta state of byte at offset <off> in exclusively owned page <p>
+static
+void setPageMeta(Arena* a, StackPage* p, int off, MetaState ms)
+{
+    int i;
+
+    p->cState[off] = (uint8_t) ms.cState;
+
+    for(i = 0; i < p->infoCount; i++)
+        if (p->info[i].off == off) break;
+    if (!ms.range && !ms.parDep) {
+        // remove info if existing
+        if (i < p->infoCount)
+            p->info[i] = p->info[--p->infoCount];
+        return;
+    }
+    if (i == p->infoCount) {
+        if (p->infoCount == p->infoCapacity) {
+            // grow in arena, the old array is released with the arena
+            int capacity = p->infoCapacity ? 2 * p->infoCapacity : 4;
+            StackExprInfo* info;
+
+            info = (StackExprInfo*) arena_alloc(a, sizeof(StackExprInfo) *
+                                                   capacity);
+            if (p->infoCount > 0)
+                memcpy(info, p->info, sizeof(StackExprInfo) * p->infoCount);
+            p->info = info;
+            p->infoCapacity = capacity;
+        }
+        p->infoCount++;
+        p->info[i].off = off;
+    }
+    p->info[i].range = ms.range;
+    p->info[i].parDep = ms.parDep;
+}
+
+static
+void setStackMeta(EmuState* es, int off, MetaState ms)
+{
+    StackPage* p = stackPageForWrite(es, off);
+    int o = off % STACKPAGE_SIZE;
+
+    es->stackHash += byteHash(off, ms.cState, p->data[o]) -
+                     byteHash(off, (CaptureState) p->cState[o], p->data[o]);
+    setPageMeta(es->arena, p, o, ms);
+}
+
+// shadow memory: optional tracking of non-stack memory written via static
+// addresses, using copy-on-write pages as for the stack. Pages are found
+// via an open hash table keyed by page address, and are only dropped all
+// at once. Page data starts as copy of real memory, which itself is not
+// modified. Writes still are captured: shadowed state allows to fold
+// loads of data written before. Bytes without known content are DEAD
+
+static
+int shadowSlot(EmuState* es, uint64_t pa)
+{
+    int i;
+
+    i = (int) (((pa / STACKPAGE_SIZE) * 0x9e3779b97f4a7c15ULL) >> 32) &
+        (es->memHashSize - 1);
+    while(es->memPage[i] && (es->memPageAddr[i] != pa))
+        i = (i + 1) & (es->memHashSize - 1);
+    return i;
+}
+
+// page containing address <a>, 0 if not shadowed
+static
+StackPage* shadowPage(EmuState* es, uint64_t a)
+{
+    if (es->memPageCount == 0) return 0;
+    return es->memPage[shadowSlot(es, a - a % STACKPAGE_SIZE)];
+}
+
+// forget all shadowed memory. Pages may already be released by an
+// arena reset, so reference counts are not touched
+static
+void dropShadowPages(EmuState* es)
+{
+    int i;
+
+    for(i = 0; i < es->memHashSize; i++)
+        es->memPage[i] = 0;
+    es->memPageCount = 0;
+    es->memHash = 0;
+}
+
+// make space for one more page in the hash table, keeping it at most
+// half full. Only used for the live state, which owns its table
+static
+void growShadow(EmuState* es)
+{
+    uint64_t* oldAddr = es->memPageAddr;
+    StackPage** oldPage = es->memPage;
+    int i, j, oldSize = es->memHashSize;
+
+    if (2 * (es->memPageCount + 1) <= es->memHashSize) return;
+
+    es->memHashSize = oldSize ? 2 * oldSize : 64;
+    es->memHashCapacity = es->memHashSize;
+    es->memPageAddr = (uint64_t*) malloc(sizeof(uint64_t) * es->memHashSize);
+    es->memPage = (StackPage**) malloc(sizeof(StackPage*) * es->memHashSize);
+    for(i = 0; i < es->memHashSize; i++)
+        es->memPage[i] = 0;
+    for(i = 0; i < oldSize; i++) {
+        if (!oldPage[i]) continue;
+        j = shadowSlot(es, oldAddr[i]);
+        es->memPageAddr[j] = oldAddr[i];
+        es->memPage[j] = oldPage[i];
+    }
+    free(oldAddr);
+    free(oldPage);
+}
+
+// return shadow page for address <a> owned exclusively by <es>
+static
+StackPage* shadowPageForWrite(EmuState* es, uint64_t a)
+{
+    uint64_t pa = a - a % STACKPAGE_SIZE;
+    int i;
+
+    growShadow(es);
+    i = shadowSlot(es, pa);
+    if (!es->memPage[i]) {
+        // page-aligned range is in same mapping as <a>
+        es->memPage[i] = pageForWrite(es->arena, 0);
+        memcpy(es->memPage[i]->data, (void*) pa, STACKPAGE_SIZE);
+        es->memPageAddr[i] = pa;
+        es->memPageCount++;
+    }
+    else
+        es->memPage[i] = pageForWrite(es->arena, es->memPage[i]);
+
+    return es->memPage[i];
+}
+
+static
+void setShadowByte(EmuState* es, uint64_t a, uint8_t v)
+{
+    StackPage* p = shadowPageForWrite(es, a);
+    int o = a % STACKPAGE_SIZE;
+    CaptureState cs = (CaptureState) p->cState[o];
+
+    es->memHash += byteHash(a, cs, v) - byteHash(a, cs, p->data[o]);
+    p->data[o] = v;
+}
+
+static
+void setShadowMeta(EmuState* es, uint64_t a, MetaState ms)
+{
+    StackPage* p = shadowPageForWrite(es, a);
+    int o = a % STACKPAGE_SIZE;
+
+    es->memHash += byteHash(a, ms.cState, p->data[o]) -
+                   byteHash(a, (CaptureState) p->cState[o], p->data[o]);
+    setPageMeta(es->arena, p, o, ms);
+}
+
+// forget shadowed content of <len> bytes at <a>
+static
+void clearShadow(EmuState* es, uint64_t a, int len)
+{
+    MetaState dead;
+    int i;
+
+    initMetaState(&dead, CS_DEAD);
+    for(i = 0; i < len; i++) {
+        if (!shadowPage(es, a + i)) continue;
+        setShadowMeta(es, a + i, dead);
+    }
+}
+
 void resetEmuState(EmuState* es)
 {
     int i;
@@ -135,13 +437,19 @@ void resetEmuState(EmuState* es)
         initMetaState(&(es->flag_state[i]), CS_DEAD);
     }
 
-    for(i=0; i< es->stackSize; i++)
-        es->stack[i] = 0;
-    for(i=0; i< es->stackSize; i++)
-        initMetaState(&(es->stackState[i]), CS_DEAD);
+    // vector registers may be used for parameters
+    for(i=0; i < RI_XMMMax; i++) {
+        es->vreg[i][0] = 0;
+        es->vreg[i][1] = 0;
+        initMetaState(&(es->vreg_state[i][0]), CS_DYNAMIC);
+        initMetaState(&(es->vreg_state[i][1]), CS_DYNAMIC);
+    }
+
+    dropStackPages(es);
+    dropShadowPages(es);
 
     // use real addresses for now
-    es->stackStart = (uint64_t) es->stack;
+    es->stackStart = (uint64_t) es->stackMem;
     es->stackTop = es->stackStart + es->stackSize;
     es->stackAccessed = es->stackTop;
 
@@ -153,26 +461,92 @@ void resetEmuState(EmuState* es)
     initMetaState(&(es->regIP_state), CS_STATIC);
 
     es->depth = 0;
+    es->loopCopy = 0;
+
+    es->staticReadCount = 0;
+    es->staticReadsComplete = true;
+}
+
+// set up state without stack content and address range
+static
+void initEmuState(EmuState* es, int size, StackPage** pages)
+{
+    int i;
+
+    assert((size % STACKPAGE_SIZE) == 0);
+
+    es->stackSize = size;
+    es->stackMem = 0;
+    es->stackPage = pages;
+    for(i = 0; i < size / STACKPAGE_SIZE; i++)
+        es->stackPage[i] = 0;
+    es->stackHash = 0;
+    es->memHash = 0;
+    es->arena = 0;
+    es->trackMem = false;
+    es->memPageCount = 0;
+    es->memHashSize = 0;
+    es->memHashCapacity = 0;
+    es->memPageAddr = 0;
+    es->memPage = 0;
+    es->depth = 0;
+    es->retStackCapacity = 0;
+    es->ret_stack = 0;
+    es->loopCopy = 0;
+
+    es->logStaticReads = false;
+    es->staticReadCount = 0;
+    es->staticReadCapacity = 0;
+    es->staticRead = 0;
+    es->staticReadsComplete = true;
+    es->cc = 0;
 }
 
 EmuState* allocEmuState(int size)
 {
     EmuState* es;
 
+    size = (size + STACKPAGE_SIZE - 1) / STACKPAGE_SIZE * STACKPAGE_SIZE;
     es = (EmuState*) malloc(sizeof(EmuState));
-    es->stackSize = size;
-    es->stack = (uint8_t*) malloc(size);
-    es->stackState = (MetaState*) malloc(sizeof(MetaState) * size);
+    initEmuState(es, size, (StackPage**) malloc(sizeof(StackPage*) *
+                                                (size / STACKPAGE_SIZE)));
+    es->stackMem = (uint8_t*) malloc(size);
 
     return es;
 }
 
+// forget saved emulator states, keeping the space for the list.
+// their memory is released with the arena
+static
+void freeSavedStates(Rewriter* r)
+{
+    int i;
+
+    r->savedStateCount = 0;
+    for(i = 0; i < r->esHashSize; i++)
+        r->esHash[i] = 0;
+}
+
 void freeEmuState(Rewriter* r)
 {
+    freeSavedStates(r);
+    free(r->savedState);
+    free(r->savedStateHash);
+    free(r->esHash);
+    r->savedState = 0;
+    r->savedStateHash = 0;
+    r->savedStateCapacity = 0;
+    r->esHash = 0;
+    r->esHashSize = 0;
+
     if (!r->es) return;
 
-    free(r->es->stack);
-    free(r->es->stackState);
+    free(r->es->stackPage);
+    free(r->es->stackMem);
+    free(r->es->memPageAddr);
+    free(r->es->memPage);
+    free(r->es->ret_stack);
+    free(r->es->staticRead);
     free(r->es);
     r->es = 0;
 }
@@ -210,11 +584,34 @@ bool csIsEqual(EmuState* es1, CaptureState s1, uint64_t v1,
     return true;
 }
 
+// is shadowed content of <es1> also known in <es2>?
+static
+bool shadowIsEqual(EmuState* es1, EmuState* es2)
+{
+    StackPage *p1, *p2;
+    int i, b;
+
+    for(i = 0; i < es1->memHashSize; i++) {
+        p1 = es1->memPage[i];
+        if (!p1) continue;
+        p2 = shadowPage(es2, es1->memPageAddr[i]);
+        if ((p1 == p2) && (es1->parent == es2->parent)) continue;
+
+        for(b = 0; b < STACKPAGE_SIZE; b++) {
+            if (!csIsEqual(es1, (CaptureState) p1->cState[b], p1->data[b],
+                           es2, p2 ? (CaptureState) p2->cState[b] : CS_DEAD,
+                           p2 ? p2->data[b] : 0))
+                return false;
+        }
+    }
+    return true;
+}
+
 // states are equal if metainformation is equal and static data is the same
 static
 bool esIsEqual(EmuState* es1, EmuState* es2)
 {
-    int i;
+    int i, l, pg;
 
     // same state for registers?
     for(i = 0; i < RI_GPMax; i++) {
@@ -230,41 +627,39 @@ bool esIsEqual(EmuState* es1, EmuState* es2)
             return false;
     }
 
-    // for equality, must be at same call depth
+    // same state for vector register lanes?
+    for(i = 0; i < RI_XMMMax; i++) {
+        for(l = 0; l < 2; l++)
+            if (!csIsEqual(es1, es1->vreg_state[i][l].cState, es1->vreg[i][l],
+                           es2, es2->vreg_state[i][l].cState, es2->vreg[i][l]))
+                return false;
+    }
+
+    // for equality, must be at same call depth and loop body copy
     if (es1->depth != es2->depth) return false;
+    if (es1->loopCopy != es2->loopCopy) return false;
 
     // Stack
-    // all known data has to be the same
-    if (es1->stackSize < es2->stackSize) {
-        int diff = es2->stackSize - es1->stackSize;
-        // stack of es2 is larger: bottom should not be static
-        for(i = 0; i < diff; i++) {
-            if (msIsStatic(es2->stackState[i]))
-                return false;
-        }
-        // check for equal state at byte granularity
-        for(i = 0; i < es1->stackSize; i++) {
-            if (!csIsEqual(es1, es1->stackState[i].cState, es1->stack[i],
-                           es2, es2->stackState[i+diff].cState, es2->stack[i+diff]))
-                return false;
-        }
-    }
-    else {
-        // es1 larger
-        int diff = es1->stackSize - es2->stackSize;
-        // bottom of es1 should not be static
-        for(i = 0; i < diff; i++) {
-            if (msIsStatic(es1->stackState[i]))
-                return false;
-        }
+    // all known data has to be the same. Saved states are derived from
+    // the current state, and thus have the same stack layout
+    assert(es1->stackSize == es2->stackSize);
+    for(pg = 0; pg < es1->stackSize / STACKPAGE_SIZE; pg++) {
+        // a shared page has same content
+        if ((es1->stackPage[pg] == es2->stackPage[pg]) &&
+            (es1->parent == es2->parent))
+            continue;
+
         // check for equal state at byte granularity
-        for(i = 0; i < es2->stackSize; i++) {
-            if (!csIsEqual(es1, es1->stackState[i+diff].cState, es1->stack[i+diff],
-                           es2, es2->stackState[i].cState, es2->stack[i]))
+        for(i = pg * STACKPAGE_SIZE; i < (pg + 1) * STACKPAGE_SIZE; i++) {
+            if (!csIsEqual(es1, stackMeta(es1, i).cState, stackByte(es1, i),
+                           es2, stackMeta(es2, i).cState, stackByte(es2, i)))
                 return false;
         }
     }
 
+    // shadowed memory: pages missing in one state have no known content
+    if (!shadowIsEqual(es1, es2) || !shadowIsEqual(es2, es1)) return false;
+
     return true;
 }
 
@@ -285,49 +680,81 @@ void copyEmuState(EmuState* dst, EmuState* src)
         dst->flag_state[i] = src->flag_state[i];
     }
 
+    memcpy(dst->vreg, src->vreg, sizeof(src->vreg));
+    memcpy(dst->vreg_state, src->vreg_state, sizeof(src->vreg_state));
+
+    // share stack pages of source
+    assert(dst->stackSize == src->stackSize);
+    dst->stackStart = src->stackStart;
     dst->stackTop = src->stackTop;
     dst->stackAccessed = src->stackAccessed;
-    if (src->stackSize < dst->stackSize) {
-        // stack to restore is smaller than at destination:
-        // fill start of destination with DEAD entries
-        int diff = dst->stackSize - src->stackSize;
+    for(i = 0; i < src->stackSize / STACKPAGE_SIZE; i++) {
+        StackPage* p = src->stackPage[i];
 
-        dst->stackStart = src->stackStart - diff;
-        for(i = 0; i < diff; i++) {
-            initMetaState(&(dst->stackState[i]), CS_DEAD);
-            dst->stack[i] = 0;
-        }
-        for(i = 0; i < src->stackSize; i++) {
-            dst->stack[i+diff] = src->stack[i];
-            dst->stackState[i+diff] = src->stackState[i];
-        }
+        if (dst->stackPage[i] == p) continue;
+        if (p) p->refCount++;
+        if (dst->stackPage[i]) dst->stackPage[i]->refCount--;
+        dst->stackPage[i] = p;
     }
-    else {
-        // stack to restore is larger than at destination:
-        // make sure that start of source was never accessed
-        uint64_t diff = src->stackSize - dst->stackSize;
-        assert(src->stackAccessed - src->stackStart >= diff);
-
-        dst->stackStart = src->stackStart + diff;
-        for(i = 0; i < dst->stackSize; i++) {
-            dst->stack[i] = src->stack[i+diff];
-            dst->stackState[i] = src->stackState[i+diff];
-        }
+    dst->stackHash = src->stackHash;
+
+    // share shadow pages of source
+    for(i = 0; i < dst->memHashSize; i++)
+        if (dst->memPage[i]) dst->memPage[i]->refCount--;
+    if (dst->memHashCapacity < src->memHashSize) {
+        dst->memHashCapacity = src->memHashSize;
+        dst->memPageAddr = (uint64_t*) realloc(dst->memPageAddr,
+                                               sizeof(uint64_t) *
+                                               src->memHashSize);
+        dst->memPage = (StackPage**) realloc(dst->memPage,
+                                             sizeof(StackPage*) *
+                                             src->memHashSize);
     }
-    assert(dst->stackTop == dst->stackStart + dst->stackSize);
+    dst->memHashSize = src->memHashSize;
+    dst->memPageCount = src->memPageCount;
+    for(i = 0; i < src->memHashSize; i++) {
+        StackPage* p = src->memPage[i];
+
+        if (p) p->refCount++;
+        dst->memPage[i] = p;
+        dst->memPageAddr[i] = src->memPageAddr[i];
+    }
+    dst->memHash = src->memHash;
 
     dst->depth = src->depth;
+    if (dst->retStackCapacity < src->depth) {
+        dst->retStackCapacity = src->depth;
+        dst->ret_stack = (uint64_t*) realloc(dst->ret_stack,
+                                             sizeof(uint64_t) * src->depth);
+    }
     for(i = 0; i < src->depth; i++)
         dst->ret_stack[i] = src->ret_stack[i];
+
+    dst->loopCopy = src->loopCopy;
 }
 
 static
-EmuState* cloneEmuState(EmuState* src)
+EmuState* cloneEmuState(Arena* a, EmuState* src)
 {
     EmuState* dst;
-
-    // allocate only stack space that was accessed in source
-    dst = allocEmuState(src->stackTop - src->stackAccessed);
+    int pages = src->stackSize / STACKPAGE_SIZE;
+
+    // no own address range: stack content is only accessed via pages
+    dst = (EmuState*) arena_alloc(a, sizeof(EmuState));
+    initEmuState(dst, src->stackSize,
+                 (StackPage**) arena_alloc(a, sizeof(StackPage*) * pages));
+    if (src->depth > 0) {
+        dst->retStackCapacity = src->depth;
+        dst->ret_stack = (uint64_t*) arena_alloc(a, sizeof(uint64_t) *
+                                                    src->depth);
+    }
+    if (src->memHashSize > 0) {
+        dst->memHashCapacity = src->memHashSize;
+        dst->memPageAddr = (uint64_t*) arena_alloc(a, sizeof(uint64_t) *
+                                                      src->memHashSize);
+        dst->memPage = (StackPage**) arena_alloc(a, sizeof(StackPage*) *
+                                                    src->memHashSize);
+    }
     copyEmuState(dst, src);
 
     // remember that we cloned dst from src
@@ -336,38 +763,127 @@ EmuState* cloneEmuState(EmuState* src)
     return dst;
 }
 
+// fingerprint of the part of an EmuState checked by esIsEqual.
+// Equal states must get the same fingerprint: as in csIsEqual, CS_STATIC2
+// is hashed as CS_STATIC, and only values of static and stack-relative
+// resources are included. Stack and shadowed memory are covered by
+// running fingerprints kept up to date on writes (see byteHash), so the
+// cost does not depend on their size
+static
+uint64_t hashCS(uint64_t h, EmuState* es, CaptureState cs, uint64_t v)
+{
+    if (cs == CS_STATIC2) cs = CS_STATIC;
+    h = (h ^ cs) * 0x100000001b3ULL;
+    if (cs == CS_STATIC)
+        h = (h ^ v) * 0x100000001b3ULL;
+    else if (cs == CS_STACKRELATIVE)
+        h = (h ^ v ^ (uint64_t) es->parent) * 0x100000001b3ULL;
+    return h;
+}
+
+static
+uint64_t esFingerprint(EmuState* es)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    int i;
+
+    for(i = 0; i < RI_GPMax; i++)
+        h = hashCS(h, es, es->reg_state[i].cState, es->reg[i]);
+    for(i = 0; i < FT_Max; i++)
+        h = hashCS(h, es, es->flag_state[i].cState, es->flag[i]);
+    for(i = 0; i < RI_XMMMax; i++) {
+        h = hashCS(h, es, es->vreg_state[i][0].cState, es->vreg[i][0]);
+        h = hashCS(h, es, es->vreg_state[i][1].cState, es->vreg[i][1]);
+    }
+    h = (h ^ (uint64_t) es->depth) * 0x100000001b3ULL;
+    h = (h ^ (uint64_t) es->loopCopy) * 0x100000001b3ULL;
+
+    h = (h ^ es->stackHash) * 0x100000001b3ULL;
+
+    return h + es->memHash;
+}
+
+static
+void insertSavedStateHash(Rewriter* r, int esID)
+{
+    int i;
+
+    i = (int) (r->savedStateHash[esID] >> 32) & (r->esHashSize - 1);
+    while(r->esHash[i])
+        i = (i + 1) & (r->esHashSize - 1);
+    r->esHash[i] = esID + 1;
+}
+
+// make space for one more saved state
+static
+void growSavedStates(Rewriter* r)
+{
+    int i;
+
+    if (r->savedStateCount < r->savedStateCapacity) return;
+
+    r->savedStateCapacity = r->savedStateCapacity ?
+                            2 * r->savedStateCapacity : 32;
+    r->savedState = (EmuState**) realloc(r->savedState,
+                        sizeof(EmuState*) * r->savedStateCapacity);
+    r->savedStateHash = (uint64_t*) realloc(r->savedStateHash,
+                            sizeof(uint64_t) * r->savedStateCapacity);
+
+    // hash index at most half full
+    free(r->esHash);
+    r->esHashSize = 2 * r->savedStateCapacity;
+    r->esHash = (int*) malloc(sizeof(int) * r->esHashSize);
+    for(i = 0; i < r->esHashSize; i++)
+        r->esHash[i] = 0;
+    for(i = 0; i < r->savedStateCount; i++)
+        insertSavedStateHash(r, i);
+}
+
 // checks current state against already saved states, and returns an ID
 // (which is the index in the saved state list of the rewriter)
 int saveEmuState(RContext* c)
 {
-    static Error e;
-    int i;
     Rewriter* r = c->r;
+    uint64_t h;
+    int i, esID;
 
     if (r->showEmuSteps)
         printf("Saving current emulator state: ");
     //printStaticEmuState(r->es, -1);
-    for(i = 0; i < r->savedStateCount; i++) {
-        //printf("Check ES %d\n", i);
-        //printStaticEmuState(r->savedState[i], i);
-        if (esIsEqual(r->es, r->savedState[i])) {
-            if (r->showEmuSteps)
-                printf("already existing, esID %d\n", i);
-            return i;
+
+    h = esFingerprint(r->es);
+    if (r->esHashSize > 0) {
+        // full comparison only for states with same fingerprint
+        i = (int) (h >> 32) & (r->esHashSize - 1);
+        while(r->esHash[i]) {
+            esID = r->esHash[i] - 1;
+            if ((r->savedStateHash[esID] == h) &&
+                esIsEqual(r->es, r->savedState[esID])) {
+                if (r->showEmuSteps)
+                    printf("already existing, esID %d\n", esID);
+                return esID;
+            }
+            i = (i + 1) & (r->esHashSize - 1);
         }
     }
-    if (r->showEmuSteps)
-        printf("new with esID %d\n", i);
-    if (i >= SAVEDSTATE_MAX) {
-        setError(&e, ET_BufferOverflow, EM_Rewriter, r,
-                 "Too many different emulation states");
-        c->e = &e;
+
+    if ((r->maxSavedStates > 0) && (r->savedStateCount >= r->maxSavedStates)) {
+        setError(&r->error, ET_BufferOverflow, EM_Rewriter, r,
+                 "Saved emulator state limit exceeded");
+        c->e = &r->error;
         return -1;
     }
-    r->savedState[i] = cloneEmuState(r->es);
-    r->savedStateCount++;
 
-    return i;
+    growSavedStates(r);
+    esID = r->savedStateCount++;
+    if (r->showEmuSteps)
+        printf("new with esID %d\n", esID);
+    r->savedState[esID] = cloneEmuState(r->arena, r->es);
+    // the clone has another parent, relevant for stack-relative values
+    r->savedStateHash[esID] = esFingerprint(r->savedState[esID]);
+    insertSavedStateHash(r, esID);
+
+    return esID;
 }
 
 void restoreEmuState(Rewriter* r, int esID)
@@ -425,6 +941,17 @@ void printEmuState(EmuState* es)
     }
     printf("\n");
 
+    // vector registers only if not all dynamic
+    for(i = 0; i < RI_XMMMax; i++) {
+        MetaState* ms = es->vreg_state[i];
+        if ((ms[0].cState == CS_DYNAMIC) && (ms[1].cState == CS_DYNAMIC))
+            continue;
+        printf("    %%%-5s = 0x%016lx %c 0x%016lx %c\n",
+               regNameI(RT_XMM, (RegIndex)i),
+               es->vreg[i][1], captureState2Char(ms[1].cState),
+               es->vreg[i][0], captureState2Char(ms[0].cState));
+    }
+
     spOff = es->reg[RI_SP] - es->stackStart;
     spMax = spOff /8*8 + 40;
     spMin = spOff /8*8 - 32;
@@ -439,8 +966,9 @@ void printEmuState(EmuState* es)
         for(o = spMin; o < spMax; o += 8) {
             printf("   %016lx ", (uint64_t) (es->stackStart + o));
             for(oo = o; oo < o+8 && oo <= spMax; oo++) {
-                printf(" %s%02x %c", (oo == spOff) ? "*" : " ", es->stack[oo],
-                       captureState2Char(es->stackState[oo].cState));
+                printf(" %s%02x %c", (oo == spOff) ? "*" : " ",
+                       stackByte(es, oo),
+                       captureState2Char(stackMeta(es, oo).cState));
             }
             printf("\n");
         }
@@ -496,11 +1024,23 @@ void printStaticEmuState(EmuState* es, int esID)
     else
         printf("(none)\n");
 
+    // static vector register lanes, only printed if existing
+    c = 0;
+    for(i = 0; i < 2 * RI_XMMMax; i++) {
+        if (!msIsStatic(es->vreg_state[i / 2][i % 2])) continue;
+        printf("%s%%%s[%d] (0x%lx)", (c>0) ? ", " : "  Vector: ",
+               regNameI(RT_XMM, (RegIndex) (i / 2)), i % 2,
+               es->vreg[i / 2][i % 2]);
+        c++;
+    }
+    if (c>0)
+        printf("\n");
+
     printf("  Stack: ");
     cc = 0;
     c = 0;
     for(i = 0; i < es->stackSize; i++) {
-        if (!msIsStatic(es->stackState[i])) {
+        if (!msIsStatic(stackMeta(es, i))) {
             c = 0;
             continue;
         }
@@ -508,7 +1048,7 @@ void printStaticEmuState(EmuState* es, int esID)
             printf("\n   %016lx ", (uint64_t) (es->stackStart + i));
         else
             printf(" ");
-        printf("%02x", es->stack[i]);
+        printf("%02x", stackByte(es, i));
         cc++;
         c++;
     }
@@ -516,6 +1056,16 @@ void printStaticEmuState(EmuState* es, int esID)
         printf("\n");
     else
         printf("(none)\n");
+
+    // shadowed memory, only printed if existing
+    cc = 0;
+    for(i = 0; i < es->memHashSize; i++) {
+        if (!es->memPage[i]) continue;
+        for(c = 0; c < STACKPAGE_SIZE; c++)
+            if (csIsStatic((CaptureState) es->memPage[i]->cState[c])) cc++;
+    }
+    if (cc>0)
+        printf("  Memory: %d static bytes\n", cc);
 }
 
 static
@@ -562,61 +1112,192 @@ CaptureState combineState4Flags(CaptureState s1, CaptureState s2)
     return s;
 }
 
+//---------------------------------------------------------------
+// Capture budget
+//
+// If any budget configured for a capture run is exhausted, capturing
+// continues without further specialization: static results of operations
+// are loaded into their destinations and become dynamic, and loops are
+// kept rolled at their next back-edge. This way, all remaining paths
+// quickly reach already captured states, and the rewritten function is
+// specialized only partially.
+
+static
+uint64_t currentMillis(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// called before emulating an instruction
+void checkBudget(RContext* c)
+{
+    Rewriter* r = c->r;
+    const char* reason = 0;
+
+    r->emuSteps++;
+    if (r->budgetExceeded) return;
+
+    if ((r->budgetInstrs > 0) && (r->capturedInstrs >= r->budgetInstrs))
+        reason = "captured instructions";
+    else if ((r->maxEmuSteps > 0) && (r->emuSteps > r->maxEmuSteps))
+        reason = "emulation steps";
+    // time is checked only every 1024 steps
+    else if ((r->maxMillis > 0) && ((r->emuSteps & 1023) == 0) &&
+             (currentMillis() - r->captureStart >= (uint64_t) r->maxMillis))
+        reason = "time";
+    if (!reason) return;
+
+    r->budgetExceeded = true;
+    if (r->showEmuSteps)
+        printf("Capture budget exhausted (%s): stop specializing\n", reason);
+}
+
+// should static results become unknown?
+static
+bool forceUnknown(RContext* c, EmuState* es)
+{
+    if (c->r->budgetExceeded) return true;
+    return config_force_unknown(c->r->cc, es->depth);
+}
+
 //---------------------------------------------------------------
 // Functions to find/allocate new (captured) basic blocks (CBBs).
 // A CBB is keyed by a function address and world state ID
 // (actually an emulator state esID)
 
-// remove any previously allocated CBBs (keep allocated memory space)
+static
+void resetCaptureBBHash(Rewriter* r, int size)
+{
+    int i;
+
+    if (r->capBBHashSize != size) {
+        free(r->capBBHash);
+        r->capBBHashSize = size;
+        r->capBBHash = (CBB**) malloc(sizeof(CBB*) * size);
+    }
+    for(i = 0; i < size; i++)
+        r->capBBHash[i] = 0;
+}
+
+// remove any previously allocated CBBs and saved states: this releases
+// all transient data of the previous rewrite (keep allocated memory space)
 void resetCapturing(Rewriter* r)
 {
+    int size;
+
     // only to be called after initRewriter()
-    assert(r->capInstr != 0);
+    assert(r->arena != 0);
     assert(r->capBB != 0);
 
+    arena_reset(r->arena);
+    r->ePool = expr_allocPool(r->arena, 1000);
+
     r->capBBCount = 0;
+    r->capInstr = 0;
     r->capInstrCount = 0;
+    r->capInstrChunkSize = 0;
     r->currentCapBB = 0;
 
+    // hash table at most half full
+    size = 16;
+    while(size < 2 * r->capBBCapacity) size *= 2;
+    resetCaptureBBHash(r, size);
+
     r->capStackTop = -1;
-    r->savedStateCount = 0;
+    r->genOrderCount = 0;
+    r->profiledCode = 0;
+    r->loopCount = 0;
+    freeSavedStates(r);
+
+    r->capturedInstrs = 0;
+    r->emuSteps = 0;
+    r->captureStart = (r->maxMillis > 0) ? currentMillis() : 0;
+    r->budgetExceeded = false;
 }
 
-// return 0 if not found
-static
-CBB *findCaptureBB(Rewriter* r, uint64_t f, int esID)
+void freeCapturing(Rewriter* r)
 {
-    int i;
+    free(r->capBB);
+    r->capBB = 0;
+    r->capBBCount = 0;
 
-    for(i = 0; i < r->capBBCount; i++)
-        if ((r->capBB[i].dec_addr == f) && (r->capBB[i].esID == esID))
-            return &(r->capBB[i]);
+    free(r->capBBHash);
+    r->capBBHash = 0;
+    r->capBBHashSize = 0;
 
-    return 0;
+    free(r->loop);
+    r->loop = 0;
+    r->loopCount = 0;
+    r->loopCapacity = 0;
 }
 
-// allocate a BB structure to collect instructions for capturing
-CBB* getCaptureBB(RContext* c, uint64_t f, int esID)
+static
+int captureBBHashIndex(Rewriter* r, uint64_t f, int esID)
+{
+    uint64_t h = (f ^ (f >> 17) ^ ((uint64_t) esID << 32)) *
+                 0x9E3779B97F4A7C15ULL;
+    return (int) (h >> 32) & (r->capBBHashSize - 1);
+}
+
+// return 0 if not found
+static
+CBB *findCaptureBB(Rewriter* r, uint64_t f, int esID)
+{
+    int i = captureBBHashIndex(r, f, esID);
+
+    while(r->capBBHash[i]) {
+        CBB* bb = r->capBBHash[i];
+        if ((bb->dec_addr == f) && (bb->esID == esID)) return bb;
+        i = (i + 1) & (r->capBBHashSize - 1);
+    }
+    return 0;
+}
+
+static
+void insertCaptureBB(Rewriter* r, CBB* bb)
+{
+    int i;
+
+    i = captureBBHashIndex(r, bb->dec_addr, bb->esID);
+    while(r->capBBHash[i])
+        i = (i + 1) & (r->capBBHashSize - 1);
+    r->capBBHash[i] = bb;
+}
+
+// allocate a BB structure to collect instructions for capturing
+CBB* getCaptureBB(RContext* c, uint64_t f, int esID)
 {
     CBB* bb;
     Rewriter* r = c->r;
+    int i;
 
     // already captured?
     bb = findCaptureBB(r, f, esID);
     if (bb) return bb;
 
     // start capturing of new BB beginning at f
-    if (r->capBBCount >= r->capBBCapacity) {
-        static Error e;
-        setError(&e, ET_BufferOverflow, EM_Rewriter, r,
-                 "Too many captured blocks");
-        c->e = &e;
-        return 0;
+    if (r->capBBCount == r->capBBCapacity) {
+        r->capBBCapacity *= 2;
+        r->capBB = (CBB**) realloc(r->capBB, sizeof(CBB*) * r->capBBCapacity);
     }
-    bb = &(r->capBB[r->capBBCount]);
-    r->capBBCount++;
+    // CBBs are allocated one by one as pointers to them must stay valid
+    bb = (CBB*) arena_alloc(r->arena, sizeof(CBB));
+    r->capBB[r->capBBCount++] = bb;
     bb->dec_addr = f;
     bb->esID = esID;
+
+    if (2 * r->capBBCount > r->capBBHashSize) {
+        // rehash with double size
+        resetCaptureBBHash(r, 2 * r->capBBHashSize);
+        for(i = 0; i < r->capBBCount; i++)
+            insertCaptureBB(r, r->capBB[i]);
+    }
+    else
+        insertCaptureBB(r, bb);
+
     bb->fc = config_find_function(r, f);
 
     bb->count = 0;
@@ -625,12 +1306,19 @@ CBB* getCaptureBB(RContext* c, uint64_t f, int esID)
     bb->nextFallThrough = 0;
     bb->endType = IT_None;
     bb->preferBranch = false;
+    bb->liveIn = 0;
+    bb->deadStackBelow = 0;
+    bb->countBranch = 0;
+    bb->countFallThrough = 0;
 
     bb->size = -1; // size of 0 could be valid
     bb->addr1 = 0;
     bb->addr2 = 0;
     bb->genJcc8 = false;
     bb->genJump = false;
+    bb->genJmp8 = false;
+    bb->genInvert = false;
+    bb->genCounter = 0;
 
     bb->generatorData = 0;
 
@@ -639,7 +1327,7 @@ CBB* getCaptureBB(RContext* c, uint64_t f, int esID)
 
 char* cbb_prettyName(CBB* bb)
 {
-    static char buf[100];
+    static __thread char buf[100];
     int off;
 
     if ((bb->fc == 0) || (bb->fc->start > bb->dec_addr))
@@ -658,12 +1346,10 @@ char* cbb_prettyName(CBB* bb)
 int pushCaptureBB(RContext* c, CBB* bb)
 {
     Rewriter* r = c->r;
-    if (r->capStackTop + 1 >= CAPTURESTACK_LEN) {
-        static Error e;
-        setError(&e, ET_BufferOverflow, EM_Rewriter, r,
-                 "Too many blocks on capture stack");
-        c->e = &e;
-        return -1;
+    if (r->capStackTop + 1 >= r->capStackCapacity) {
+        int capacity = r->capStackCapacity ? 2 * r->capStackCapacity : 32;
+        r->capStack = (CBB**) realloc(r->capStack, sizeof(CBB*) * capacity);
+        r->capStackCapacity = capacity;
     }
     r->capStackTop++;
     r->capStack[r->capStackTop] = bb;
@@ -681,24 +1367,28 @@ CBB* popCaptureBB(Rewriter* r)
     return bb;
 }
 
-Instr* newCapInstr(RContext* c)
+Instr* newCapInstrs(Rewriter* r, int count)
 {
     Instr* instr;
-    Rewriter* r = c->r;
 
-    if (r->capInstrCount >= r->capInstrCapacity) {
-        static Error e;
-        setError(&e, ET_BufferOverflow, EM_Capture, r,
-                 "Too many captured instructions");
-        c->e = &e;
-        return 0;
+    if (r->capInstrCount + count > r->capInstrChunkSize) {
+        // start a new chunk, previous ones stay valid
+        int size = 2 * r->capInstrChunkSize;
+        if (size < r->capInstrCapacity) size = r->capInstrCapacity;
+        if (size < count) size = count;
+        r->capInstr = (Instr*) arena_alloc(r->arena, sizeof(Instr) * size);
+        r->capInstrCount = 0;
+        r->capInstrChunkSize = size;
     }
     instr = r->capInstr + r->capInstrCount;
-    r->capInstrCount++;
+    r->capInstrCount += count;
 
     return instr;
 }
 
+static void annotateStack(EmuState* es, Instr* instr);
+static void invalidateShadow(EmuState* es, Instr* instr);
+
 // capture a new instruction
 void capture(RContext* c, Instr* instr)
 {
@@ -710,14 +1400,30 @@ void capture(RContext* c, Instr* instr)
     if (r->showEmuSteps)
         printf("Capture '%s' (into %s + %d)\n",
                instr2string(instr, 0, cbb->fc), cbb_prettyName(cbb), cbb->count);
-
-    newInstr = newCapInstr(c);
-    if (c->e) return;
+    r->capturedInstrs++;
+
+    if (cbb->instr &&
+        ((cbb->instr + cbb->count != r->capInstr + r->capInstrCount) ||
+         (r->capInstrCount == r->capInstrChunkSize))) {
+        // cannot append in current chunk: move instructions of CBB along
+        newInstr = newCapInstrs(r, cbb->count + 1);
+        memcpy(newInstr, cbb->instr, sizeof(Instr) * cbb->count);
+        cbb->instr = newInstr;
+        newInstr += cbb->count;
+    }
+    else
+        newInstr = newCapInstrs(r, 1);
     if (cbb->instr == 0) {
         cbb->instr = newInstr;
         assert(cbb->count == 0);
     }
     copyInstr(newInstr, instr);
+    if (cbb->esID >= 0) {
+        annotateStack(r->es, newInstr);
+        invalidateShadow(r->es, newInstr);
+    }
+    else
+        newInstr->info_stack = SA_Unknown;
     cbb->count++;
 }
 
@@ -941,9 +1647,9 @@ CaptureState getStackState(EmuState* es, EmuValue* off)
     cs = CS_DYNAMIC;
     if (off->state.cState == CS_STATIC) {
         if (off->val >= (uint64_t) es->stackSize) cs = CS_DEAD;
-        if (off->val < es->stackAccessed - es->stackStart) cs = CS_DEAD;
+        else if (off->val < es->stackAccessed - es->stackStart) cs = CS_DEAD;
         else
-            return es->stackState[off->val].cState;
+            return stackMeta(es, off->val).cState;
     }
     return cs;
 }
@@ -954,31 +1660,23 @@ void getStackValue(EmuState* es, EmuValue* v, EmuValue* off)
     int i, count;
     CaptureState state;
 
-    assert(off->val < (uint64_t) es->stackSize);
-
     switch(v->type) {
-    case VT_16:
-        v->val = *(uint16_t*) (es->stack + off->val);
-        count = 2;
-        break;
-
-    case VT_32:
-        v->val = *(uint32_t*) (es->stack + off->val);
-        count = 4;
-        break;
-
-    case VT_64:
-        v->val = *(uint64_t*) (es->stack + off->val);
-        count = 8;
-        break;
-
+    case VT_16: count = 2; break;
+    case VT_32: count = 4; break;
+    case VT_64: count = 8; break;
     default: assert(0);
     }
+    assert(off->val + count <= (uint64_t) es->stackSize);
+
+    // little-endian
+    v->val = 0;
+    for(i = count - 1; i >= 0; i--)
+        v->val = (v->val << 8) | stackByte(es, off->val + i);
 
     if (off->state.cState == CS_STATIC) {
         state = getStackState(es, off);
         for(i=1; i<count; i++)
-            state = combineState(state, es->stackState[off->val + i].cState, 1);
+            state = combineState(state, stackMeta(es, off->val + i).cState, 1);
     }
     else
         state = CS_DYNAMIC;
@@ -1002,7 +1700,7 @@ void setStackState(EmuState* es, EmuValue* off, ValType vt, MetaState ms)
     }
 
     for(i=0; i<count; i++)
-        es->stackState[off->val + i] = ms;
+        setStackMeta(es, off->val + i, ms);
 
     if (es->stackStart + off->val < es->stackAccessed)
         es->stackAccessed = es->stackStart + off->val;
@@ -1012,28 +1710,19 @@ void setStackState(EmuState* es, EmuValue* off, ValType vt, MetaState ms)
 static
 void setStackValue(EmuState* es, EmuValue* v, EmuValue* off)
 {
-    uint16_t* a16;
-    uint32_t* a32;
-    uint64_t* a64;
+    int i, count;
 
     switch(v->type) {
-    case VT_16:
-        a16 = (uint16_t*) (es->stack + off->val);
-        *a16 = (uint16_t) v->val;
-        break;
-
-    case VT_32:
-        a32 = (uint32_t*) (es->stack + off->val);
-        *a32 = (uint32_t) v->val;
-        break;
-
-    case VT_64:
-        a64 = (uint64_t*) (es->stack + off->val);
-        *a64 = (uint64_t) v->val;
-        break;
-
+    case VT_16: count = 2; break;
+    case VT_32: count = 4; break;
+    case VT_64: count = 8; break;
     default: assert(0);
     }
+    assert(off->val + count <= (uint64_t) es->stackSize);
+
+    // little-endian
+    for(i = 0; i < count; i++)
+        setStackByte(es, off->val + i, (uint8_t) (v->val >> (8 * i)));
 
     if (es->stackStart + off->val < es->stackAccessed)
         es->stackAccessed = es->stackStart + off->val;
@@ -1049,12 +1738,61 @@ void getRegValue(EmuValue* v, EmuState* es, Reg r, ValType t)
     v->state = es->reg_state[r.ri];
 }
 
+// remember memory range read via static address (for specialization cache)
+static
+void logStaticRead(EmuState* es, uint64_t addr, int len)
+{
+    StaticRead* sr;
+
+    if (!es->logStaticReads) return;
+
+    // extend previous range if adjacent or overlapping
+    if (es->staticReadCount > 0) {
+        sr = &(es->staticRead[es->staticReadCount - 1]);
+        if ((addr >= sr->addr) && (addr <= sr->addr + sr->len)) {
+            if (addr + len > sr->addr + sr->len)
+                sr->len = addr + len - sr->addr;
+            return;
+        }
+    }
+
+    if (es->staticReadCount == es->staticReadCapacity) {
+        es->staticReadCapacity = es->staticReadCapacity ?
+                                 2 * es->staticReadCapacity : 16;
+        es->staticRead = (StaticRead*) realloc(es->staticRead,
+                             sizeof(StaticRead) * es->staticReadCapacity);
+    }
+    sr = &(es->staticRead[es->staticReadCount++]);
+    sr->addr = addr;
+    sr->len = len;
+}
+
+// read <len> bytes at <a> into <v>, using shadowed content where existing.
+// Returns the combined state, DEAD if any byte is not known
+static
+CaptureState getShadowValue(EmuState* es, uint64_t a, int len, uint64_t* v)
+{
+    CaptureState cs = CS_STATIC;
+    StackPage* p;
+    int i, off;
+
+    *v = 0;
+    for(i = len - 1; i >= 0; i--) {
+        p = shadowPage(es, a + i);
+        off = (a + i) % STACKPAGE_SIZE;
+        *v = (*v << 8) | (p ? p->data[off] : *(uint8_t*) (a + i));
+        cs = combineState(cs, p ? (CaptureState) p->cState[off] : CS_DEAD, 1);
+    }
+    return cs;
+}
+
 static
 void getMemValue(EmuValue* v, EmuValue* addr, EmuState* es, ValType t,
                  bool shouldBeStack)
 {
     EmuValue off;
-    int isOnStack;
+    CaptureState cs = CS_DEAD;
+    int isOnStack, len = 0;
 
     isOnStack = getStackOffset(es, addr, &off);
     if (isOnStack) {
@@ -1070,12 +1808,28 @@ void getMemValue(EmuValue* v, EmuValue* addr, EmuState* es, ValType t,
 
     v->type = t;
     switch(t) {
-    case VT_8:  v->val = *(uint8_t*) addr->val; break;
-    case VT_16: v->val = *(uint16_t*) addr->val; break;
-    case VT_32: v->val = *(uint32_t*) addr->val; break;
-    case VT_64: v->val = *(uint64_t*) addr->val; break;
+    case VT_8:  v->val = *(uint8_t*) addr->val; len = 1; break;
+    case VT_16: v->val = *(uint16_t*) addr->val; len = 2; break;
+    case VT_32: v->val = *(uint32_t*) addr->val; len = 4; break;
+    case VT_64: v->val = *(uint64_t*) addr->val; len = 8; break;
     default: assert(0);
     }
+
+    // content written before, if tracking memory
+    if (es->memPageCount > 0)
+        cs = getShadowValue(es, addr->val, len, &(v->val));
+    if ((v->state.cState == CS_DYNAMIC) && msIsStatic(addr->state)) {
+        if (cs != CS_DEAD) {
+            initMetaState(&(v->state), cs);
+            return;
+        }
+        // static address into data registered as constant
+        if (config_is_constant(es->cc, addr->val, len))
+            v->state.cState = CS_STATIC;
+    }
+
+    if (msIsStatic(v->state))
+        logStaticRead(es, addr->val, len);
 }
 
 // reading memory using segment override (fs/gs)
@@ -1123,6 +1877,20 @@ void getSegMemValue(EmuValue* v, EmuValue* addr, ValType t, OpSegOverride s)
     }
 }
 
+// number of bytes accessed with value type <t>
+static
+int valTypeLen(ValType t)
+{
+    switch(t) {
+    case VT_8:  return 1;
+    case VT_16: return 2;
+    case VT_32: return 4;
+    case VT_64: return 8;
+    default: assert(0);
+    }
+    return 0;
+}
+
 static
 void setMemValue(EmuValue* v, EmuValue* addr, EmuState* es, ValType t,
                  int shouldBeStack)
@@ -1132,6 +1900,7 @@ void setMemValue(EmuValue* v, EmuValue* addr, EmuState* es, ValType t,
     uint32_t* a32;
     uint64_t* a64;
     bool isOnStack;
+    int i, len;
 
     assert(v->type == t);
     isOnStack = getStackOffset(es, addr, &off);
@@ -1142,6 +1911,20 @@ void setMemValue(EmuValue* v, EmuValue* addr, EmuState* es, ValType t,
 
     assert(!shouldBeStack);
 
+    if (es->trackMem) {
+        // unknown location may be overwritten
+        if (!msIsStatic(addr->state)) {
+            dropShadowPages(es);
+            return;
+        }
+        // content is known only after setting the state
+        len = valTypeLen(t);
+        clearShadow(es, addr->val, len);
+        for(i = 0; i < len; i++)
+            setShadowByte(es, addr->val + i, (uint8_t) (v->val >> (8 * i)));
+        return;
+    }
+
     switch(t) {
     case VT_16:
         a16 = (uint16_t*) addr->val;
@@ -1167,6 +1950,7 @@ void setMemState(EmuState* es, EmuValue* addr, ValType t, MetaState ms,
 {
     EmuValue off;
     bool isOnStack;
+    int i;
 
     isOnStack = getStackOffset(es, addr, &off);
     if (isOnStack) {
@@ -1175,7 +1959,18 @@ void setMemState(EmuState* es, EmuValue* addr, ValType t, MetaState ms,
     }
     assert(!shouldBeStack);
 
-    // nothing to do: we do not keep track of state in memory
+    // without shadow, we do not keep track of state in memory
+    if (!es->trackMem) return;
+
+    if (!msIsStatic(addr->state)) {
+        dropShadowPages(es);
+        return;
+    }
+    // only static content is worth tracking
+    if (!msIsStatic(ms) && (ms.cState != CS_STACKRELATIVE))
+        initMetaState(&ms, CS_DEAD);
+    for(i = 0; i < valTypeLen(t); i++)
+        setShadowMeta(es, addr->val + i, ms);
 }
 
 // helper for getOpAddr()
@@ -1219,6 +2014,61 @@ void getOpAddr(EmuValue* v, EmuState* es, Operand* o)
         addRegToValue(v, es, o->ireg, o->scale);
 }
 
+// annotate stack access of an instruction on capturing, for use in
+// optimization passes (see optPassStackToReg).
+// Push/pop are captured after updating the stack pointer, any other
+// instruction with memory operand before its emulation
+static
+void annotateStack(EmuState* es, Instr* instr)
+{
+    EmuValue addr, off;
+    Operand* o = 0;
+
+    instr->info_stack = SA_None;
+    switch(instr->type) {
+    case IT_PUSH:
+    case IT_POP:
+        instr->info_stack = SA_Unknown;
+        if (opIsInd(&(instr->dst))) return;
+        if (es->reg_state[RI_SP].cState != CS_STACKRELATIVE) return;
+
+        instr->info_stackLen = (instr->dst.type == OT_Reg16 ||
+                                instr->dst.type == OT_Imm16) ? 2 : 8;
+        addr = emuValue(es->reg[RI_SP], VT_64, es->reg_state[RI_SP]);
+        if (instr->type == IT_POP)
+            addr.val -= instr->info_stackLen;
+        if (!getStackOffset(es, &addr, &off)) return;
+        instr->info_stack = SA_Slot;
+        instr->info_stackOff = off.val;
+        return;
+
+    case IT_RET:
+        // return address is above the stack of the rewritten function
+        return;
+
+    default: break;
+    }
+
+    if (opIsInd(&(instr->dst))) o = &(instr->dst);
+    else if (opIsInd(&(instr->src))) o = &(instr->src);
+    else if (opIsInd(&(instr->src2))) o = &(instr->src2);
+    if (!o) return;
+
+    // segment override (thread-local data) or RIP-relative: no stack
+    if ((o->seg != OSO_None) || (o->reg.rt == RT_IP)) return;
+
+    getOpAddr(&addr, es, o);
+    if (!getStackOffset(es, &addr, &off)) return;
+    if (!msIsStatic(off.state)) {
+        // dynamic address pointing into the stack: any slot may be accessed
+        instr->info_stack = SA_Unknown;
+        return;
+    }
+    instr->info_stack = SA_Slot;
+    instr->info_stackOff = off.val;
+    instr->info_stackLen = opTypeWidth(o) / 8;
+}
+
 // returned value v should be casted to expected type (8/16/32 bit)
 static
 void getOpValue(EmuValue* v, EmuState* es, Operand* o)
@@ -1516,7 +2366,7 @@ void captureBinaryOp(RContext* c, Instr* orig, EmuState* es, EmuValue* res)
 
     if (msIsStatic(res->state)) {
         // force results to become unknown?
-        if (c->r->cc->force_unknown[es->depth]) {
+        if (forceUnknown(c, es)) {
             initMetaState(&(res->state), CS_DYNAMIC);
         }
         else {
@@ -1577,13 +2427,39 @@ void captureBinaryOp(RContext* c, Instr* orig, EmuState* es, EmuValue* res)
     capture(c, &i);
 }
 
+// dst = src op src2, with src2 immediate
+static
+void captureTernaryOp(RContext* c, Instr* orig, EmuState* es, EmuValue* res)
+{
+    Instr i;
+
+    if (msIsStatic(res->state)) return;
+
+    initTernaryInstr(&i, orig->type,
+                     &(orig->dst), &(orig->src), &(orig->src2));
+    applyStaticToInd(&(i.src), es);
+    capture(c, &i);
+}
+
 // dst = unary-op dst
 static
 void captureUnaryOp(RContext* c, Instr* orig, EmuState* es, EmuValue* res)
 {
     Instr i;
 
-    if (msIsStatic(res->state)) return;
+    if (msIsStatic(res->state)) {
+        // out of budget: load known result into dst, as for binary ops
+        if (c->r->budgetExceeded)
+            initMetaState(&(res->state), CS_DYNAMIC);
+        // no need to update data if capture state is maintained
+        else if (opStateIsTracked(es, &(orig->dst)))
+            return;
+        initBinaryInstr(&i, IT_MOV, res->type,
+                        &(orig->dst), getImmOp(res->type, res->val));
+        applyStaticToInd(&(i.dst), es);
+        capture(c, &i);
+        return;
+    }
 
     initUnaryInstr(&i, orig->type, &(orig->dst));
     applyStaticToInd(&(i.dst), es);
@@ -1591,66 +2467,722 @@ void captureUnaryOp(RContext* c, Instr* orig, EmuState* es, EmuValue* res)
 }
 
 static
-void captureLea(RContext* c, Instr* orig, EmuState* es, EmuValue* res)
+void captureLea(RContext* c, Instr* orig, EmuState* es, EmuValue* res)
+{
+    Instr i;
+
+    assert(opIsReg(&(orig->dst)));
+    if (msIsStatic(res->state)) {
+        if (forceUnknown(c, es)) {
+            // force results to become unknown => load value into dest
+
+            initMetaState(&(res->state), CS_DYNAMIC);
+            initBinaryInstr(&i, IT_MOV, res->type,
+                            &(orig->dst), getImmOp(res->type, res->val));
+            capture(c, &i);
+        }
+        return;
+    }
+    initBinaryInstr(&i, IT_LEA, orig->vtype, &(orig->dst), &(orig->src));
+    applyStaticToInd(&(i.src), es);
+    capture(c, &i);
+}
+
+static
+void captureCmp(RContext* c, Instr* orig, EmuState* es, CaptureState cs)
+{
+    EmuValue opval;
+    Instr i;
+    Operand *o;
+
+    if (csIsStatic(cs)) return;
+
+    getOpValue(&opval, es, &(orig->dst));
+    if (msIsStatic(opval.state)) {
+        // cannot replace dst with imm: no such encoding => update dst
+        initBinaryInstr(&i, IT_MOV, opval.type,
+                        &(orig->dst), getImmOp(opval.type, opval.val));
+        capture(c, &i);
+    }
+
+    o = &(orig->src);
+    getOpValue(&opval, es, &(orig->src));
+    if (msIsStatic(opval.state))
+        o = getImmOp(opval.type, opval.val);
+
+    initBinaryInstr(&i, IT_CMP, orig->vtype, &(orig->dst), o);
+    applyStaticToInd(&(i.dst), es);
+    applyStaticToInd(&(i.src), es);
+    capture(c, &i);
+}
+
+static
+void captureTest(RContext* c, Instr* orig, EmuState* es, CaptureState cs)
+{
+    Instr i;
+
+    if (csIsStatic(cs)) return;
+
+    initBinaryInstr(&i, IT_TEST, orig->vtype, &(orig->dst), &(orig->src));
+    applyStaticToInd(&(i.dst), es);
+    applyStaticToInd(&(i.src), es);
+    capture(c, &i);
+}
+
+// helper for capturePassThrough: do capture state modifications
+// if provided as meta information (e.g. setting values in locations unknown)
+static
+void processPassThrough(Instr* i, EmuState* es)
+{
+    assert(i->ptLen >0);
+    if (i->ptSChange == SC_None) return;
+
+    switch(i->dst.type) {
+    case OT_Reg32:
+    case OT_Reg64:
+        if (opIsGPReg(&(i->dst)))
+            initMetaState(&(es->reg_state[i->dst.reg.ri]), CS_DYNAMIC);
+        break;
+
+        // memory locations not handled yet
+
+    default: assert(0);
+    }
+}
+
+static
+void captureVec(RContext* c, Instr* orig, EmuState* es)
+{
+    Instr i;
+    OperandEncoding oe = OE_None;
+
+    switch(orig->type) {
+    case IT_ADDSS:
+    case IT_ADDSD:
+    case IT_ADDPS:
+    case IT_ADDPD:
+        oe = OE_RM;
+        break;
+    default: assert(0);
+    }
+
+    // we need to apply static information to memory addressing
+
+    initSimpleInstr(&i, orig->type);
+    i.vtype  = orig->vtype;
+    i.form   = orig->form;
+
+    switch(oe) {
+    case OE_MR:
+        assert(opIsReg(&(orig->dst)) || opIsInd(&(orig->dst)));
+        assert(opIsReg(&(orig->src)));
+
+        copyOperand( &(i.dst), &(orig->dst));
+        copyOperand( &(i.src), &(orig->src));
+        applyStaticToInd(&(i.dst), es);
+        break;
+
+    case OE_RM:
+        assert(opIsReg(&(orig->src)) || opIsInd(&(orig->src)));
+        assert(opIsReg(&(orig->dst)));
+
+        copyOperand( &(i.dst), &(orig->dst));
+        copyOperand( &(i.src), &(orig->src));
+        applyStaticToInd(&(i.src), es);
+        break;
+
+    default: assert(0);
+    }
+    capture(c, &i);
+}
+
+
+static
+void capturePassThrough(RContext* c, Instr* orig, EmuState* es)
+{
+    Instr i;
+
+    // pass-through: may have influence to emu state
+    processPassThrough(orig, es);
+
+    assert(orig->ptLen >0);
+    initSimpleInstr(&i, orig->type);
+    i.vtype  = orig->vtype;
+
+    i.ptLen  = orig->ptLen;
+    i.ptEnc  = orig->ptEnc;
+    i.ptPSet = orig->ptPSet;
+    i.ptVexP = orig->ptVexP;
+    for(int j=0; j<orig->ptLen; j++)
+        i.ptOpc[j] = orig->ptOpc[j];
+
+    switch(orig->ptEnc) {
+    case OE_None:
+        break;
+
+    case OE_MR:
+        assert(opIsReg(&(orig->dst)) || opIsInd(&(orig->dst)));
+        assert(opIsReg(&(orig->src)));
+
+        i.form = OF_2;
+        copyOperand( &(i.dst), &(orig->dst));
+        copyOperand( &(i.src), &(orig->src));
+        applyStaticToInd(&(i.dst), es);
+        break;
+
+    case OE_RVM:
+        // used with AVX, 2nd operand is vector register
+        assert(opIsReg(&(orig->dst)));
+        assert(opIsReg(&(orig->src)));
+        assert(opIsReg(&(orig->src2)) || opIsInd(&(orig->src2)));
+
+        i.form = OF_3;
+        copyOperand( &(i.dst), &(orig->dst));
+        copyOperand( &(i.src), &(orig->src));
+        copyOperand( &(i.src2), &(orig->src2));
+        applyStaticToInd(&(i.src2), es);
+        break;
+
+    case OE_RM:
+        assert(opIsReg(&(orig->dst)));
+        assert(opIsReg(&(orig->src)) || opIsInd(&(orig->src)));
+
+        i.form = OF_2;
+        copyOperand( &(i.dst), &(orig->dst));
+        copyOperand( &(i.src), &(orig->src));
+        applyStaticToInd(&(i.src), es);
+        break;
+
+    default: assert(0);
+    }
+    capture(c, &i);
+}
+
+//----------------------------------------------------------
+// Vector registers
+//
+// The lower 128 bits of xmm0 - xmm15 are tracked as two lanes of 64 bit,
+// each with its own capture state. Moves, and scalar/packed arithmetic on
+// double/float values (SSE, without VEX encoding) are emulated: results
+// with static operands are not captured. As there are no immediate
+// operands for vector instructions, a static lane is not available in the
+// register of the generated code. Before capturing an instruction reading
+// the register, static lanes are loaded as constants (captured as
+// movq/movlpd/movhpd/movapd with immediate, which the generator loads
+// from a constant pool) and become dynamic.
+// In the same way, static stack data read by a captured vector instruction
+// gets stored before.
+
+static
+bool opIsSSEReg(Operand* o)
+{
+    return opIsReg(o) && ((o->reg.rt == RT_XMM) || (o->reg.rt == RT_YMM));
+}
+
+// capture loading of static lanes in <mask> of vector register <ri>
+static
+void materializeVReg(RContext* c, EmuState* es, RegIndex ri, int mask)
+{
+    MetaState* ms = es->vreg_state[ri];
+    Operand* dst = getRegOp(getReg(RT_XMM, ri));
+    bool s0 = (mask & 1) && msIsStatic(ms[0]);
+    bool s1 = (mask & 2) && msIsStatic(ms[1]);
+    Instr i;
+
+    if (s0 && s1 && (es->vreg[ri][1] != 0)) {
+        // 128-bit constant: upper half as 2nd source
+        Operand lo, hi;
+
+        copyOperand(&lo, getImmOp(VT_64, es->vreg[ri][0]));
+        copyOperand(&hi, getImmOp(VT_64, es->vreg[ri][1]));
+        initTernaryInstr(&i, IT_MOVAPD, dst, &lo, &hi);
+        capture(c, &i);
+        s1 = false;
+        initMetaState(&(ms[1]), CS_DYNAMIC);
+    }
+    else if (s0 && (msIsStatic(ms[1]) || (ms[1].cState == CS_DEAD)) &&
+             (es->vreg[ri][1] == 0)) {
+        // movq zero-extends into upper lane
+        initBinaryInstr(&i, IT_MOVQ, VT_None, dst,
+                        getImmOp(VT_64, es->vreg[ri][0]));
+        capture(c, &i);
+        s1 = false;
+        initMetaState(&(ms[1]), CS_DYNAMIC);
+    }
+    else if (s0) {
+        initBinaryInstr(&i, IT_MOVLPD, VT_None, dst,
+                        getImmOp(VT_64, es->vreg[ri][0]));
+        capture(c, &i);
+    }
+    if (s1) {
+        initBinaryInstr(&i, IT_MOVHPD, VT_None, dst,
+                        getImmOp(VT_64, es->vreg[ri][1]));
+        capture(c, &i);
+        initMetaState(&(ms[1]), CS_DYNAMIC);
+    }
+    if (s0)
+        initMetaState(&(ms[0]), CS_DYNAMIC);
+}
+
+// capture stores of static stack bytes in <len> bytes accessed via <o>
+static
+void materializeMem(RContext* c, EmuState* es, Operand* o, int len)
+{
+    EmuValue addr, off;
+    MetaState dyn;
+    Operand mo;
+    Instr i;
+    int p, b, n, count;
+
+    if (!opIsInd(o) || (o->seg != OSO_None) || (o->reg.rt == RT_IP)) return;
+    if (!opStateIsTracked(es, o)) return;
+
+    getOpAddr(&addr, es, o);
+    getStackOffset(es, &addr, &off);
+    initMetaState(&dyn, CS_DYNAMIC);
+    for(p = 0; p < len; p += 4) {
+        int base = off.val + p;
+        if (base + 4 > es->stackSize) break;
+
+        count = 0;
+        for(b = 0; b < 4; b++)
+            if (msIsStatic(stackMeta(es, base + b))) count++;
+        if (count == 0) continue;
+
+        // store 4 bytes at once if all static, otherwise the static bytes
+        for(b = 0; b < 4; b += n) {
+            ValType vt = (count == 4) ? VT_32 : VT_8;
+            uint64_t v = 0;
+
+            n = (count == 4) ? 4 : 1;
+            if (!msIsStatic(stackMeta(es, base + b))) continue;
+            for(int bb = n - 1; bb >= 0; bb--)
+                v = (v << 8) | stackByte(es, base + b + bb);
+
+            copyOperand(&mo, o);
+            mo.type = (vt == VT_32) ? OT_Ind32 : OT_Ind8;
+            mo.val += p + b;
+            initBinaryInstr(&i, IT_MOV, vt, &mo, getImmOp(vt, v));
+            applyStaticToInd(&(i.dst), es);
+            capture(c, &i);
+            for(int bb = 0; bb < n; bb++)
+                setStackMeta(es, base + b + bb, dyn);
+        }
+    }
+}
+
+// lanes of a vector value, with capture states
+typedef struct _VecValue {
+    uint64_t v[2];
+    MetaState ms[2];
+} VecValue;
+
+// bytes accessed by vector instruction <instr> in a memory operand
+static
+int vecMemLen(Instr* instr)
+{
+    switch(instr->type) {
+    case IT_MOVSS: case IT_MOVD:
+    case IT_ADDSS: case IT_SUBSS: case IT_MULSS: case IT_DIVSS:
+    case IT_MINSS: case IT_MAXSS: case IT_SQRTSS:
+        return 4;
+
+    case IT_MOVSD: case IT_MOVQ:
+    case IT_MOVLPD: case IT_MOVLPS: case IT_MOVHPD: case IT_MOVHPS:
+    case IT_ADDSD: case IT_SUBSD: case IT_MULSD: case IT_DIVSD:
+    case IT_MINSD: case IT_MAXSD: case IT_SQRTSD:
+        return 8;
+
+    default: break;
+    }
+    if ((instr->dst.type == OT_Ind256) || (instr->src.type == OT_Ind256) ||
+        (instr->src2.type == OT_Ind256))
+        return 32;
+    return 16;
+}
+
+static
+bool instrHasVReg(Instr* instr)
+{
+    return opIsSSEReg(&(instr->dst)) || opIsSSEReg(&(instr->src)) ||
+           opIsSSEReg(&(instr->src2));
+}
+
+// captured instruction <instr> may write to shadowed memory: forget about
+// content at its memory destination (everything if location is unknown).
+// For emulated writes, the new content gets set after capturing
+static
+void invalidateShadow(EmuState* es, Instr* instr)
+{
+    EmuValue addr;
+    Operand* o = &(instr->dst);
+
+    if ((es->memPageCount == 0) || !opIsInd(o)) return;
+    switch(instr->type) {
+    case IT_CMP: case IT_TEST: case IT_PUSH: case IT_CALL: case IT_JMPI:
+        return; // memory operand only read
+    default: break;
+    }
+
+    if (o->seg != OSO_None) {
+        dropShadowPages(es);
+        return;
+    }
+    getOpAddr(&addr, es, o);
+    if (!msIsStatic(addr.state)) {
+        dropShadowPages(es);
+        return;
+    }
+    clearShadow(es, addr.val,
+                instrHasVReg(instr) ? vecMemLen(instr) : opTypeWidth(o) / 8);
+}
+
+// before capturing vector instruction <instr>: load static lanes in
+// <dstMask>/<srcMask> of vector registers used as dst/src, and store
+// static stack data accessed (memory dst only if <dstMask> is set)
+static
+void vecCaptureBefore(RContext* c, EmuState* es, Instr* instr,
+                      int dstMask, int srcMask)
+{
+    int len = vecMemLen(instr);
+
+    if (opIsSSEReg(&(instr->dst)))
+        materializeVReg(c, es, instr->dst.reg.ri, dstMask);
+    else if (dstMask)
+        materializeMem(c, es, &(instr->dst), len);
+
+    if (opIsSSEReg(&(instr->src)))
+        materializeVReg(c, es, instr->src.reg.ri, srcMask);
+    else
+        materializeMem(c, es, &(instr->src), len);
+
+    if (opIsSSEReg(&(instr->src2)))
+        materializeVReg(c, es, instr->src2.reg.ri, 3);
+    else
+        materializeMem(c, es, &(instr->src2), len);
+}
+
+// after capturing vector instruction <instr>: lanes in <dstMask> of
+// vector register written, or stack data written become dynamic
+static
+void vecCaptureAfter(EmuState* es, Instr* instr, int dstMask)
+{
+    Operand* o = &(instr->dst);
+    EmuValue addr, off;
+    MetaState dyn;
+    int b, len;
+
+    initMetaState(&dyn, CS_DYNAMIC);
+    if (opIsSSEReg(o)) {
+        for(int l = 0; l < 2; l++)
+            if (dstMask & (1 << l))
+                es->vreg_state[o->reg.ri][l] = dyn;
+        return;
+    }
+    if (opIsGPReg(o)) {
+        es->reg_state[o->reg.ri] = dyn;
+        return;
+    }
+    if (!opIsInd(o) || (o->seg != OSO_None) || (o->reg.rt == RT_IP)) return;
+    if (!opStateIsTracked(es, o)) return;
+
+    // written stack range was stored before if static, see vecCaptureBefore
+    len = vecMemLen(instr);
+    getOpAddr(&addr, es, o);
+    getStackOffset(es, &addr, &off);
+    for(b = 0; (b < len) && (off.val + b < (uint64_t) es->stackSize); b++)
+        setStackMeta(es, off.val + b, dyn);
+    if (addr.val < es->stackAccessed)
+        es->stackAccessed = addr.val;
+}
+
+// capture vector instruction <instr>, with static lanes read loaded before
+static
+void captureVecInstr(RContext* c, EmuState* es, Instr* instr,
+                     int dstReadMask, int srcMask, int dstWriteMask)
+{
+    vecCaptureBefore(c, es, instr, dstReadMask, srcMask);
+    if (instr->ptLen > 0)
+        capturePassThrough(c, instr, es);
+    else
+        captureVec(c, instr, es);
+    vecCaptureAfter(es, instr, dstWriteMask);
+}
+
+// operands supported in emulation of vector instructions
+static
+bool vecOpSupported(Operand* o)
+{
+    if (opIsInd(o)) return (o->seg == OSO_None);
+    if (opIsGPReg(o)) return true;
+    return opIsReg(o) && (o->reg.rt == RT_XMM);
+}
+
+// get <len> bytes of vector operand <o> as lanes, zero-extended.
+// XMM registers always are returned with both lanes
+static
+void getVecValue(VecValue* vv, EmuState* es, Operand* o, int len)
+{
+    EmuValue addr, a, off, ev;
+    bool onStack;
+    int l;
+
+    for(l = 0; l < 2; l++) {
+        vv->v[l] = 0;
+        initMetaState(&(vv->ms[l]), CS_STATIC);
+    }
+
+    if (opIsSSEReg(o)) {
+        for(l = 0; l < 2; l++) {
+            vv->v[l] = es->vreg[o->reg.ri][l];
+            vv->ms[l] = es->vreg_state[o->reg.ri][l];
+        }
+        return;
+    }
+    if (opIsGPReg(o)) {
+        vv->v[0] = es->reg[o->reg.ri];
+        if (len == 4) vv->v[0] = (uint32_t) vv->v[0];
+        vv->ms[0] = es->reg_state[o->reg.ri];
+        return;
+    }
+
+    assert(opIsInd(o));
+    getOpAddr(&addr, es, o);
+    for(l = 0; l < (len + 7) / 8; l++) {
+        a = addr;
+        a.val += 8 * l;
+        onStack = getStackOffset(es, &a, &off);
+        // only read memory at known addresses
+        if ((onStack && (off.val + 8 > (uint64_t) es->stackSize)) ||
+            (!onStack && !msIsStatic(a.state))) {
+            initMetaState(&(vv->ms[l]), CS_DYNAMIC);
+            continue;
+        }
+        getMemValue(&ev, &a, es, (len == 4) ? VT_32 : VT_64, 0);
+        vv->v[l] = ev.val;
+        vv->ms[l] = ev.state;
+    }
+}
+
+// store <len> bytes of static lanes <vv> to memory operand <o>
+static
+void setVecMem(VecValue* vv, EmuState* es, Operand* o, int len)
+{
+    EmuValue addr, ev;
+    ValType vt = (len == 4) ? VT_32 : VT_64;
+
+    getOpAddr(&addr, es, o);
+    for(int l = 0; l < (len + 7) / 8; l++) {
+        ev.type = vt;
+        ev.val = vv->v[l];
+        ev.state = vv->ms[l];
+        setMemValue(&ev, &addr, es, vt, 0);
+        setMemState(es, &addr, vt, ev.state, 0);
+        addr.val += 8;
+    }
+}
+
+static
+__m128i vecLoad(VecValue* vv)
 {
-    Instr i;
+    return _mm_set_epi64x((int64_t) vv->v[1], (int64_t) vv->v[0]);
+}
 
-    assert(opIsReg(&(orig->dst)));
-    if (msIsStatic(res->state)) {
-        if (c->r->cc->force_unknown[es->depth]) {
-            // force results to become unknown => load value into dest
+// calculate result of vector arithmetic <it> with native instructions,
+// which guarantees exact results as in the rewritten code
+static
+void vecCalc(InstrType it, VecValue* res, VecValue* d, VecValue* s)
+{
+    __m128i a = vecLoad(d), b = vecLoad(s), r;
+    __m128d ad = _mm_castsi128_pd(a), bd = _mm_castsi128_pd(b);
+    __m128 af = _mm_castsi128_ps(a), bf = _mm_castsi128_ps(b);
 
-            initMetaState(&(res->state), CS_DYNAMIC);
-            initBinaryInstr(&i, IT_MOV, res->type,
-                            &(orig->dst), getImmOp(res->type, res->val));
-            capture(c, &i);
-        }
-        return;
+    switch(it) {
+    case IT_ADDSS:  r = _mm_castps_si128(_mm_add_ss(af, bf)); break;
+    case IT_ADDSD:  r = _mm_castpd_si128(_mm_add_sd(ad, bd)); break;
+    case IT_ADDPS:  r = _mm_castps_si128(_mm_add_ps(af, bf)); break;
+    case IT_ADDPD:  r = _mm_castpd_si128(_mm_add_pd(ad, bd)); break;
+    case IT_SUBSS:  r = _mm_castps_si128(_mm_sub_ss(af, bf)); break;
+    case IT_SUBSD:  r = _mm_castpd_si128(_mm_sub_sd(ad, bd)); break;
+    case IT_SUBPS:  r = _mm_castps_si128(_mm_sub_ps(af, bf)); break;
+    case IT_SUBPD:  r = _mm_castpd_si128(_mm_sub_pd(ad, bd)); break;
+    case IT_MULSS:  r = _mm_castps_si128(_mm_mul_ss(af, bf)); break;
+    case IT_MULSD:  r = _mm_castpd_si128(_mm_mul_sd(ad, bd)); break;
+    case IT_MULPS:  r = _mm_castps_si128(_mm_mul_ps(af, bf)); break;
+    case IT_MULPD:  r = _mm_castpd_si128(_mm_mul_pd(ad, bd)); break;
+    case IT_DIVSS:  r = _mm_castps_si128(_mm_div_ss(af, bf)); break;
+    case IT_DIVSD:  r = _mm_castpd_si128(_mm_div_sd(ad, bd)); break;
+    case IT_DIVPS:  r = _mm_castps_si128(_mm_div_ps(af, bf)); break;
+    case IT_DIVPD:  r = _mm_castpd_si128(_mm_div_pd(ad, bd)); break;
+    case IT_MINSS:  r = _mm_castps_si128(_mm_min_ss(af, bf)); break;
+    case IT_MINSD:  r = _mm_castpd_si128(_mm_min_sd(ad, bd)); break;
+    case IT_MINPS:  r = _mm_castps_si128(_mm_min_ps(af, bf)); break;
+    case IT_MINPD:  r = _mm_castpd_si128(_mm_min_pd(ad, bd)); break;
+    case IT_MAXSS:  r = _mm_castps_si128(_mm_max_ss(af, bf)); break;
+    case IT_MAXSD:  r = _mm_castpd_si128(_mm_max_sd(ad, bd)); break;
+    case IT_MAXPS:  r = _mm_castps_si128(_mm_max_ps(af, bf)); break;
+    case IT_MAXPD:  r = _mm_castpd_si128(_mm_max_pd(ad, bd)); break;
+    case IT_SQRTSS:
+        r = _mm_castps_si128(_mm_move_ss(af, _mm_sqrt_ss(bf))); break;
+    case IT_SQRTSD: r = _mm_castpd_si128(_mm_sqrt_sd(ad, bd)); break;
+    case IT_SQRTPS: r = _mm_castps_si128(_mm_sqrt_ps(bf)); break;
+    case IT_SQRTPD: r = _mm_castpd_si128(_mm_sqrt_pd(bd)); break;
+    case IT_XORPS: case IT_XORPD: case IT_PXOR:
+        r = _mm_xor_si128(a, b); break;
+    case IT_ANDPS: case IT_ANDPD:
+        r = _mm_and_si128(a, b); break;
+    case IT_ORPS: case IT_ORPD:
+        r = _mm_or_si128(a, b); break;
+    case IT_ANDNPS: case IT_ANDNPD:
+        r = _mm_andnot_si128(a, b); break;
+    default: assert(0);
     }
-    initBinaryInstr(&i, IT_LEA, orig->vtype, &(orig->dst), &(orig->src));
-    applyStaticToInd(&(i.src), es);
-    capture(c, &i);
+    _mm_storeu_si128((__m128i*) res->v, r);
 }
 
+// emulate SSE move or arithmetic instruction <instr> on tracked lanes.
+// Returns false if not supported (to be captured as pass-through)
 static
-void captureCmp(RContext* c, Instr* orig, EmuState* es, CaptureState cs)
+bool processVec(RContext* c, Instr* instr)
 {
-    EmuValue opval;
-    Instr i;
-    Operand *o;
+    EmuState* es = c->r->es;
+    Operand* dst = &(instr->dst);
+    Operand* src = &(instr->src);
+    VecValue d, s, res;
+    int len = vecMemLen(instr);
+    int readMask, writeMask, srcMask, l;
+    bool isMove = false, mergeLow = false, isStatic;
+    CaptureState cs;
 
-    if (csIsStatic(cs)) return;
+    // no VEX encoding (3 operands, upper ymm lanes)
+    if ((instr->ptLen > 0) && (instr->ptVexP != VEX_No)) return false;
+    if ((instr->form != OF_2) || forceUnknown(c, es)) return false;
+    if (!vecOpSupported(dst) || !vecOpSupported(src)) return false;
+    if (!opIsSSEReg(dst) && !opIsSSEReg(src)) return false;
 
-    getOpValue(&opval, es, &(orig->dst));
-    if (msIsStatic(opval.state)) {
-        // cannot replace dst with imm: no such encoding => update dst
-        initBinaryInstr(&i, IT_MOV, opval.type,
-                        &(orig->dst), getImmOp(opval.type, opval.val));
-        capture(c, &i);
+    switch(instr->type) {
+    case IT_MOVSS:
+    case IT_MOVSD:
+        // register-to-register moves merge into lower lane
+        isMove = true;
+        mergeLow = opIsReg(src);
+        break;
+    case IT_MOVD:
+    case IT_MOVQ:
+    case IT_MOVAPS: case IT_MOVAPD: case IT_MOVUPS: case IT_MOVUPD:
+    case IT_MOVDQA: case IT_MOVDQU:
+        isMove = true;
+        break;
+
+    case IT_ADDSS: case IT_SUBSS: case IT_MULSS: case IT_DIVSS:
+    case IT_MINSS: case IT_MAXSS: case IT_SQRTSS:
+    case IT_ADDSD: case IT_SUBSD: case IT_MULSD: case IT_DIVSD:
+    case IT_MINSD: case IT_MAXSD: case IT_SQRTSD:
+    case IT_ADDPS: case IT_SUBPS: case IT_MULPS: case IT_DIVPS:
+    case IT_MINPS: case IT_MAXPS: case IT_SQRTPS:
+    case IT_ADDPD: case IT_SUBPD: case IT_MULPD: case IT_DIVPD:
+    case IT_MINPD: case IT_MAXPD: case IT_SQRTPD:
+    case IT_XORPS: case IT_XORPD: case IT_ORPS: case IT_ORPD:
+    case IT_ANDPS: case IT_ANDPD: case IT_ANDNPS: case IT_ANDNPD:
+    case IT_PXOR:
+        if (!opIsSSEReg(dst)) return false;
+        break;
+
+    default:
+        return false;
     }
 
-    o = &(orig->src);
-    getOpValue(&opval, es, &(orig->src));
-    if (msIsStatic(opval.state))
-        o = getImmOp(opval.type, opval.val);
+    getVecValue(&s, es, src, len);
+    srcMask = (len == 16) ? 3 : 1;
 
-    initBinaryInstr(&i, IT_CMP, orig->vtype, &(orig->dst), o);
-    applyStaticToInd(&(i.dst), es);
-    applyStaticToInd(&(i.src), es);
-    capture(c, &i);
-}
+    if (isMove && !opIsSSEReg(dst)) {
+        if (opIsGPReg(dst)) {
+            // movd/movq to GP register
+            if (msIsStatic(s.ms[0])) {
+                es->reg[dst->reg.ri] = (len == 4) ? (uint32_t) s.v[0] : s.v[0];
+                es->reg_state[dst->reg.ri] = s.ms[0];
+                return true;
+            }
+        }
+        else {
+            // store to memory
+            isStatic = msIsStatic(s.ms[0]) && ((len < 16) || msIsStatic(s.ms[1]));
+            if (isStatic && opStateIsTracked(es, dst)) {
+                setVecMem(&s, es, dst, len);
+                return true;
+            }
+            captureVecInstr(c, es, instr, 0, srcMask, 0);
+            // keep static data stored into non-stack memory as known
+            if (isStatic && !opStateIsTracked(es, dst)) {
+                EmuValue addr;
+                getOpAddr(&addr, es, dst);
+                if (msIsStatic(addr.state)) setVecMem(&s, es, dst, len);
+            }
+            return true;
+        }
+        captureVecInstr(c, es, instr, 0, srcMask, 0);
+        return true;
+    }
 
-static
-void captureTest(RContext* c, Instr* orig, EmuState* es, CaptureState cs)
-{
-    Instr i;
+    getVecValue(&d, es, dst, 16);
+    if (isMove) {
+        readMask = (mergeLow && (len == 4)) ? 1 : 0;
+        writeMask = mergeLow ? 1 : 3;
+        res = s;
+        if (len < 16) {
+            // loads from memory and GP registers zero-extend
+            res.v[1] = 0;
+            initMetaState(&(res.ms[1]), CS_STATIC);
+            if (len == 4) res.v[0] = (uint32_t) s.v[0];
+        }
+        if (mergeLow && (len == 4)) {
+            res.v[0] = (d.v[0] & 0xffffffff00000000) | (uint32_t) s.v[0];
+            cs = combineState(d.ms[0].cState, s.ms[0].cState, 1);
+            initMetaState(&(res.ms[0]), cs);
+        }
+    }
+    else {
+        bool isSqrt = (instr->type == IT_SQRTSD) ||
+                      (instr->type == IT_SQRTPS) || (instr->type == IT_SQRTPD);
+
+        writeMask = (len == 16) ? 3 : 1;
+        readMask = isSqrt ? 0 : writeMask;
+        vecCalc(instr->type, &res, &d, &s);
+        for(l = 0; l < 2; l++) {
+            if (!(writeMask & (1 << l))) continue;
+            cs = s.ms[l].cState;
+            if (readMask & (1 << l))
+                cs = combineState(d.ms[l].cState, cs, 0);
+            initMetaState(&(res.ms[l]), cs);
+        }
 
-    if (csIsStatic(cs)) return;
+        // zeroing idiom: result independent of register content
+        if (opIsSSEReg(src) && (src->reg.ri == dst->reg.ri) &&
+            ((instr->type == IT_XORPS) || (instr->type == IT_XORPD) ||
+             (instr->type == IT_PXOR) ||
+             (instr->type == IT_ANDNPS) || (instr->type == IT_ANDNPD))) {
+            for(l = 0; l < 2; l++) {
+                res.v[l] = 0;
+                initMetaState(&(res.ms[l]), CS_STATIC);
+            }
+        }
+    }
 
-    initBinaryInstr(&i, IT_TEST, orig->vtype, &(orig->dst), &(orig->src));
-    applyStaticToInd(&(i.dst), es);
-    applyStaticToInd(&(i.src), es);
-    capture(c, &i);
+    isStatic = true;
+    for(l = 0; l < 2; l++)
+        if ((writeMask & (1 << l)) && !msIsStatic(res.ms[l]))
+            isStatic = false;
+
+    if (!isStatic) {
+        captureVecInstr(c, es, instr, readMask, srcMask, writeMask);
+        return true;
+    }
+    for(l = 0; l < 2; l++) {
+        if (!(writeMask & (1 << l))) continue;
+        es->vreg[dst->reg.ri][l] = res.v[l];
+        es->vreg_state[dst->reg.ri][l] = res.ms[l];
+    }
+    return true;
 }
 
 void captureRet(RContext* c, Instr* orig, EmuState* es)
@@ -1668,136 +3200,210 @@ void captureRet(RContext* c, Instr* orig, EmuState* es)
             capture(c, &i);
         }
     }
+    // floating-point values are returned in xmm0 (and xmm1 for pairs
+    // if configured to return floating-point): load static lanes
+    materializeVReg(c, es, RI_XMM0, 3);
+    if (c->r->cc->hasReturnFP)
+        materializeVReg(c, es, RI_XMM1, 3);
     capture(c, orig);
 }
 
-// helper for capturePassThrough: do capture state modifications
-// if provided as meta information (e.g. setting values in locations unknown)
+//----------------------------------------------------------
+// Loop handling
+//
+// A back-edge is a jump to an address not behind the jump itself.
+// Without further action, a loop with static induction variable gets
+// fully unrolled, as the emulator state differs in each iteration.
+// Depending on the loop policy, static registers changed in the loop
+// instead are made dynamic at a back-edge: their current value is loaded
+// as immediate, and the back-edge goes to a CBB for the loop head with
+// this generalized state. Capturing the loop body with that state is
+// expected to reach the same state at the back-edge again, closing the
+// loop. Static data not changed in the loop still is used to specialize
+// the loop body.
+
+// loop with back-edge to <head> from jump ending before <tail>
 static
-void processPassThrough(Instr* i, EmuState* es)
+LoopInfo* getLoop(Rewriter* r, uint64_t head, uint64_t tail)
 {
-    assert(i->ptLen >0);
-    if (i->ptSChange == SC_None) return;
+    LoopInfo* li;
+    int i;
 
-    switch(i->dst.type) {
-    case OT_Reg32:
-    case OT_Reg64:
-        if (opIsGPReg(&(i->dst)))
-            initMetaState(&(es->reg_state[i->dst.reg.ri]), CS_DYNAMIC);
-        break;
+    for(i = 0; i < r->loopCount; i++) {
+        li = r->loop + i;
+        if ((li->head == head) && (li->tail == tail)) return li;
+    }
 
-        // memory locations not handled yet
+    if (r->loopCount >= r->loopCapacity) {
+        int capacity = r->loopCapacity ? 2 * r->loopCapacity : 8;
+        r->loop = (LoopInfo*) realloc(r->loop, sizeof(LoopInfo) * capacity);
+        r->loopCapacity = capacity;
+    }
+    li = r->loop + r->loopCount++;
+    li->head = head;
+    li->tail = tail;
+    li->backEdges = 0;
+    li->rolled = false;
+    for(i = 0; i < RI_GPMax; i++)
+        li->regStatic[i] = false;
+    for(i = 0; i < RI_XMMMax; i++)
+        li->vregStatic[i][0] = li->vregStatic[i][1] = false;
+
+    return li;
+}
 
-    default: assert(0);
+// remember static register values at back-edge of <li>
+static
+void loopRemember(LoopInfo* li, EmuState* es)
+{
+    for(int i = 0; i < RI_GPMax; i++) {
+        li->regStatic[i] = (i != RI_SP) && msIsStatic(es->reg_state[i]);
+        li->reg[i] = es->reg[i];
+    }
+    for(int i = 0; i < RI_XMMMax; i++) {
+        for(int l = 0; l < 2; l++) {
+            li->vregStatic[i][l] = msIsStatic(es->vreg_state[i][l]);
+            li->vreg[i][l] = es->vreg[i][l];
+        }
     }
 }
 
+// make static registers dynamic which changed since last back-edge of <li>
 static
-void captureVec(RContext* c, Instr* orig, EmuState* es)
+void loopGeneralize(RContext* c, LoopInfo* li)
 {
+    EmuState* es = c->r->es;
     Instr i;
-    OperandEncoding oe = OE_None;
 
-    switch(orig->type) {
-    case IT_ADDSS:
-    case IT_ADDSD:
-    case IT_ADDPS:
-    case IT_ADDPD:
-        oe = OE_RM;
-        break;
-    default: assert(0);
+    for(int ri = 0; ri < RI_GPMax; ri++) {
+        if ((ri == RI_SP) || !msIsStatic(es->reg_state[ri])) continue;
+        if (li->regStatic[ri] && (li->reg[ri] == es->reg[ri])) continue;
+
+        // update register value to static value, as for makeDynamic
+        initBinaryInstr(&i, IT_MOV, VT_64,
+                        getRegOp(getReg(RT_GP64, ri)),
+                        getImmOp(VT_64, es->reg[ri]));
+        capture(c, &i);
+        initMetaState(&(es->reg_state[ri]), CS_DYNAMIC);
     }
+    for(int ri = 0; ri < RI_XMMMax; ri++) {
+        int mask = 0;
+
+        for(int l = 0; l < 2; l++) {
+            if (!msIsStatic(es->vreg_state[ri][l])) continue;
+            if (li->vregStatic[ri][l] && (li->vreg[ri][l] == es->vreg[ri][l]))
+                continue;
+            mask |= 1 << l;
+        }
+        materializeVReg(c, es, ri, mask);
+    }
+}
 
-    // we need to apply static information to memory addressing
+// called on back-edge to <head> from jump ending before <tail>, with the
+// CBB of the jump still open. Returns the loop body copy to continue with
+// if the loop is kept rolled, or -1 to continue unrolling
+static
+int loopBackEdge(RContext* c, uint64_t head, uint64_t tail)
+{
+    Rewriter* r = c->r;
+    CaptureConfig* cc = r->cc;
+    EmuState* es = r->es;
+    LoopInfo* li;
+    int i, peel;
 
-    initSimpleInstr(&i, orig->type);
-    i.vtype  = orig->vtype;
-    i.form   = orig->form;
+    if ((cc->loopPolicy == DBREW_LOOP_UNROLL) && !r->budgetExceeded)
+        return -1;
 
-    switch(oe) {
-    case OE_MR:
-        assert(opIsReg(&(orig->dst)) || opIsInd(&(orig->dst)));
-        assert(opIsReg(&(orig->src)));
+    li = getLoop(r, head, tail);
+    li->backEdges++;
+    // next iteration: loops nested inside get entered again
+    for(i = 0; i < r->loopCount; i++) {
+        LoopInfo* inner = r->loop + i;
+        if ((inner == li) || (inner->head < head) || (inner->tail > tail))
+            continue;
+        inner->backEdges = 0;
+        inner->rolled = false;
+    }
 
-        copyOperand( &(i.dst), &(orig->dst));
-        copyOperand( &(i.src), &(orig->src));
-        applyStaticToInd(&(i.dst), es);
-        break;
+    // changes between two back-edges are needed to find loop variables
+    peel = (cc->loopPolicy == DBREW_LOOP_PEEL) ? cc->loopCount : 2;
+    if (peel < 2) peel = 2;
+    // out of budget: stop unrolling at once, generalizing all registers
+    if (r->budgetExceeded) peel = 1;
+    if (li->backEdges < peel) {
+        // keep unrolling
+        loopRemember(li, es);
+        return -1;
+    }
 
-    case OE_RM:
-        assert(opIsReg(&(orig->src)) || opIsInd(&(orig->src)));
-        assert(opIsReg(&(orig->dst)));
+    if (r->showEmuSteps)
+        printf("Loop back-edge to %s (%d. time): keep rolled\n",
+               prettyAddress(head, config_find_function(r, head)),
+               li->backEdges);
 
-        copyOperand( &(i.dst), &(orig->dst));
-        copyOperand( &(i.src), &(orig->src));
-        applyStaticToInd(&(i.src), es);
-        break;
+    loopGeneralize(c, li);
+    loopRemember(li, es);
 
-    default: assert(0);
+    if (!li->rolled) {
+        li->rolled = true;
+        return 0;
     }
-    capture(c, &i);
+    if (cc->loopPolicy != DBREW_LOOP_PARTIAL) return 0;
+    return (es->loopCopy + 1) % cc->loopCount;
 }
 
-
+// body copy for state at <target> when leaving partially unrolled loop
+// at jump ending before <tail>; otherwise current copy is kept
 static
-void capturePassThrough(RContext* c, Instr* orig, EmuState* es)
+int loopExitCopy(Rewriter* r, uint64_t tail, uint64_t target)
 {
-    Instr i;
-
-    // pass-through: may have influence to emu state
-    processPassThrough(orig, es);
-
-    assert(orig->ptLen >0);
-    initSimpleInstr(&i, orig->type);
-    i.vtype  = orig->vtype;
+    LoopInfo *li, *inner = 0;
+    int i;
 
-    i.ptLen  = orig->ptLen;
-    i.ptEnc  = orig->ptEnc;
-    i.ptPSet = orig->ptPSet;
-    i.ptVexP = orig->ptVexP;
-    for(int j=0; j<orig->ptLen; j++)
-        i.ptOpc[j] = orig->ptOpc[j];
+    if (r->es->loopCopy == 0) return 0;
 
-    switch(orig->ptEnc) {
-    case OE_None:
-        break;
+    // innermost rolled loop containing the jump
+    for(i = 0; i < r->loopCount; i++) {
+        li = r->loop + i;
+        if (!li->rolled || (li->head >= tail) || (li->tail < tail)) continue;
+        if (!inner || (li->head > inner->head)) inner = li;
+    }
+    if (!inner || ((target >= inner->head) && (target < inner->tail)))
+        return r->es->loopCopy;
+    return 0;
+}
 
-    case OE_MR:
-        assert(opIsReg(&(orig->dst)) || opIsInd(&(orig->dst)));
-        assert(opIsReg(&(orig->src)));
+// static back-edge <instr> to <target>: if the loop is kept rolled, end
+// the current CBB with a jump to a CBB for the loop head, and return true
+bool captureBackEdge(RContext* c, Instr* instr, uint64_t target)
+{
+    Rewriter* r = c->r;
+    uint64_t tail = instr->addr + instr->len;
+    CBB *cbb, *next;
+    int copy, esID;
 
-        i.form = OF_2;
-        copyOperand( &(i.dst), &(orig->dst));
-        copyOperand( &(i.src), &(orig->src));
-        applyStaticToInd(&(i.dst), es);
-        break;
+    if (!instrIsJcc(instr->type) && (instr->type != IT_JMP)) return false;
+    // already ended by a conditional branch with dynamic condition?
+    if (r->currentCapBB == 0) return false;
+    if (target >= tail) return false;
 
-    case OE_RVM:
-        // used with AVX, 2nd operand is vector register
-        assert(opIsReg(&(orig->dst)));
-        assert(opIsReg(&(orig->src)));
-        assert(opIsReg(&(orig->src2)) || opIsInd(&(orig->src2)));
+    copy = loopBackEdge(c, target, tail);
+    if (copy < 0) return false;
 
-        i.form = OF_3;
-        copyOperand( &(i.dst), &(orig->dst));
-        copyOperand( &(i.src), &(orig->src));
-        copyOperand( &(i.src2), &(orig->src2));
-        applyStaticToInd(&(i.src2), es);
-        break;
+    cbb = popCaptureBB(r);
+    cbb->endType = IT_JMP;
 
-    case OE_RM:
-        assert(opIsReg(&(orig->dst)));
-        assert(opIsReg(&(orig->src)) || opIsInd(&(orig->src)));
+    r->es->loopCopy = copy;
+    esID = saveEmuState(c);
+    if (c->e) return true;
+    next = getCaptureBB(c, target, esID);
+    if (c->e) return true;
 
-        i.form = OF_2;
-        copyOperand( &(i.dst), &(orig->dst));
-        copyOperand( &(i.src), &(orig->src));
-        applyStaticToInd(&(i.src), es);
-        break;
+    cbb->nextBranch = next;
+    cbb->nextFallThrough = next;
+    pushCaptureBB(c, next);
 
-    default: assert(0);
-    }
-    capture(c, &i);
+    return true;
 }
 
 // this ends a captured BB, queuing new paths to be traced
@@ -1806,22 +3412,39 @@ void captureJcc(RContext* c, InstrType it,
                 uint64_t branchTarget, uint64_t fallthroughTarget)
 {
     CBB *cbb, *cbbBR, *cbbFT;
-    int esID;
+    int esFT, esBR, copyFT, copyBR = -1;
     Rewriter* r = c->r;
 
     // do not end BB and assume jump fixed?
     // TODO: this config is a hack which should be removed
     if (r->cc->branches_known) return;
 
+    // back-edge of loop kept rolled? Register updates get captured
+    // before the branch, valid for both paths
+    if (branchTarget < fallthroughTarget)
+        copyBR = loopBackEdge(c, branchTarget, fallthroughTarget);
+    if (c->e) return;
+    if (copyBR < 0)
+        copyBR = loopExitCopy(r, fallthroughTarget, branchTarget);
+    copyFT = loopExitCopy(r, fallthroughTarget, fallthroughTarget);
+
     cbb = popCaptureBB(r);
     cbb->endType = it;
     // use static prediction: 1st follow branch if backwards
     // need to remember is this for code generation
     cbb->preferBranch = (branchTarget < fallthroughTarget);
 
-    esID = saveEmuState(c);
-    cbbFT = getCaptureBB(c, fallthroughTarget, esID);
-    cbbBR = getCaptureBB(c, branchTarget, esID);
+    r->es->loopCopy = copyFT;
+    esFT = saveEmuState(c);
+    if (c->e) return;
+    esBR = esFT;
+    if (copyBR != copyFT) {
+        r->es->loopCopy = copyBR;
+        esBR = saveEmuState(c);
+        if (c->e) return;
+    }
+    cbbFT = getCaptureBB(c, fallthroughTarget, esFT);
+    cbbBR = getCaptureBB(c, branchTarget, esBR);
     if (c->e) return;
 
     cbb->nextFallThrough = cbbFT;
@@ -1851,8 +3474,8 @@ static
 void setEmulatorError(RContext* c, Instr* instr,
                       ErrorType et, const char* d)
 {
-    static Error e;
-    static char buf[100];
+    Rewriter* r = c->r;
+    char* buf = r->errorDesc;
 
     if (d == 0) {
         d = buf;
@@ -1865,8 +3488,8 @@ void setEmulatorError(RContext* c, Instr* instr,
         else
             d = 0;
     }
-    setError(&e, et, EM_Emulator, c->r, d);
-    c->e = &e;
+    setError(&r->error, et, EM_Emulator, r, d);
+    c->e = &r->error;
 }
 
 static
@@ -1875,12 +3498,9 @@ void emulateRet(RContext* c, Instr* instr)
     Rewriter* r = c->r;
     EmuState* es = c->r->es;
 
-    // all caller-save / parameter registers become dead, but not return
-    // TODO: includes vector registers xmm1-15
-    static RegIndex ri[8] =
-    { RI_DI, RI_SI, RI_D, RI_C, RI_8, RI_9, RI_10, RI_11 };
-    for(int i=0; i<8; i++)
-        initMetaState(&(es->reg_state[ri[i]]), CS_DEAD);
+    // caller-save registers keep their state: with interprocedural
+    // register allocation, the caller may rely on a callee to not change
+    // some of them
 
     if (r->addInliningHints) {
         Instr i;
@@ -1907,6 +3527,70 @@ void emulateRet(RContext* c, Instr* instr)
     }
 }
 
+// Kept calls
+//
+// Depending on the call policy configured for the target, a call gets
+// inlined (default) or kept as call in the generated code, possibly to a
+// replacement. As static stores to the stack are not captured, stack
+// arguments would be missing: calls are only kept on request, where the
+// user knows that all arguments are passed in registers. Calls to unknown
+// targets still are not supported. Registers not preserved by the callee
+// according to the calling convention get loaded with their static values
+// before the call: they include the argument registers and al (number of
+// vector registers used for varargs), and the compiler may know that the
+// callee leaves some of them unchanged. Afterwards, these registers become
+// dynamic, and the known content of memory written before is dropped.
+// Stack data is not passed to the callee: a call with a stack address in
+// an argument register cannot be kept.
+
+static RegIndex callArgGP[] = {
+    RI_DI, RI_SI, RI_D, RI_C, RI_8, RI_9
+};
+
+static RegIndex callClobberGP[] = {
+    RI_A, RI_C, RI_D, RI_SI, RI_DI, RI_8, RI_9, RI_10, RI_11
+};
+
+// does a call pass an address of stack data in an argument register?
+static
+bool callPassesStack(EmuState* es)
+{
+    for(int i = 0; i < (int) (sizeof(callArgGP) / sizeof(RegIndex)); i++)
+        if (es->reg_state[callArgGP[i]].cState == CS_STACKRELATIVE)
+            return true;
+    return false;
+}
+
+// capture call to <target> kept in generated code
+static
+void captureCall(RContext* c, EmuState* es, uint64_t target)
+{
+    Instr i;
+    int j, l;
+
+    for(j = 0; j < (int) (sizeof(callClobberGP) / sizeof(RegIndex)); j++) {
+        RegIndex ri = callClobberGP[j];
+        if (!msIsStatic(es->reg_state[ri])) continue;
+        initBinaryInstr(&i, IT_MOV, VT_64, getRegOp(getReg(RT_GP64, ri)),
+                        getImmOp(VT_64, es->reg[ri]));
+        capture(c, &i);
+    }
+    for(j = 0; j < RI_XMMMax; j++)
+        materializeVReg(c, es, j, 3);
+
+    initUnaryInstr(&i, IT_CALL, getImmOp(VT_64, target));
+    capture(c, &i);
+
+    for(j = 0; j < (int) (sizeof(callClobberGP) / sizeof(RegIndex)); j++)
+        initMetaState(&(es->reg_state[callClobberGP[j]]), CS_DYNAMIC);
+    for(j = 0; j < RI_XMMMax; j++)
+        for(l = 0; l < 2; l++)
+            initMetaState(&(es->vreg_state[j][l]), CS_DYNAMIC);
+    for(j = 0; j < FT_Max; j++)
+        initMetaState(&(es->flag_state[j]), CS_DEAD);
+    dropShadowPages(es);
+}
+
 // process an instruction
 // if this changes control flow, c.exit is set accordingly
 void processInstr(RContext* c, Instr* instr)
@@ -1919,6 +3603,11 @@ void processInstr(RContext* c, Instr* instr)
     EmuState* es = c->r->es;
 
     if (instr->ptLen > 0) {
+        if (processVec(c, instr)) return;
+        if (instrHasVReg(instr)) {
+            captureVecInstr(c, es, instr, 3, 3, 3);
+            return;
+        }
         // memory addressing in captured instructions depends on emu state
         capturePassThrough(c, instr, es);
         return;
@@ -1965,19 +3654,31 @@ void processInstr(RContext* c, Instr* instr)
         break;
 
     case IT_CALL: {
-        // TODO: keep call. For now, we always inline
+        FunctionConfig* fc;
+        DBrewCallPolicy policy;
+
         getOpValue(&v1, es, &(instr->dst));
-        if (es->depth >= MAX_CALLDEPTH) {
-            setEmulatorError(c, instr, ET_BufferOverflow,
-                             "Call depth too deep");
-            return;
-        }
         if (!msIsStatic(v1.state)) {
             // call target must be known
             setEmulatorError(c, instr, ET_UnsupportedOperands,
                              "Call to unknown target not supported");
             return;
         }
+        fc = config_find_function(r, v1.val);
+        if (fc && (fc->callPolicy == DBREW_CALL_REPLACE)) {
+            v1.val = fc->replacement;
+            fc = config_find_function(r, v1.val);
+        }
+        policy = fc ? fc->callPolicy : DBREW_CALL_INLINE;
+        if ((policy != DBREW_CALL_INLINE) && !callPassesStack(es)) {
+            captureCall(c, es, v1.val);
+            break;
+        }
+        if ((r->maxCallDepth > 0) && (es->depth >= r->maxCallDepth)) {
+            setEmulatorError(c, instr, ET_BufferOverflow,
+                             "Call depth limit exceeded");
+            return;
+        }
 
         Instr i;
         Operand o;
@@ -1988,6 +3689,12 @@ void processInstr(RContext* c, Instr* instr)
         processInstr(c, &i);
         if (c->e) return; // error
 
+        if (es->depth == es->retStackCapacity) {
+            int capacity = es->retStackCapacity ? 2 * es->depth : 8;
+            es->ret_stack = (uint64_t*) realloc(es->ret_stack,
+                                                sizeof(uint64_t) * capacity);
+            es->retStackCapacity = capacity;
+        }
         es->ret_stack[es->depth++] = o.val;
 
         if (r->addInliningHints) {
@@ -2103,8 +3810,15 @@ void processInstr(RContext* c, Instr* instr)
         break;
 
     case IT_IMUL:
-        getOpValue(&v1, es, &(instr->dst));
-        getOpValue(&v2, es, &(instr->src));
+        if (instr->form == OF_3) {
+            // dst = src * imm
+            getOpValue(&v1, es, &(instr->src));
+            getOpValue(&v2, es, &(instr->src2));
+        }
+        else {
+            getOpValue(&v1, es, &(instr->dst));
+            getOpValue(&v2, es, &(instr->src));
+        }
 
         assert(opIsGPReg(&(instr->dst)));
         assert(v1.type == v2.type);
@@ -2135,7 +3849,10 @@ void processInstr(RContext* c, Instr* instr)
         initMetaState(&(vres.state), cs);
 
         // for capture we need state of dst, do before setting dst
-        captureBinaryOp(c, instr, es, &vres);
+        if (instr->form == OF_3)
+            captureTernaryOp(c, instr, es, &vres);
+        else
+            captureBinaryOp(c, instr, es, &vres);
         setOpValue(&vres, es, &(instr->dst));
         setOpState(vres.state, es, &(instr->dst));
         break;
@@ -2779,8 +4496,8 @@ void processInstr(RContext* c, Instr* instr)
     case IT_ADDSD:
     case IT_ADDPS:
     case IT_ADDPD:
-        // just always capture without emulation
-        captureVec(c, instr, es);
+        if (!processVec(c, instr))
+            captureVecInstr(c, es, instr, 3, 3, 3);
         break;
 
     default:
@@ -2807,6 +4524,9 @@ uint64_t processKnownTargets(RContext* c, uint64_t f)
     }
 
     if (f == (uint64_t) makeStatic) {
+        // value may come from data unknown to specialization cache
+        if (!msIsStatic(es->reg_state[RI_DI]))
+            es->staticReadsComplete = false;
         initMetaState(&(es->reg_state[RI_DI]), CS_STATIC2);
     }
 
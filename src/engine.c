@@ -24,6 +24,8 @@
 #include <string.h>
 
 #include "common.h"
+#include "async.h"
+#include "cache.h"
 #include "printer.h"
 #include "engine.h"
 #include "emulate.h"
@@ -31,12 +33,13 @@
 #include "generate.h"
 #include "expr.h"
 #include "error.h"
+#include "opt.h"
+#include "vector.h"
 
 
 Rewriter* allocRewriter(void)
 {
     Rewriter* r;
-    int i;
 
     r = (Rewriter*) malloc(sizeof(Rewriter));
 
@@ -45,30 +48,73 @@ Rewriter* allocRewriter(void)
     r->decInstrCount = 0;
     r->decInstrCapacity = 0;
     r->decInstr = 0;
+    r->decInstrChunkCount = 0;
+    r->decInstrChunk = 0;
 
     r->decBBCount = 0;
     r->decBBCapacity = 0;
+    r->decBBAllocated = 0;
     r->decBB = 0;
+    r->decBBHashSize = 0;
+    r->decBBHash = 0;
+
+    r->arena = 0;
 
     r->capInstrCount = 0;
     r->capInstrCapacity = 0;
+    r->capInstrChunkSize = 0;
     r->capInstr = 0;
 
     r->capBBCount = 0;
     r->capBBCapacity = 0;
     r->capBB = 0;
+    r->capBBHashSize = 0;
+    r->capBBHash = 0;
     r->currentCapBB = 0;
     r->capStackTop = -1;
+    r->capStackCapacity = 0;
+    r->capStack = 0;
+    r->loopCount = 0;
+    r->loopCapacity = 0;
+    r->loop = 0;
     r->genOrderCount = 0;
+    r->genOrderCapacity = 0;
+    r->genOrder = 0;
+    r->poolCount = 0;
+    r->poolCapacity = 0;
+    r->pool = 0;
+    r->poolRefCount = 0;
+    r->poolRefCapacity = 0;
+    r->poolRef = 0;
+    r->doProfile = false;
+    r->profiledCode = 0;
+    r->maxCallDepth = 32;
+    r->maxSavedStates = 10000;
+    r->maxCapInstrs = 0;
+    r->maxCodeSize = 0;
+    r->maxMillis = 0;
+    r->maxEmuSteps = 0;
+    r->budgetInstrs = 0;
+    r->capturedInstrs = 0;
+    r->emuSteps = 0;
+    r->captureStart = 0;
+    r->budgetExceeded = false;
 
     r->savedStateCount = 0;
-    for(i=0; i< SAVEDSTATE_MAX; i++)
-        r->savedState[i] = 0;
+    r->savedStateCapacity = 0;
+    r->savedState = 0;
+    r->savedStateHash = 0;
+    r->esHashSize = 0;
+    r->esHash = 0;
 
     r->capCodeCapacity = 0;
     r->cs = 0;
     r->generatedCodeAddr = 0;
     r->generatedCodeSize = 0;
+    r->generatedDataSize = 0;
+    r->cache = 0;
+    r->useGlobalCache = false;
+    r->job = 0;
 
     r->cc = 0;
     r->vreq = VR_None;
@@ -80,6 +126,11 @@ Rewriter* allocRewriter(void)
     // optimization passes
     r->addInliningHints = true;
     r->doCopyPass = true;
+    r->doInlinedFramePass = true;
+    r->doStackToRegPass = true;
+    r->doStrengthReducePass = true;
+    r->doDeadCodePass = true;
+    r->doPeepholePass = true;
 
     // default: debug off
     r->showDecoding = false;
@@ -95,66 +146,51 @@ Rewriter* allocRewriter(void)
 
 void initRewriter(Rewriter* r)
 {
-    if (r->decInstr == 0) {
-        // default
-        if (r->decInstrCapacity == 0) r->decInstrCapacity = 500;
-        r->decInstr = (Instr*) malloc(sizeof(Instr) * r->decInstrCapacity);
-    }
-    r->decInstrCount = 0;
+    resetDecoding(r);
 
-    if (r->decBB == 0) {
-        // default
-        if (r->decBBCapacity == 0) r->decBBCapacity = 50;
-        r->decBB = (DBB*) malloc(sizeof(DBB) * r->decBBCapacity);
-    }
-    r->decBBCount = 0;
+    if (r->arena == 0)
+        r->arena = arena_new(64 * 1024);
 
-    if (r->capInstr == 0) {
-        // default
-        if (r->capInstrCapacity == 0) r->capInstrCapacity = 500;
-        r->capInstr = (Instr*) malloc(sizeof(Instr) * r->capInstrCapacity);
-    }
-    r->capInstrCount = 0;
+    // default: initial size of first chunk
+    if (r->capInstrCapacity == 0) r->capInstrCapacity = 500;
 
     if (r->capBB == 0) {
         // default
         if (r->capBBCapacity == 0) r->capBBCapacity = 50;
-        r->capBB = (CBB*) malloc(sizeof(CBB) * r->capBBCapacity);
+        r->capBB = (CBB**) malloc(sizeof(CBB*) * r->capBBCapacity);
     }
-    r->capBBCount = 0;
-    r->currentCapBB = 0;
-    r->genOrderCount = 0;
+    resetCapturing(r);
 
     if (r->cs == 0) {
         if (r->capCodeCapacity == 0) r->capCodeCapacity = 3000;
         if (r->capCodeCapacity >0)
             r->cs = initCodeStorage(r->capCodeCapacity);
     }
-    if (r->cs) {
-        r->cs->used = 0;
-        // any previously generated code is invalid
-        r->generatedCodeAddr = 0;
-        r->generatedCodeSize = 0;
-    }
-
-    if (r->ePool == 0)
-        r->ePool = expr_allocPool(1000);
+    // previously generated code stays valid until released
+    r->generatedCodeAddr = 0;
+    r->generatedCodeSize = 0;
+    r->generatedDataSize = 0;
 }
 
 void freeRewriter(Rewriter* r)
 {
     if (!r) return;
 
-    free(r->decInstr);
-    free(r->decBB);
-    free(r->capInstr);
-    free(r->capBB);
-    free(r->cc);
+    async_wait(r);
+    freeDecoding(r);
+    freeCapturing(r);
+    free(r->capStack);
+    free(r->genOrder);
+    free(r->pool);
+    free(r->poolRef);
+    config_free(r->cc);
 
     freeEmuState(r);
     if (r->cs)
         freeCodeStorage(r->cs);
-    expr_freePool(r->ePool);
+    if (!r->useGlobalCache)
+        cache_free(r->cache);
+    arena_free(r->arena);
 
     free(r);
 }
@@ -177,7 +213,6 @@ void freeRewriter(Rewriter* r)
  * The state can be accessed as c->es afterwards (e.g. for the return
  * value of the emulated function)
  */
-static
 Error* emulateAndCapture(Rewriter* r, int parCount, uint64_t* par)
 {
     // calling convention x86-64: parameters are stored in registers
@@ -196,14 +231,17 @@ Error* emulateAndCapture(Rewriter* r, int parCount, uint64_t* par)
     cxt.r = r;
     cxt.e = 0;
 
-    if (!r->es)
+    if (!r->es) {
         r->es = allocEmuState(1024);
+        r->es->arena = r->arena;
+    }
     resetEmuState(r->es);
     es = r->es;
+    es->logStaticReads = cache_enabled(r);
+    es->cc = r->cc;
+    es->trackMem = r->cc && r->cc->trackMemory;
 
     resetCapturing(r);
-    if (r->cs)
-        r->cs->used = 0;
 
     for(i=0;i<parCount;i++) {
         MetaState* ms = &(es->reg_state[parReg[i]]);
@@ -228,7 +266,7 @@ Error* emulateAndCapture(Rewriter* r, int parCount, uint64_t* par)
     cbb = (esID >= 0) ? getCaptureBB(&cxt, r->func, esID) : 0;
     if (cxt.e) return cxt.e;
     // new CBB has to be first in this rewriter (we start with it in Pass 2)
-    assert(cbb = r->capBB);
+    assert(cbb == r->capBB[0]);
     pushCaptureBB(&cxt, cbb);
     if (cxt.e) return cxt.e;
     assert(r->capStackTop == 0);
@@ -297,6 +335,7 @@ Error* emulateAndCapture(Rewriter* r, int parCount, uint64_t* par)
             es->regIP = instr->addr + instr->len;
 
             cxt.exit = 0;
+            checkBudget(&cxt);
             processInstr(&cxt, instr);
             if (cxt.e) {
                 assert(isErrorSet(cxt.e));
@@ -319,6 +358,11 @@ Error* emulateAndCapture(Rewriter* r, int parCount, uint64_t* par)
             // fall through at end of BB
             nextbb_addr = instr->addr + instr->len;
         }
+        else if (captureBackEdge(&cxt, instr, nextbb_addr)) {
+            // loop kept rolled, continue with next CBB to capture
+            if (cxt.e) return cxt.e;
+            continue;
+        }
         if (es->depth < 0) {
             // finish this path
             assert(instr->type == IT_RET);
@@ -334,30 +378,41 @@ Error* emulateAndCapture(Rewriter* r, int parCount, uint64_t* par)
     return 0;
 }
 
-Error* vEmulateAndCapture(Rewriter* r, va_list args)
+// fetch parameters for function to rewrite according to config
+Error* vGetParameters(Rewriter* r, va_list args, uint64_t* par)
 {
-    static Error e;
+    Error* e = &r->error;
     int i, parCount;
-    uint64_t par[6];
 
     parCount = r->cc->parCount;
     if (parCount == -1) {
-        setError(&e, ET_InvalidRequest, EM_Rewriter, r,
+        setError(e, ET_InvalidRequest, EM_Rewriter, r,
                  "number of parameters not set");
-        return &e;
+        return e;
     }
 
-    if (parCount > 6) {
-        setError(&e, ET_InvalidRequest, EM_Rewriter, r,
+    if (parCount > CC_MAXPARAM) {
+        setError(e, ET_InvalidRequest, EM_Rewriter, r,
                  "number of parameters >6 not supported");
-        return &e;
+        return e;
     }
 
     for(i = 0; i < parCount; i++) {
         par[i] = va_arg(args, uint64_t);
     }
 
-    return emulateAndCapture(r, parCount, par);
+    return 0;
+}
+
+Error* vEmulateAndCapture(Rewriter* r, va_list args)
+{
+    Error* e;
+    uint64_t par[CC_MAXPARAM];
+
+    e = vGetParameters(r, args, par);
+    if (e) return e;
+
+    return emulateAndCapture(r, r->cc->parCount, par);
 }
 
 
@@ -369,19 +424,14 @@ Error* vEmulateAndCapture(Rewriter* r, va_list args)
 static
 Instr* optPassCopy(RContext* c, CBB* cbb)
 {
-    Instr *first, *instr;
+    Instr* first;
     int i;
 
     if (cbb->count == 0) return 0;
 
-    first = newCapInstr(c);
-    if (!first) return 0;
-    copyInstr(first, cbb->instr);
-    for(i = 1; i < cbb->count; i++) {
-        instr = newCapInstr(c);
-        if (!instr) return 0;
-        copyInstr(instr, cbb->instr + i);
-    }
+    first = newCapInstrs(c->r, cbb->count);
+    for(i = 0; i < cbb->count; i++)
+        copyInstr(first + i, cbb->instr + i);
     return first;
 }
 
@@ -409,10 +459,22 @@ void runOptsOnCaptured(RContext* c)
 {
     Rewriter* r = c->r;
     for(int i = 0; i < r->capBBCount; i++) {
-        CBB* cbb = r->capBB + i;
+        CBB* cbb = r->capBB[i];
         optPass(c, cbb);
         if (c->e) return;
     }
+
+    if (r->doInlinedFramePass)
+        optPassInlinedFrames(c);
+    if (r->doStackToRegPass)
+        optPassStackToReg(c);
+    if (r->doStrengthReducePass)
+        optPassStrengthReduce(c);
+    // promoted slots may leave dead register moves
+    if (r->doDeadCodePass)
+        optPassDeadCode(c);
+    if (r->doPeepholePass)
+        optPassPeephole(c);
 }
 
 
@@ -420,15 +482,179 @@ void runOptsOnCaptured(RContext* c)
 // generate x86 code from instructions captured in vEmulateAndCapture
 //
 
+// Block layout: the more likely successor of a conditional branch is
+// placed directly behind a CBB as fall-through, inverting the condition
+// if this is the branch target. Likelihood comes from edge counts of a
+// profiling run if available, otherwise from the static hint of capturing.
+// Successors never reached in a profiling run are moved to the end.
+
+// trailing bytes of CBB with conditional branch, maximally needed:
+// pc-relative Jcc (6) + PC-relative Jmp (5) + alignment (15) = 26
+#define GEN_HOLESIZE 26
+// with profiling: Jcc (6) + 2x counter increment (22) and Jmp (5) = 60
+#define GEN_COUNTSIZE 22
+#define GEN_PROFILESIZE (6 + 2 * (GEN_COUNTSIZE + 5))
+
+// does <cbb> end with a jump to other CBBs: conditional branch, or
+// unconditional jump with both successors the same (rolled loops)
+static
+bool hasJump(CBB* cbb)
+{
+    return instrIsJcc(cbb->endType) || (cbb->endType == IT_JMP);
+}
+
+// are edges of <cbb> counted in code instrumented for profiling?
+static
+bool isProfiled(Rewriter* r, CBB* cbb)
+{
+    return r->doProfile && instrIsJcc(cbb->endType);
+}
+
+// is the branch target of <cbb> the more likely successor?
+static
+bool branchIsHot(CBB* cbb)
+{
+    if (cbb->countBranch + cbb->countFallThrough > 0)
+        return cbb->countBranch > cbb->countFallThrough;
+    return cbb->preferBranch;
+}
+
+// was an edge of <cbb> never taken in a profiling run executing <cbb>?
+static
+bool edgeIsCold(CBB* cbb, bool branch)
+{
+    uint64_t count = branch ? cbb->countBranch : cbb->countFallThrough;
+
+    return (count == 0) && (cbb->countBranch + cbb->countFallThrough > 0);
+}
+
+// write Jcc of <cbb> (negated if <invert>) to <target> into <buf>.
+// returns number of bytes written
+static
+int genJcc(uint8_t* buf, CBB* cbb, uint64_t target, bool jcc8, bool invert)
+{
+    uint8_t cc;
+    int diff;
+
+    switch (cbb->endType) {
+    case IT_JO:  cc = 0x0; break;
+    case IT_JNO: cc = 0x1; break;
+    case IT_JC:  cc = 0x2; break;
+    case IT_JNC: cc = 0x3; break;
+    case IT_JZ:  cc = 0x4; break;
+    case IT_JNZ: cc = 0x5; break;
+    case IT_JBE: cc = 0x6; break;
+    case IT_JA:  cc = 0x7; break;
+    case IT_JS:  cc = 0x8; break;
+    case IT_JNS: cc = 0x9; break;
+    case IT_JP:  cc = 0xA; break;
+    case IT_JNP: cc = 0xB; break;
+    case IT_JL:  cc = 0xC; break;
+    case IT_JGE: cc = 0xD; break;
+    case IT_JLE: cc = 0xE; break;
+    case IT_JG:  cc = 0xF; break;
+    default: assert(0);
+    }
+    // lowest bit of condition code negates the condition
+    if (invert)
+        cc ^= 1;
+
+    if (jcc8) {
+        diff = target - ((uint64_t) buf + 2);
+        assert((diff >= -128) && (diff <= 127));
+        buf[0] = 0x70 + cc;
+        buf[1] = (int8_t) diff;
+        return 2;
+    }
+    diff = target - ((uint64_t) buf + 6);
+    buf[0] = 0x0F;
+    buf[1] = 0x80 + cc;
+    *(int32_t*)(buf+2) = diff;
+    return 6;
+}
+
+static
+int genJmp(uint8_t* buf, uint64_t target, bool jmp8)
+{
+    int diff;
+
+    if (jmp8) {
+        diff = target - ((uint64_t) buf + 2);
+        assert((diff >= -128) && (diff <= 127));
+        buf[0] = 0xEB;
+        buf[1] = (int8_t) diff;
+        return 2;
+    }
+    buf[0] = 0xE9;
+    *(int32_t*)(buf+1) = (int32_t) (target - ((uint64_t) buf + 5));
+    return 5;
+}
+
+// can a jump ending at <end> reach <target> with 8-bit displacement?
+static
+bool fitsRel8(uint64_t target, uint64_t end)
+{
+    int64_t diff = (int64_t) (target - end);
+
+    return (diff >= -128) && (diff <= 127);
+}
+
+// bytes needed for jumps at end of <cbb> with conditional branch
+static
+int jumpSize(CBB* cbb)
+{
+    int size = 0;
+
+    if (cbb->nextBranch != cbb->nextFallThrough)
+        size += cbb->genJcc8 ? 2 : 6;
+    if (cbb->genJump)
+        size += cbb->genJmp8 ? 2 : 5;
+    return size;
+}
+
+// write increment of 64-bit <counter>, keeping flags and red zone
+static
+int genCount(uint8_t* buf, uint64_t* counter)
+{
+    static const uint8_t code[GEN_COUNTSIZE] = {
+        0x48, 0x8d, 0x64, 0x24, 0x80,       // lea -0x80(%rsp),%rsp
+        0x9c,                               // pushfq
+        0x48, 0xff, 0x05, 0, 0, 0, 0,       // incq counter(%rip)
+        0x9d,                               // popfq
+        0x48, 0x8d, 0xa4, 0x24, 0x80, 0, 0, 0 // lea 0x80(%rsp),%rsp
+    };
+
+    memcpy(buf, code, GEN_COUNTSIZE);
+    *(int32_t*)(buf+9) = (int32_t) ((uint64_t) counter - ((uint64_t) buf + 13));
+    return GEN_COUNTSIZE;
+}
+
 // result in c->rewrittenFunc/rewrittenSize
 void generateBinaryFromCaptured(RContext *c)
 {
     CBB* cbb;
+    CBB** cold = 0;
+    int coldCount = 0;
 
     // Pass 1: generating code for BBs without linking them
 
     Rewriter* r = c->r;
-    uint8_t* buf0 = reserveCodeStorage(r->cs, 0);
+    bool profile = r->doProfile;
+    int holeSize = profile ? GEN_PROFILESIZE : GEN_HOLESIZE;
+
+    // the generated function has to fit into one chunk of code storage:
+    // reserve space needed at most (alignment, instructions, holes,
+    // cacheline-aligned counters when profiling)
+    int maxSize = profile ? 127 : 63;
+    // alignment of constant pool
+    maxSize += 63;
+    for(int i = 0; i < r->capBBCount; i++) {
+        CBB* bb = r->capBB[i];
+        for(int j = 0; j < bb->count; j++)
+            maxSize += generateMaxSize(bb->instr + j);
+        maxSize += holeSize + (profile ? 16 : 0);
+    }
+    uint8_t* buf0 = reserveCodeStorage(r->cs, maxSize);
 
     // align address to cacheline boundary (multiple of 64)
     int cl_off = ((uint64_t)buf0) & 63;
@@ -437,21 +663,30 @@ void generateBinaryFromCaptured(RContext *c)
         buf0 = reserveCodeStorage(r->cs, 0);
     }
 
-    int usedPass0 = r->cs->used;
     int genOrder0 = r->genOrderCount;
+    resetConstPool(r);
 
     assert(r->capStackTop == -1);
     assert(r->capBBCount > 0);
     // start with first CBB created
-    pushCaptureBB(c, r->capBB);
+    pushCaptureBB(c, r->capBB[0]);
     if (c->e) return;
 
-    while(r->capStackTop >= 0) {
+    while((r->capStackTop >= 0) || (coldCount > 0)) {
+        // cold CBBs go last, in the order they were found
+        if (r->capStackTop < 0)
+            pushCaptureBB(c, cold[--coldCount]);
+
         cbb = r->capStack[r->capStackTop];
         r->capStackTop--;
         if (cbb->size >= 0) continue;
 
-        assert(r->genOrderCount < GENORDER_MAX);
+        // keep space for terminating 0
+        if (r->genOrderCount + 1 >= r->genOrderCapacity) {
+            int capacity = r->genOrderCapacity ? 2 * r->genOrderCapacity : 32;
+            r->genOrder = (CBB**) realloc(r->genOrder, sizeof(CBB*) * capacity);
+            r->genOrderCapacity = capacity;
+        }
         r->genOrder[r->genOrderCount++] = cbb;
 
         Error* e = (Error*) generate(r, cbb);
@@ -459,147 +694,288 @@ void generateBinaryFromCaptured(RContext *c)
             assert(isErrorSet(e));
             r->generatedCodeAddr = 0;
             r->generatedCodeSize = 0;
+            r->generatedDataSize = 0;
             c->e = e;
+            free(cold);
             return;
         }
 
-        if (instrIsJcc(cbb->endType)) {
-            // FIXME: order according to branch preference
-            pushCaptureBB(c, cbb->nextBranch);
-            pushCaptureBB(c, cbb->nextFallThrough);
-            if (c->e) return;
+        if (hasJump(cbb)) {
+            // entry pushed last will be processed first: the likely one
+            bool hotBranch = branchIsHot(cbb);
+            CBB* hot = hotBranch ? cbb->nextBranch : cbb->nextFallThrough;
+            CBB* other = hotBranch ? cbb->nextFallThrough : cbb->nextBranch;
+
+            if (edgeIsCold(cbb, !hotBranch)) {
+                cold = (CBB**) realloc(cold, sizeof(CBB*) * (coldCount + 1));
+                memmove(cold + 1, cold, sizeof(CBB*) * coldCount);
+                cold[0] = other;
+                coldCount++;
+            }
+            else
+                pushCaptureBB(c, other);
+            pushCaptureBB(c, hot);
         }
 
         // add a hole with size maximally needed (shrinks in pass 2)
-        // pc-relative Jcc (6) + PC-relative Jmp (5) + alignment (15) = 26
-        useCodeStorage(r->cs, 26);
+        useCodeStorage(r->cs, holeSize);
+    }
+    free(cold);
+    if (profile) {
+        // space for aligned profile counters (allocated in pass 2)
+        useCodeStorage(r->cs, 63 + 16 * (r->genOrderCount - genOrder0));
     }
+    // space for aligned constant pool (placed in pass 2)
+    if (r->poolCount > 0)
+        useCodeStorage(r->cs, 63 + 16 * r->poolCount);
 
     // Pass 2: determine trailing bytes needed for each BB
 
-    // reuse code storage: set pointer to buf0
-    // This is fine as we shrink the holes between BBs as needed
-    uint8_t* buf1 = buf0;
-
+    // jumps needed at end of CBBs, given the order of CBBs
+    int jccCount = 0;
     r->genOrder[r->genOrderCount] = 0;
     for(int i=genOrder0; i < r->genOrderCount; i++) {
-        int diff;
+        CBB* next;
 
         cbb = r->genOrder[i];
-        cbb->addr2 = (uint64_t) buf1;
-        buf1 += cbb->size;
-
-        if (cbb->size > 0) {
-            assert(cbb->count>0);
-            assert(cbb->addr2 <= cbb->addr1);
-            // copy manually, dst may overlap src!
-            char* src = (char*)cbb->addr1;
-            char* dst = (char*)cbb->addr2;
-            for(int j=0; j<cbb->size; j++)
-                dst[j] = src[j];
+        if (!hasJump(cbb)) continue;
+
+        if (instrIsJcc(cbb->endType)) jccCount++;
+        if (isProfiled(r, cbb)) continue;
+
+        // with branch target placed next, jump on inverted condition.
+        // no Jcc at all if both successors are the same
+        next = r->genOrder[i+1];
+        cbb->genInvert = (next == cbb->nextBranch) &&
+                         (next != cbb->nextFallThrough);
+        cbb->genJump = !cbb->genInvert && (cbb->nextFallThrough != next);
+    }
+
+    // Branch relaxation: starting with long forms, switch to short forms
+    // of Jcc/Jmp if the target is in reach with current addresses. Code
+    // only shrinks, so distances never grow: iterate until nothing changes.
+    // Reuse code storage: this is fine as we shrink the holes between BBs
+    uint8_t* buf1;
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        buf1 = buf0;
+        for(int i=genOrder0; i < r->genOrderCount; i++) {
+            cbb = r->genOrder[i];
+            cbb->addr2 = (uint64_t) buf1;
+            buf1 += cbb->size;
+            if (hasJump(cbb))
+                buf1 += isProfiled(r, cbb) ? GEN_PROFILESIZE : jumpSize(cbb);
         }
-        if (!instrIsJcc(cbb->endType)) continue;
-
-        diff = cbb->nextBranch->addr1 - (cbb->addr1 + cbb->size);
-        if ((diff > -120) && (diff < 120))
-            cbb->genJcc8 = true;
-        buf1 += cbb->genJcc8 ? 2 : 6;
-        if (cbb->nextFallThrough != r->genOrder[i+1]) {
-            cbb->genJump = true;
-            buf1 += 5;
+
+        for(int i=genOrder0; i < r->genOrderCount; i++) {
+            uint64_t end;
+
+            cbb = r->genOrder[i];
+            if (!hasJump(cbb) || isProfiled(r, cbb)) continue;
+
+            end = cbb->addr2 + cbb->size;
+            if (cbb->nextBranch != cbb->nextFallThrough) {
+                CBB* target = cbb->genInvert ? cbb->nextFallThrough
+                                             : cbb->nextBranch;
+                if (!cbb->genJcc8 && fitsRel8(target->addr2, end + 2)) {
+                    cbb->genJcc8 = true;
+                    changed = true;
+                }
+                end += cbb->genJcc8 ? 2 : 6;
+            }
+            if (cbb->genJump && !cbb->genJmp8 &&
+                fitsRel8(cbb->nextFallThrough->addr2, end + 2)) {
+                cbb->genJmp8 = true;
+                changed = true;
+            }
         }
     }
+
+    // move generated code of CBBs to final addresses
+    for(int i=genOrder0; i < r->genOrderCount; i++) {
+        cbb = r->genOrder[i];
+        if (cbb->size == 0) continue;
+
+        assert(cbb->count>0);
+        assert(cbb->addr2 <= cbb->addr1);
+        // copy manually, dst may overlap src!
+        char* src = (char*)cbb->addr1;
+        char* dst = (char*)cbb->addr2;
+        for(int j=0; j<cbb->size; j++)
+            dst[j] = src[j];
+    }
+
+    // profile counters (taken, not taken) in own cachelines behind code
+    uint8_t* codeEnd = buf1;
+    uint64_t* counter = 0;
+    if (profile && (jccCount > 0)) {
+        buf1 = (uint8_t*) (((uint64_t) buf1 + 63) & ~63ul);
+        counter = (uint64_t*) buf1;
+        memset(counter, 0, 2 * sizeof(uint64_t) * jccCount);
+        buf1 += 2 * sizeof(uint64_t) * jccCount;
+    }
+
+    // constants loaded RIP-relative, in own cachelines behind code
+    buf1 = (uint8_t*) placeConstPool(r, (uint64_t) buf1);
+
     if (r->showEmuSteps) {
         printf("Generated: %d bytes (pass1: %d)\n",
-               (int)(buf1 - buf0), r->cs->used - usedPass0);
+               (int)(buf1 - buf0),
+               (int)(reserveCodeStorage(r->cs, 0) - buf0));
         //printf(" at %lx\n", (uint64_t) buf0);
     }
 
     // free bytes used in holes
-    r->cs->used = usedPass0 + (buf1 - buf0);
+    resetCodeStorage(r->cs, buf1);
 
     // Pass 3: fill trailing bytes with jump instructions
 
     for(int i=0; i < r->genOrderCount; i++) {
         uint8_t* buf;
-        uint64_t buf_addr;
-        int diff;
 
         cbb = r->genOrder[i];
-        if (!instrIsJcc(cbb->endType)) continue;
+        if (!hasJump(cbb)) continue;
 
         buf = (uint8_t*) (cbb->addr2 + cbb->size);
-        buf_addr = (uint64_t) buf;
-        if (cbb->genJcc8) {
-            diff = cbb->nextBranch->addr2 - (buf_addr + 2);
-            assert((diff > -128) && (diff < 127));
-
-            switch (cbb->endType) {
-            case IT_JO:  buf[0] = 0x70; break;
-            case IT_JNO: buf[0] = 0x71; break;
-            case IT_JC:  buf[0] = 0x72; break;
-            case IT_JNC: buf[0] = 0x73; break;
-            case IT_JZ:  buf[0] = 0x74; break;
-            case IT_JNZ: buf[0] = 0x75; break;
-            case IT_JBE: buf[0] = 0x76; break;
-            case IT_JA:  buf[0] = 0x77; break;
-            case IT_JS:  buf[0] = 0x78; break;
-            case IT_JNS: buf[0] = 0x79; break;
-            case IT_JP:  buf[0] = 0x7A; break;
-            case IT_JNP: buf[0] = 0x7B; break;
-            case IT_JL:  buf[0] = 0x7C; break;
-            case IT_JGE: buf[0] = 0x7D; break;
-            case IT_JLE: buf[0] = 0x7E; break;
-            case IT_JG:  buf[0] = 0x7F; break;
-            default: assert(0);
-            }
-            buf[1] = (int8_t) diff;
-            buf += 2;
-        }
-        else {
-            diff = cbb->nextBranch->addr2 - (buf_addr + 6);
-            buf[0] = 0x0F;
-            switch (cbb->endType) {
-            case IT_JO:  buf[1] = 0x80; break;
-            case IT_JNO: buf[1] = 0x81; break;
-            case IT_JC:  buf[1] = 0x82; break;
-            case IT_JNC: buf[1] = 0x83; break;
-            case IT_JZ:  buf[1] = 0x84; break;
-            case IT_JNZ: buf[1] = 0x85; break;
-            case IT_JBE: buf[1] = 0x86; break;
-            case IT_JA:  buf[1] = 0x87; break;
-            case IT_JS:  buf[1] = 0x88; break;
-            case IT_JNS: buf[1] = 0x89; break;
-            case IT_JP:  buf[1] = 0x8A; break;
-            case IT_JNP: buf[1] = 0x8B; break;
-            case IT_JL:  buf[1] = 0x8C; break;
-            case IT_JGE: buf[1] = 0x8D; break;
-            case IT_JLE: buf[1] = 0x8E; break;
-            case IT_JG:  buf[1] = 0x8F; break;
-            default: assert(0);
-            }
-            *(int32_t*)(buf+2) = diff;
-            buf += 6;
+        if (isProfiled(r, cbb)) {
+            // Jcc to counting of taken branch, fall-through counted before
+            cbb->genCounter = counter;
+            counter += 2;
+            buf += genJcc(buf, cbb, (uint64_t) buf + 6 + GEN_COUNTSIZE + 5,
+                          false, false);
+            buf += genCount(buf, cbb->genCounter + 1);
+            buf += genJmp(buf, cbb->nextFallThrough->addr2, false);
+            buf += genCount(buf, cbb->genCounter);
+            buf += genJmp(buf, cbb->nextBranch->addr2, false);
+            continue;
         }
-        if (cbb->genJump) {
-            buf_addr = (uint64_t) buf;
-            diff = cbb->nextFallThrough->addr2 - (buf_addr + 5);
-            buf[0] = 0xE9;
-            *(int32_t*)(buf+1) = diff;
-            buf += 5;
+
+        if (cbb->nextBranch == cbb->nextFallThrough) {
+            // no Jcc needed
         }
+        else if (cbb->genInvert)
+            buf += genJcc(buf, cbb, cbb->nextFallThrough->addr2,
+                          cbb->genJcc8, true);
+        else
+            buf += genJcc(buf, cbb, cbb->nextBranch->addr2,
+                          cbb->genJcc8, false);
+        if (cbb->genJump)
+            buf += genJmp(buf, cbb->nextFallThrough->addr2, cbb->genJmp8);
     }
 
     assert(r->cs != 0);
-    assert(r->cs->used > 0);
+    assert(buf1 > buf0);
 
     if (r->genOrderCount > 0) {
-        int usedBefore = (r->genOrder[0]->addr2 - (uint64_t) r->cs->buf);
         r->generatedCodeAddr = r->genOrder[0]->addr2;
-        r->generatedCodeSize = r->cs->used - usedBefore;
+        r->generatedCodeSize = (uint64_t) buf1 - r->generatedCodeAddr;
+        r->generatedDataSize = (int) (buf1 - codeEnd);
+        // keep code alive until released
+        commitCodeStorage(r->cs, r->generatedCodeAddr);
+        r->profiledCode = profile ? r->generatedCodeAddr : 0;
     }
     else {
         r->generatedCodeAddr = 0;
         r->generatedCodeSize = 0;
+        r->generatedDataSize = 0;
+    }
+}
+
+// regenerate code of last rewrite, using edge counts of its profiled
+// version for block layout. Captured CBBs must still be available
+void relayoutCaptured(RContext* c)
+{
+    Rewriter* r = c->r;
+
+    assert(r->profiledCode != 0);
+    for(int i = 0; i < r->capBBCount; i++) {
+        CBB* cbb = r->capBB[i];
+
+        if (cbb->genCounter) {
+            cbb->countBranch = cbb->genCounter[0];
+            cbb->countFallThrough = cbb->genCounter[1];
+        }
+        cbb->size = -1;
+        cbb->addr1 = 0;
+        cbb->addr2 = 0;
+        cbb->genJcc8 = false;
+        cbb->genJump = false;
+        cbb->genJmp8 = false;
+        cbb->genInvert = false;
+        cbb->genCounter = 0;
     }
+    r->genOrderCount = 0;
+
+    bool profile = r->doProfile;
+    r->doProfile = false;
+    generateBinaryFromCaptured(c);
+    r->doProfile = profile;
+}
+
+// captures at most repeated to meet a code size budget
+#define CAPTURE_SIZERETRIES 3
+
+// run all rewrite steps for parameters <par> of configured function.
+// uses and fills the specialization cache if enabled
+uint64_t rewriteWithParameters(Rewriter* r, uint64_t* par)
+{
+    Error* e;
+
+    if (cache_enabled(r)) {
+        if (cache_lookup(r, par))
+            return r->generatedCodeAddr;
+    }
+
+    r->budgetInstrs = r->maxCapInstrs;
+    for(int retry = 0; ; retry++) {
+        e = emulateAndCapture(r, r->cc->parCount, par);
+
+        if (!e) {
+            RContext c;
+            c.r = r;
+            c.e = 0;
+
+            if (r->vreq != VR_None)
+                runVectorization(&c);
+            if (!c.e)
+                runOptsOnCaptured(&c);
+            if (!c.e)
+                generateBinaryFromCaptured(&c);
+            e = c.e;
+        }
+        if (e || (r->maxCodeSize == 0) ||
+            (r->generatedCodeSize <= r->maxCodeSize))
+            break;
+        if (retry == CAPTURE_SIZERETRIES) {
+            // still too large: fall back to original function
+            releaseCodeStorage(r->cs, r->generatedCodeAddr);
+            e = &r->error;
+            setError(e, ET_BufferOverflow, EM_Rewriter, r,
+                     "Generated code exceeds size budget");
+            break;
+        }
+
+        // code too large: capture again, with instruction budget lowered
+        // according to the ratio of allowed and generated code size
+        int used = r->budgetExceeded ? r->budgetInstrs : r->capturedInstrs;
+        int budget = (int) ((int64_t) used *
+                            r->maxCodeSize / r->generatedCodeSize);
+        if (r->showEmuSteps)
+            printf("Generated code too large (%d bytes): "
+                   "capture again with budget of %d instructions\n",
+                   r->generatedCodeSize, budget);
+        releaseCodeStorage(r->cs, r->generatedCodeAddr);
+        r->budgetInstrs = (budget > 0) ? budget : 1;
+    }
+
+    if (e) {
+        // on error, return original function
+        logError(e, (char*) "Stopped rewriting; return original");
+        r->generatedCodeAddr = r->func;
+    }
+    else if (cache_enabled(r))
+        cache_insert(r, par);
+
+    return r->generatedCodeAddr;
 }
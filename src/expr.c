@@ -23,21 +23,16 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-ExprPool* expr_allocPool(int s)
+ExprPool* expr_allocPool(Arena* a, int s)
 {
     ExprPool* p;
 
-    p = (ExprPool*) malloc(sizeof(ExprPool) + s * sizeof(ExprNode));
+    p = (ExprPool*) arena_alloc(a, sizeof(ExprPool) + s * sizeof(ExprNode));
     p->size = s;
     p->used = 0;
     return p;
 }
 
-void expr_freePool(ExprPool* p)
-{
-    free(p);
-}
-
 ExprNode* expr_newNode(ExprPool* p, NodeType t)
 {
     ExprNode* e;
@@ -162,7 +157,7 @@ int appendExpr(char* b, ExprNode* e)
 
 char *expr_toString(ExprNode *e)
 {
-    static char buf[200];
+    static __thread char buf[200];
     int off;
     off = appendExpr(buf, e);
     assert(off < 200);
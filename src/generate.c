@@ -21,6 +21,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
@@ -46,6 +47,11 @@ struct _GContext {
     OperandEncoding oe;
     ValType vt;
     int flags;
+
+    // constant loaded RIP-relative from pool, displacement at <dispOff>
+    // relative to end of instruction at <dispEnd>
+    uint64_t cv[2];
+    int cLen, dispOff, dispEnd;
 };
 
 static
@@ -522,7 +528,7 @@ void setGenInfo(GContext* c,
 static
 Operand* reduceImm64to32(Operand* o)
 {
-    static Operand newOp;
+    static __thread Operand newOp;
 
     if (o->type == OT_Imm64) {
         // reduction possible if signed 64bit fits into signed 32bit
@@ -539,7 +545,7 @@ Operand* reduceImm64to32(Operand* o)
 static
 Operand* reduceImm16to8(Operand* o)
 {
-    static Operand newOp;
+    static __thread Operand newOp;
 
     if (o->type == OT_Imm16) {
         // reduction possible if signed 16bit fits into signed 8bit
@@ -556,7 +562,7 @@ Operand* reduceImm16to8(Operand* o)
 static
 Operand* reduceImm32to8(Operand* o)
 {
-    static Operand newOp;
+    static __thread Operand newOp;
 
     if (o->type == OT_Imm32) {
         // reduction possible if signed 32bit fits into signed 8bit
@@ -758,10 +764,8 @@ int genMov(GContext* cxt)
 
         case OT_Reg32:
         case OT_Reg64:
-            if (src->val == 0) {
-                // setting to 0: use 'xor r/m,r 32/64' (0x31 MR)
-                return genModRM(cxt, 0x31, dst, dst, VT_None, 0);
-            }
+            // not using xor for 0: flags must stay unchanged. The
+            // peephole pass does this if flags are dead
             // use 'mov r/m 32/64, imm32' (0xC7/0)
             return genDigitMI(cxt, 0xC7, 0, dst, src, 0);
 
@@ -773,10 +777,6 @@ int genMov(GContext* cxt)
         switch(dst->type) {
         case OT_Reg32:
         case OT_Reg64:
-            if (src->val == 0) {
-                // setting to 0: use 'xor r/m,r 32/64' (0x31 MR)
-                return genModRM(cxt, 0x31, dst, dst, VT_None, 0);
-            }
             // use 'mov r64,imm64' (REX.W + 0xB8)
             return genOI(cxt, 0xB8, dst, src, 0);
 
@@ -784,6 +784,17 @@ int genMov(GContext* cxt)
         }
         break;
 
+    case OT_Imm8:
+        switch(dst->type) {
+        case OT_Reg8:
+        case OT_Ind8:
+            // use 'mov r/m 8, imm8' (0xC6/0 MI)
+            return genDigitMI(cxt, 0xC6, 0, dst, src, 0);
+
+        default: return -1;
+        }
+        break;
+
     default: return -1;
     }
     return 0;
@@ -1149,6 +1160,39 @@ int genIMul(GContext* cxt)
     Operand* src =  &(cxt->instr->src);
     Operand* dst =  &(cxt->instr->dst);
 
+    if (cxt->instr->form == OF_1) {
+        switch(dst->type) {
+        case OT_Reg32:
+        case OT_Ind32:
+        case OT_Reg64:
+        case OT_Ind64:
+            // use 'imul r/m 32/64' (0xF7/5 M), into edx:eax / rdx:rax
+            return genDigitRM(cxt, 0xF7, 5, dst, 0);
+
+        default: return -1;
+        }
+    }
+
+    if (cxt->instr->form == OF_3) {
+        Operand* imm = &(cxt->instr->src2);
+
+        if (!opIsGPReg(dst) || (opValType(src) != opValType(dst)))
+            return -1;
+        imm = reduceImm64to32(imm);
+        imm = reduceImm32to8(imm);
+        switch(imm->type) {
+        case OT_Imm8:
+            // use 'imul r,r/m 32/64,imm8' (0x6B/r RMI)
+            return genModRMI(cxt, 0x6B, src, dst, imm, 0);
+
+        case OT_Imm32:
+            // use 'imul r,r/m 32/64,imm32' (0x69/r RMI)
+            return genModRMI(cxt, 0x69, src, dst, imm, 0);
+
+        default: return -1;
+        }
+    }
+
     // if src is imm, try to reduce width
     src = reduceImm64to32(src);
     src = reduceImm32to8(src);
@@ -1181,7 +1225,7 @@ int genIMul(GContext* cxt)
         break;
 
     case OT_Imm32:
-        if (opValType(src) != opValType(dst)) return -1;
+        // imm32 is sign-extended with 64bit operands
         switch(dst->type) {
         case OT_Reg32:
         case OT_Reg64:
@@ -1720,6 +1764,206 @@ int genVec(GContext* c)
     return genInstr(c);
 }
 
+// is <instr> a load of a constant into a vector register? Captured by the
+// emulator for static lanes, using opcodes without immediate form: movq,
+// movlpd and movhpd for 64 bit, movapd with <src2> as upper half
+static
+bool isVecConst(Instr* instr)
+{
+    switch(instr->type) {
+    case IT_MOVQ:
+    case IT_MOVLPD:
+    case IT_MOVHPD:
+    case IT_MOVAPD:
+        return (instr->ptLen == 0) && opIsImm(&(instr->src));
+    default: break;
+    }
+    return false;
+}
+
+// the constant is loaded RIP-relative from the pool behind the generated
+// function, the displacement is set when placing the pool. Zero is
+// loaded with pxor
+static
+int genVecConst(GContext* cxt)
+{
+    Instr* instr = cxt->instr;
+    uint8_t* buf = cxt->buf;
+    int r, o = 0;
+
+    if (!opIsReg(&(instr->dst)) || (instr->dst.reg.rt != RT_XMM)) return -1;
+    r = VRegEncoding(instr->dst.reg);
+
+    cxt->cv[0] = instr->src.val;
+    cxt->cv[1] = (instr->form == OF_3) ? instr->src2.val : 0;
+    cxt->cLen = (instr->type == IT_MOVAPD) ? 16 : 8;
+
+    if ((cxt->cv[0] == 0) && (cxt->cv[1] == 0) &&
+        ((instr->type == IT_MOVQ) || (instr->type == IT_MOVAPD))) {
+        // pxor xmm,xmm (66 0F EF)
+        cxt->cLen = 0;
+        buf[o++] = 0x66;
+        if (r > 7) buf[o++] = 0x45;
+        buf[o++] = 0x0F; buf[o++] = 0xEF;
+        buf[o++] = 0xC0 | ((r & 7) << 3) | (r & 7);
+        return o;
+    }
+
+    // movq (F3 0F 7E), movlpd (66 0F 12), movhpd (66 0F 16),
+    // movapd (66 0F 28) from rip-relative address (mod 0, r/m 5)
+    buf[o++] = (instr->type == IT_MOVQ) ? 0xF3 : 0x66;
+    if (r > 7) buf[o++] = 0x44;
+    buf[o++] = 0x0F;
+    switch(instr->type) {
+    case IT_MOVQ:   buf[o++] = 0x7E; break;
+    case IT_MOVLPD: buf[o++] = 0x12; break;
+    case IT_MOVHPD: buf[o++] = 0x16; break;
+    case IT_MOVAPD: buf[o++] = 0x28; break;
+    default: assert(0);
+    }
+    buf[o++] = 0x05 | ((r & 7) << 3);
+    cxt->dispOff = o;
+    *(int32_t*)(buf + o) = 0;
+    o += 4;
+    cxt->dispEnd = o;
+
+    return o;
+}
+
+// call kept by the emulator. Pushes of static values are not captured, so
+// the stack pointer may not be aligned as expected by the callee: it is
+// saved in rbx (preserved by the callee) and aligned to 16 bytes around
+// the call. The target is called via the constant pool, without limit on
+// the distance to the generated code
+static
+int genCall(GContext* cxt)
+{
+    Operand* o = &(cxt->instr->dst);
+    uint8_t* buf = cxt->buf;
+    int n = 0;
+
+    if (o->type != OT_Imm64) return -1;
+
+    buf[n++] = 0x53; // push %rbx
+    buf[n++] = 0x48; buf[n++] = 0x89; buf[n++] = 0xE3; // mov %rsp,%rbx
+    buf[n++] = 0x48; buf[n++] = 0x83; buf[n++] = 0xE4; // and $-16,%rsp
+    buf[n++] = 0xF0;
+    // call *disp32(%rip) (FF /2, mod 0, r/m 5)
+    buf[n++] = 0xFF; buf[n++] = 0x15;
+    cxt->cv[0] = o->val;
+    cxt->cv[1] = 0;
+    cxt->cLen = 8;
+    cxt->dispOff = n;
+    *(int32_t*)(buf + n) = 0;
+    n += 4;
+    cxt->dispEnd = n;
+    buf[n++] = 0x48; buf[n++] = 0x89; buf[n++] = 0xDC; // mov %rbx,%rsp
+    buf[n++] = 0x5B; // pop %rbx
+
+    return n;
+}
+
+// maximal number of code bytes generated for <instr>
+static
+int genMaxLen(Instr* instr)
+{
+    return (instr->type == IT_CALL) ? 24 : 15;
+}
+
+// maximal number of bytes generated for <instr>, including pool data
+int generateMaxSize(Instr* instr)
+{
+    if (isVecConst(instr) || (instr->type == IT_CALL))
+        return genMaxLen(instr) + 16;
+    return genMaxLen(instr);
+}
+
+//----------------------------------------------------------
+// Constant pool
+//
+// Constants are collected while generating the CBBs of a function, with
+// equal constants stored only once. The pool is placed behind the code
+// of the function (and profile counters) at a cacheline boundary. As the
+// code of CBBs is moved after generation, displacements of references
+// are set when placing the pool.
+
+void resetConstPool(Rewriter* r)
+{
+    r->poolCount = 0;
+    r->poolRefCount = 0;
+}
+
+// add reference to constant <v> with <len> bytes from code of <cbb>
+static
+void addPoolRef(Rewriter* r, CBB* cbb, uint64_t* v, int len,
+                int dispOff, int endOff)
+{
+    PoolRef* ref;
+    int i;
+
+    for(i = 0; i < r->poolCount; i++) {
+        PoolConst* pc = r->pool + i;
+        if ((pc->len == len) && (pc->v[0] == v[0]) && (pc->v[1] == v[1]))
+            break;
+    }
+    if (i == r->poolCount) {
+        if (r->poolCount == r->poolCapacity) {
+            r->poolCapacity = r->poolCapacity ? 2 * r->poolCapacity : 16;
+            r->pool = (PoolConst*) realloc(r->pool,
+                                           sizeof(PoolConst) * r->poolCapacity);
+        }
+        r->pool[i].v[0] = v[0];
+        r->pool[i].v[1] = v[1];
+        r->pool[i].len = len;
+        r->pool[i].off = -1;
+        r->poolCount++;
+    }
+
+    if (r->poolRefCount == r->poolRefCapacity) {
+        r->poolRefCapacity = r->poolRefCapacity ? 2 * r->poolRefCapacity : 16;
+        r->poolRef = (PoolRef*) realloc(r->poolRef,
+                                        sizeof(PoolRef) * r->poolRefCapacity);
+    }
+    ref = r->poolRef + r->poolRefCount++;
+    ref->cbb = cbb;
+    ref->dispOff = dispOff;
+    ref->endOff = endOff;
+    ref->idx = i;
+}
+
+// place constant pool at <addr> (aligned to cacheline), with CBBs already
+// at final addresses. Returns end address
+uint64_t placeConstPool(Rewriter* r, uint64_t addr)
+{
+    uint8_t* buf;
+    int i, len, off = 0;
+
+    if (r->poolCount == 0) return addr;
+
+    addr = (addr + 63) & ~63ul;
+    buf = (uint8_t*) addr;
+    // 16-byte constants first, keeping them aligned
+    for(len = 16; len >= 8; len -= 8) {
+        for(i = 0; i < r->poolCount; i++) {
+            PoolConst* pc = r->pool + i;
+            if (pc->len != len) continue;
+            pc->off = off;
+            memcpy(buf + off, pc->v, len);
+            off += len;
+        }
+    }
+
+    for(i = 0; i < r->poolRefCount; i++) {
+        PoolRef* ref = r->poolRef + i;
+        uint64_t code = ref->cbb->addr2;
+        uint64_t target = addr + r->pool[ref->idx].off;
+
+        *(int32_t*)(code + ref->dispOff) =
+            (int32_t) (target - (code + ref->endOff));
+    }
+    return addr + off;
+}
+
 // Pass-through: parser forwarding opcodes, provides encoding
 static
 int genPassThrough(GContext* cxt)
@@ -1782,28 +2026,28 @@ void initGContext(GContext* c, uint8_t* buf, Instr* i)
     c->oe = OE_Invalid;
     c->flags = 0;
     c->vt = VT_None;
+    c->cLen = 0;
 }
 
 // generate code for a captured BB
 // this sets cbb->addr1/cbb->size
 GenerateError* generate(Rewriter* r, CBB* cbb)
 {
-    static GenerateError error;
-
+    GenerateError* error = &r->generateError;
     uint64_t buf0;
     int used, i, usedTotal;
     GContext cxt;
 
     assert(cbb != 0);
 
-    cxt.e = &error;
+    cxt.e = error;
     setErrorNone((Error*) cxt.e);
 
     if (r->cs == 0) {
         markError(&cxt, ET_BufferOverflow, "no code buffer available");
-        error.e.r = r;
-        error.cbb = cbb;
-        return &error;
+        error->e.r = r;
+        error->cbb = cbb;
+        return error;
     }
 
     if (r->showEmuSteps)
@@ -1816,12 +2060,16 @@ GenerateError* generate(Rewriter* r, CBB* cbb)
         Instr* instr = cbb->instr + i;
 
         // pass generator requests via GContext to helpers
-        initGContext(&cxt, reserveCodeStorage(r->cs, 15), instr);
+        initGContext(&cxt, reserveCodeStorage(r->cs, genMaxLen(instr)),
+                     instr);
         used = 0;
 
         if (instr->ptLen > 0) {
             used = genPassThrough(&cxt);
         }
+        else if (isVecConst(instr)) {
+            used = genVecConst(&cxt);
+        }
         else {
             switch(instr->type) {
             case IT_ADD:
@@ -1906,6 +2154,9 @@ GenerateError* generate(Rewriter* r, CBB* cbb)
             case IT_RET:
                 used = genRet(&cxt);
                 break;
+            case IT_CALL:
+                used = genCall(&cxt);
+                break;
             case IT_SUB:
                 used = genSub(&cxt);
                 break;
@@ -1933,23 +2184,27 @@ GenerateError* generate(Rewriter* r, CBB* cbb)
             markError(&cxt, ET_UnsupportedOperands, 0);
         }
 
-        assert(used < 15);
+        assert(used < genMaxLen(instr));
 
         if (isErrorSet((Error*)cxt.e)) {
             // fill-in error info
-            error.e.r = r;
-            error.cbb = cbb;
-            error.offset = i;
+            error->e.r = r;
+            error->cbb = cbb;
+            error->offset = i;
 
             // error: no code generated, reset used buffer
             cbb->size = -1;
-            r->cs->used = buf0 - (uint64_t) r->cs->buf;
-            return &error;
+            resetCodeStorage(r->cs, (uint8_t*) buf0);
+            return error;
         }
 
         instr->addr = (uint64_t) cxt.buf;
         instr->len = used;
         usedTotal += used;
+        if (cxt.cLen > 0)
+            addPoolRef(r, cbb, cxt.cv, cxt.cLen,
+                       (int) (instr->addr - buf0) + cxt.dispOff,
+                       (int) (instr->addr - buf0) + cxt.dispEnd);
 
         if (r->showEmuSteps) {
             printf("  I%2d : %-32s", i, instr2string(instr, 1, cbb->fc));
@@ -1974,6 +2229,11 @@ GenerateError* generate(Rewriter* r, CBB* cbb)
         printf(" fall-through to (%s)\n",
                cbb_prettyName(cbb->nextFallThrough));
         }
+        else if (cbb->endType == IT_JMP) {
+            printf("  I%2d : %s (%s)\n",
+                   i, instrName(cbb->endType, 0),
+                   cbb_prettyName(cbb->nextBranch));
+        }
     }
 
     cbb->size = usedTotal;
@@ -389,7 +389,7 @@ void setRegOp(Operand* o, Reg r)
 
 Operand* getRegOp(Reg r)
 {
-    static Operand o;
+    static __thread Operand o;
 
     setRegOp(&o, r);
     return &o;
@@ -397,7 +397,7 @@ Operand* getRegOp(Reg r)
 
 Operand* getImmOp(ValType t, uint64_t v)
 {
-    static Operand o;
+    static __thread Operand o;
 
     switch(t) {
     case VT_8:
@@ -601,6 +601,10 @@ void copyInstr(Instr* dst, Instr* src)
         for(int j=0; j < src->ptLen; j++)
             dst->ptOpc[j] = src->ptOpc[j];
     }
+
+    dst->info_stack = src->info_stack;
+    dst->info_stackOff = src->info_stackOff;
+    dst->info_stackLen = src->info_stackLen;
 }
 
 void initSimpleInstr(Instr* i, InstrType it)
@@ -617,6 +621,9 @@ void initSimpleInstr(Instr* i, InstrType it)
     i->src2.type = OT_None;
 
     i->info_memAddr = 0;
+    i->info_stack = SA_Unknown;
+    i->info_stackOff = 0;
+    i->info_stackLen = 0;
 }
 
 void initUnaryInstr(Instr* i, InstrType it, Operand* o)
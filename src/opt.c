@@ -0,0 +1,1811 @@
+/**
+ * This file is part of DBrew, the dynamic binary rewriting library.
+ *
+ * (c) 2015-2016, Josef Weidendorfer <josef.weidendorfer@gmx.de>
+ *
+ * DBrew is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License (LGPL)
+ * as published by the Free Software Foundation, either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * DBrew is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with DBrew.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "opt.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "emulate.h"
+#include "instr.h"
+#include "printer.h"
+
+
+//----------------------------------------------------------
+// Liveness analysis and dead code elimination
+//
+// Liveness of GP registers and flags is a bit set (LiveSet). For the
+// stack, bytes below a limit (offset from the current stack pointer) are
+// known to be dead, such as all bytes below the return address at a ret.
+// The analysis is conservative: instructions with unknown semantics read
+// all registers and may read any stack byte.
+//
+
+typedef uint32_t LiveSet;
+
+#define LS_GP(ri)   (1u << (ri))
+#define LS_GPALL    0xffffu
+#define LS_FLAG(ri) (1u << (16 + (ri)))
+#define LS_FLAGS    (0x1fu << 16)
+#define LS_ALL      (LS_GPALL | LS_FLAGS)
+
+// registers used by the caller after return: return value, callee-saved
+#define LS_RET (LS_GP(RI_A) | LS_GP(RI_D) | LS_GP(RI_B) | LS_GP(RI_SP) | \
+                LS_GP(RI_BP) | LS_GP(RI_12) | LS_GP(RI_13) | \
+                LS_GP(RI_14) | LS_GP(RI_15))
+
+// call kept in the generated code: argument registers (al for varargs)
+// and stack pointer are used, registers not preserved by the callee are
+// written
+#define LS_CALLUSE (LS_GP(RI_DI) | LS_GP(RI_SI) | LS_GP(RI_D) | \
+                    LS_GP(RI_C) | LS_GP(RI_8) | LS_GP(RI_9) | \
+                    LS_GP(RI_A) | LS_GP(RI_SP))
+#define LS_CALLDEF (LS_GP(RI_A) | LS_GP(RI_C) | LS_GP(RI_D) | \
+                    LS_GP(RI_SI) | LS_GP(RI_DI) | LS_GP(RI_8) | \
+                    LS_GP(RI_9) | LS_GP(RI_10) | LS_GP(RI_11) | LS_FLAGS)
+
+// limits for dead stack bytes
+#define STACK_NONEDEAD INT64_MIN
+#define STACK_ALLDEAD  INT64_MAX
+
+// effects of one instruction
+typedef struct _Effects {
+    LiveSet use;    // read
+    LiveSet def;    // completely overwritten
+    LiveSet write;  // written, maybe partially or conditionally
+    bool pure;      // no effect besides writing <write>, if no side effect
+    bool sideEffect;
+    bool stackStore; // only effect besides <write> is the stack write
+
+    // stack: reads relative to stack pointer before instruction, writes
+    // relative to stack pointer after it
+    bool stackReset; // unknown change of stack pointer or unknown read
+    bool stackExit;  // return: all bytes below stack pointer dead
+    int64_t rspDelta;
+    int64_t readOff, writeOff;
+    int readLen, writeLen;
+} Effects;
+
+// index of 64bit GP register covering <r>, or -1
+static
+int gpIndex(Reg r)
+{
+    switch(r.rt) {
+    case RT_GP8Leg:
+        // ah, ch, dh, bh are part of rax, rcx, rdx, rbx
+        if ((r.ri >= RI_AH) && (r.ri <= RI_BH))
+            return r.ri - RI_AH;
+        return r.ri;
+    case RT_GP8:
+    case RT_GP16:
+    case RT_GP32:
+    case RT_GP64:
+        return r.ri;
+    default:
+        break;
+    }
+    return -1;
+}
+
+// is <o> a memory operand relative to stack pointer with known offset?
+static
+bool opIsStackSlot(Operand* o)
+{
+    return opIsInd(o) && (o->reg.rt == RT_GP64) && (o->reg.ri == RI_SP) &&
+           (o->ireg.rt == RT_None) && (o->seg == OSO_None);
+}
+
+// registers used for address of memory operand <o>
+static
+LiveSet addrUse(Operand* o)
+{
+    LiveSet s = 0;
+    int ri;
+
+    ri = gpIndex(o->reg);
+    if (ri >= 0) s |= LS_GP(ri);
+    ri = gpIndex(o->ireg);
+    if (ri >= 0) s |= LS_GP(ri);
+
+    return s;
+}
+
+static
+void readStack(Effects* e, int64_t off, int len)
+{
+    if (e->readLen > 0) {
+        // merge into one range
+        int64_t end = e->readOff + e->readLen;
+        if (off + len > end) end = off + len;
+        if (off > e->readOff) off = e->readOff;
+        len = end - off;
+    }
+    e->readOff = off;
+    e->readLen = len;
+}
+
+// operand <o> is read
+static
+void useOp(Effects* e, Operand* o)
+{
+    int ri;
+
+    if (opIsInd(o)) {
+        e->use |= addrUse(o);
+        if (opIsStackSlot(o))
+            readStack(e, (int64_t) o->val, opTypeWidth(o) / 8);
+        else if (o->reg.rt != RT_IP)
+            e->stackReset = true; // may read any stack byte
+        return;
+    }
+    if (!opIsReg(o)) return;
+    ri = gpIndex(o->reg);
+    if (ri >= 0) e->use |= LS_GP(ri);
+}
+
+// operand <o> is written
+static
+void defOp(Effects* e, Operand* o)
+{
+    int ri;
+
+    if (opIsInd(o)) {
+        e->use |= addrUse(o);
+        e->sideEffect = true;
+        if (opIsStackSlot(o)) {
+            e->writeOff = (int64_t) o->val;
+            e->writeLen = opTypeWidth(o) / 8;
+        }
+        return;
+    }
+    assert(opIsReg(o));
+    ri = gpIndex(o->reg);
+    if (ri < 0) {
+        // vector registers are not tracked
+        e->sideEffect = true;
+        return;
+    }
+    e->write |= LS_GP(ri);
+    // 32bit results are zero-extended, smaller ones keep upper bits
+    if ((o->type == OT_Reg32) || (o->type == OT_Reg64))
+        e->def |= LS_GP(ri);
+}
+
+// instructions not understood: keep, and keep everything used before
+static
+void unknownEffects(Effects* e)
+{
+    e->use = LS_ALL;
+    e->stackReset = true;
+    e->sideEffect = true;
+}
+
+// SSE/AVX: only GP registers and memory in explicit operands are used
+static
+void vectorEffects(Effects* e, Instr* instr)
+{
+    switch(instr->form) {
+    case OF_3: useOp(e, &(instr->src2)); // fall through
+    case OF_2: useOp(e, &(instr->src));  // fall through
+    case OF_1:
+        useOp(e, &(instr->dst));
+        if (opIsReg(&(instr->dst)) && (gpIndex(instr->dst.reg) >= 0))
+            e->write |= LS_GP(gpIndex(instr->dst.reg));
+        if (opIsStackSlot(&(instr->dst))) {
+            e->writeOff = (int64_t) instr->dst.val;
+            e->writeLen = opTypeWidth(&(instr->dst)) / 8;
+        }
+        break;
+    default: break;
+    }
+    e->sideEffect = true;
+}
+
+static
+bool instrIsVector(InstrType it)
+{
+    return ((it >= IT_MOVSS) && (it <= IT_VZEROALL)) ||
+           (it == IT_MOVD) || (it == IT_MOVQ);
+}
+
+static
+void getEffects(Instr* instr, Effects* e)
+{
+    Operand* dst = &(instr->dst);
+    Operand* src = &(instr->src);
+
+    e->use = 0;
+    e->def = 0;
+    e->write = 0;
+    e->pure = false;
+    e->sideEffect = false;
+    e->stackStore = false;
+    e->stackReset = false;
+    e->stackExit = false;
+    e->rspDelta = 0;
+    e->readLen = 0;
+    e->writeLen = 0;
+
+    if (instr->ptLen > 0) {
+        if (instrIsVector(instr->type))
+            vectorEffects(e, instr);
+        else
+            unknownEffects(e);
+        return;
+    }
+
+    switch(instr->type) {
+    case IT_HINT_CALL:
+    case IT_HINT_RET:
+        // no code, but kept for later passes
+        e->sideEffect = true;
+        return;
+
+    case IT_NOP:
+        e->pure = true;
+        return;
+
+    case IT_MOV:
+    case IT_MOVSX:
+    case IT_MOVZX:
+        assert(instr->form == OF_2);
+        useOp(e, src);
+        defOp(e, dst);
+        e->pure = true;
+        e->stackStore = (instr->type == IT_MOV) && opIsStackSlot(dst);
+        break;
+
+    case IT_LEA:
+        assert(instr->form == OF_2);
+        e->use |= addrUse(src);
+        defOp(e, dst);
+        e->pure = true;
+        if (opIsReg(dst) && (gpIndex(dst->reg) == RI_SP) &&
+            opIsStackSlot(src))
+            e->rspDelta = (int64_t) src->val;
+        break;
+
+    case IT_CLTQ:
+    case IT_CWTL:
+    case IT_CQTO:
+        e->use = LS_GP(RI_A);
+        e->write = (instr->type == IT_CQTO) ? LS_GP(RI_D) : LS_GP(RI_A);
+        if ((instr->vtype == VT_32) || (instr->vtype == VT_64))
+            e->def = e->write;
+        e->pure = true;
+        break;
+
+    case IT_ADD:
+    case IT_ADC:
+    case IT_SUB:
+    case IT_SBB:
+    case IT_AND:
+    case IT_OR:
+    case IT_XOR:
+        assert(instr->form == OF_2);
+        if (((instr->type == IT_XOR) || (instr->type == IT_SUB)) &&
+            opIsGPReg(dst) && opIsEqual(dst, src) &&
+            ((dst->type == OT_Reg32) || (dst->type == OT_Reg64))) {
+            // zeroing idiom: does not depend on old value
+        }
+        else {
+            useOp(e, dst);
+            useOp(e, src);
+        }
+        defOp(e, dst);
+        if ((instr->type == IT_ADC) || (instr->type == IT_SBB))
+            e->use |= LS_FLAG(RI_Carry);
+        e->def |= LS_FLAGS;
+        e->write |= LS_FLAGS;
+        e->pure = true;
+        // stack pointer adjustment by constant?
+        if (opIsReg(dst) && (gpIndex(dst->reg) == RI_SP) &&
+            (dst->type == OT_Reg64) && opIsImm(src)) {
+            int64_t v = (int64_t) src->val;
+            if (src->type == OT_Imm8) v = (int8_t) v;
+            if (src->type == OT_Imm32) v = (int32_t) v;
+            if (instr->type == IT_ADD) e->rspDelta = v;
+            if (instr->type == IT_SUB) e->rspDelta = -v;
+        }
+        break;
+
+    case IT_CMP:
+    case IT_TEST:
+        assert(instr->form == OF_2);
+        useOp(e, dst);
+        useOp(e, src);
+        e->def = LS_FLAGS;
+        e->write = LS_FLAGS;
+        e->pure = true;
+        break;
+
+    case IT_NEG:
+    case IT_NOT:
+    case IT_INC:
+    case IT_DEC:
+        assert(instr->form == OF_1);
+        useOp(e, dst);
+        defOp(e, dst);
+        if (instr->type == IT_NEG) {
+            e->def |= LS_FLAGS;
+            e->write |= LS_FLAGS;
+        }
+        else if (instr->type != IT_NOT) {
+            // carry flag not changed
+            e->def |= LS_FLAGS & ~LS_FLAG(RI_Carry);
+            e->write |= LS_FLAGS & ~LS_FLAG(RI_Carry);
+        }
+        e->pure = true;
+        break;
+
+    case IT_SHL:
+    case IT_SHR:
+    case IT_SAR:
+        useOp(e, dst);
+        if (instr->form == OF_2) useOp(e, src);
+        defOp(e, dst);
+        // flags are unchanged with shift count 0
+        e->write |= LS_FLAGS;
+        if ((instr->form == OF_1) || (opIsImm(src) && (src->val & 63)))
+            e->def |= LS_FLAGS;
+        e->pure = true;
+        break;
+
+    case IT_IMUL:
+        if (instr->form == OF_2) {
+            useOp(e, dst);
+            useOp(e, src);
+        }
+        else if (instr->form == OF_3) {
+            useOp(e, src);
+            useOp(e, &(instr->src2));
+        }
+        else if ((instr->form == OF_1) &&
+                 ((dst->type == OT_Reg32) || (dst->type == OT_Reg64) ||
+                  (dst->type == OT_Ind32) || (dst->type == OT_Ind64))) {
+            // signed multiply into edx:eax / rdx:rax
+            useOp(e, dst);
+            e->use |= LS_GP(RI_A);
+            e->def = LS_GP(RI_A) | LS_GP(RI_D) | LS_FLAGS;
+            e->write = e->def;
+            e->pure = true;
+            break;
+        }
+        else {
+            unknownEffects(e);
+            return;
+        }
+        defOp(e, dst);
+        e->def |= LS_FLAGS;
+        e->write |= LS_FLAGS;
+        e->pure = true;
+        break;
+
+    case IT_IDIV1:
+    case IT_DIV:
+        // edx:eax / rdx:rax divided, flags undefined afterwards.
+        // kept, as it may raise a division error
+        if ((dst->type != OT_Reg32) && (dst->type != OT_Reg64) &&
+            (dst->type != OT_Ind32) && (dst->type != OT_Ind64)) {
+            unknownEffects(e);
+            return;
+        }
+        useOp(e, dst);
+        e->use |= LS_GP(RI_A) | LS_GP(RI_D);
+        e->def = LS_GP(RI_A) | LS_GP(RI_D) | LS_FLAGS;
+        e->write = e->def;
+        e->sideEffect = true;
+        break;
+
+    case IT_BSF:
+        // destination undefined/unchanged for source 0
+        assert(instr->form == OF_2);
+        useOp(e, dst);
+        useOp(e, src);
+        defOp(e, dst);
+        e->def |= LS_FLAGS;
+        e->write |= LS_FLAGS;
+        e->pure = true;
+        break;
+
+    case IT_CMOVO: case IT_CMOVNO: case IT_CMOVC: case IT_CMOVNC:
+    case IT_CMOVZ: case IT_CMOVNZ: case IT_CMOVBE: case IT_CMOVA:
+    case IT_CMOVS: case IT_CMOVNS: case IT_CMOVP: case IT_CMOVNP:
+    case IT_CMOVL: case IT_CMOVGE: case IT_CMOVLE: case IT_CMOVG:
+        assert(instr->form == OF_2);
+        useOp(e, dst);
+        useOp(e, src);
+        defOp(e, dst);
+        e->use |= LS_FLAGS;
+        e->pure = true;
+        break;
+
+    case IT_SETO: case IT_SETNO: case IT_SETC: case IT_SETNC:
+    case IT_SETZ: case IT_SETNZ: case IT_SETBE: case IT_SETA:
+    case IT_SETS: case IT_SETNS: case IT_SETP: case IT_SETNP:
+    case IT_SETL: case IT_SETGE: case IT_SETLE: case IT_SETG:
+        assert(instr->form == OF_1);
+        defOp(e, dst);
+        e->use |= LS_FLAGS;
+        e->pure = true;
+        break;
+
+    case IT_PUSH:
+        assert(instr->form == OF_1);
+        useOp(e, dst);
+        e->use |= LS_GP(RI_SP);
+        e->sideEffect = true;
+        e->rspDelta = (opValType(dst) == VT_16) ? -2 : -8;
+        e->writeOff = 0;
+        e->writeLen = (int) -e->rspDelta;
+        break;
+
+    case IT_POP:
+        assert(instr->form == OF_1);
+        if (!opIsReg(dst) || (gpIndex(dst->reg) == RI_SP)) {
+            unknownEffects(e);
+            return;
+        }
+        defOp(e, dst);
+        e->use |= LS_GP(RI_SP);
+        e->sideEffect = true;
+        e->rspDelta = (dst->type == OT_Reg16) ? 2 : 8;
+        readStack(e, 0, (int) e->rspDelta);
+        break;
+
+    case IT_LEAVE:
+        e->use = LS_GP(RI_SP) | LS_GP(RI_BP);
+        e->def = LS_GP(RI_BP);
+        e->write = LS_GP(RI_SP) | LS_GP(RI_BP);
+        e->sideEffect = true;
+        e->stackReset = true;
+        return;
+
+    case IT_RET:
+        e->use = LS_RET;
+        e->sideEffect = true;
+        e->stackExit = true;
+        return;
+
+    case IT_CALL:
+        // callee may read any stack byte via pointers stored in memory
+        useOp(e, dst);
+        e->use |= LS_CALLUSE;
+        e->def = LS_CALLDEF;
+        e->write = LS_CALLDEF;
+        e->sideEffect = true;
+        e->stackReset = true;
+        return;
+
+    default:
+        if (instrIsVector(instr->type))
+            vectorEffects(e, instr);
+        else
+            unknownEffects(e);
+        return;
+    }
+
+    // any other change of stack pointer is not tracked
+    if (e->write & LS_GP(RI_SP)) {
+        e->sideEffect = true;
+        if ((e->rspDelta == 0) && (instr->type != IT_PUSH) &&
+            (instr->type != IT_POP))
+            e->stackReset = true;
+    }
+}
+
+// bytes in [off, off+len) become dead
+static
+int64_t killStack(int64_t limit, int64_t off, int len)
+{
+    if ((limit == STACK_NONEDEAD) || (limit == STACK_ALLDEAD))
+        return limit;
+    if ((off <= limit) && (off + len > limit))
+        return off + len;
+    return limit;
+}
+
+// backwards over instruction with effects <e>: from liveness after
+// instruction in <live>/<limit>, calculate liveness before it
+static
+void transfer(Effects* e, LiveSet* live, int64_t* limit)
+{
+    *live = (*live & ~(e->def)) | e->use;
+
+    if (e->stackExit) {
+        // only bytes from the return address upwards are live
+        *limit = 0;
+        return;
+    }
+    if (e->stackReset) {
+        *limit = STACK_NONEDEAD;
+        return;
+    }
+    if (e->writeLen > 0)
+        *limit = killStack(*limit, e->writeOff, e->writeLen);
+    if ((*limit != STACK_NONEDEAD) && (*limit != STACK_ALLDEAD))
+        *limit += e->rspDelta;
+    if ((e->readLen > 0) && (e->readOff < *limit))
+        *limit = e->readOff;
+}
+
+// can instruction with effects <e> be removed, given liveness after it?
+static
+bool isDead(Effects* e, LiveSet live, int64_t limit)
+{
+    if (e->write & live) return false;
+    if (e->pure && !e->sideEffect) return true;
+    if (e->stackStore && (limit != STACK_NONEDEAD) &&
+        (e->writeOff + e->writeLen <= limit))
+        return true;
+    return false;
+}
+
+// liveness at end of <cbb>, from its successors
+static
+void liveOut(CBB* cbb, LiveSet* live, int64_t* limit)
+{
+    if (instrIsJcc(cbb->endType)) {
+        CBB* br = cbb->nextBranch;
+        CBB* ft = cbb->nextFallThrough;
+
+        *live = br->liveIn | ft->liveIn | LS_FLAGS;
+        *limit = (br->deadStackBelow < ft->deadStackBelow) ?
+                     br->deadStackBelow : ft->deadStackBelow;
+    }
+    else if (cbb->endType == IT_JMP) {
+        *live = cbb->nextBranch->liveIn;
+        *limit = cbb->nextBranch->deadStackBelow;
+    }
+    else if (cbb->endType == IT_RET) {
+        // the captured ret instruction uses return values
+        *live = 0;
+        *limit = STACK_ALLDEAD;
+    }
+    else {
+        *live = LS_ALL;
+        *limit = STACK_NONEDEAD;
+    }
+}
+
+// iterate until liveness at start of all CBBs is stable
+static
+void analyzeLiveness(Rewriter* r)
+{
+    Effects e;
+    LiveSet live;
+    int64_t limit;
+    bool changed;
+    int i, j, round = 0;
+
+    for(i = 0; i < r->capBBCount; i++) {
+        r->capBB[i]->liveIn = 0;
+        r->capBB[i]->deadStackBelow = STACK_ALLDEAD;
+    }
+
+    do {
+        changed = false;
+        round++;
+        // reverse capture order: successors mostly come later
+        for(i = r->capBBCount - 1; i >= 0; i--) {
+            CBB* cbb = r->capBB[i];
+
+            liveOut(cbb, &live, &limit);
+            for(j = cbb->count - 1; j >= 0; j--) {
+                getEffects(cbb->instr + j, &e);
+                transfer(&e, &live, &limit);
+            }
+            if ((live == cbb->liveIn) && (limit == cbb->deadStackBelow))
+                continue;
+
+            // stack offsets may shrink in loops with unbalanced
+            // stack pointer changes: give up on such CBBs
+            if ((round > r->capBBCount + 2) && (limit != cbb->deadStackBelow))
+                limit = STACK_NONEDEAD;
+            cbb->liveIn = live;
+            cbb->deadStackBelow = limit;
+            changed = true;
+        }
+    } while(changed);
+}
+
+// remove dead instructions from <cbb>, return number removed
+static
+int removeDead(Rewriter* r, CBB* cbb)
+{
+    Effects e;
+    LiveSet live;
+    int64_t limit;
+    bool* dead;
+    int i, n, removed = 0;
+
+    if (cbb->count == 0) return 0;
+
+    dead = (bool*) arena_alloc(r->arena, cbb->count);
+    liveOut(cbb, &live, &limit);
+    for(i = cbb->count - 1; i >= 0; i--) {
+        getEffects(cbb->instr + i, &e);
+        dead[i] = isDead(&e, live, limit);
+        if (dead[i]) {
+            removed++;
+            continue;
+        }
+        transfer(&e, &live, &limit);
+    }
+    if (removed == 0) return 0;
+
+    n = 0;
+    for(i = 0; i < cbb->count; i++) {
+        if (dead[i]) {
+            if (r->showOptSteps)
+                printf("  removing dead '%s' in CBB (%s)\n",
+                       instr2string(cbb->instr + i, 0, cbb->fc),
+                       cbb_prettyName(cbb));
+            continue;
+        }
+        if (n < i) cbb->instr[n] = cbb->instr[i];
+        n++;
+    }
+    cbb->count = n;
+
+    return removed;
+}
+
+void optPassDeadCode(RContext* c)
+{
+    Rewriter* r = c->r;
+    int i, removed;
+
+    if (r->showOptSteps)
+        printf("Run Dead Code Elimination\n");
+
+    // removing instructions may make further ones dead
+    do {
+        analyzeLiveness(r);
+        removed = 0;
+        for(i = 0; i < r->capBBCount; i++)
+            removed += removeDead(r, r->capBB[i]);
+    } while(removed > 0);
+}
+
+
+//----------------------------------------------------------
+// Promotion of stack slots to registers
+//
+// Values kept in stack slots (e.g. spilled by the compiler) are moved
+// into registers not used otherwise in the captured code. Slots are
+// identified by their offset in the emulated stack, annotated on
+// capturing. A slot is promoted only if all accesses to its bytes use
+// same offset and width, by instructions which also accept a register
+// instead of the memory operand. Any access to an unknown stack address
+// or instruction with unknown effects prohibits promotion.
+//
+
+// kind of register an access to a stack slot can use instead
+typedef enum _SlotKind {
+    SK_None = 0, // memory operand needed
+    SK_GP,
+    SK_XMM       // scalar double
+} SlotKind;
+
+typedef struct _Slot {
+    int off, len;
+    SlotKind kind;
+    int count; // number of accesses
+    Reg reg;   // promoted to, if rt != RT_None
+} Slot;
+
+// caller-saved GP registers not used for return values, in order of use
+static RegIndex promoteGP[] = {
+    RI_11, RI_10, RI_9, RI_8, RI_DI, RI_SI, RI_C
+};
+
+#define PROMOTE_GP_COUNT (int) (sizeof(promoteGP) / sizeof(RegIndex))
+
+// xmm0/xmm1 may hold return values, xmm16+ need EVEX encoding
+#define PROMOTE_XMM_FIRST RI_XMM2
+#define PROMOTE_XMM_LAST  RI_XMM15
+
+static
+Operand* memOp(Instr* instr)
+{
+    if (opIsInd(&(instr->dst))) return &(instr->dst);
+    if (opIsInd(&(instr->src))) return &(instr->src);
+    if (opIsInd(&(instr->src2))) return &(instr->src2);
+    return 0;
+}
+
+static
+SlotKind accessKind(Instr* instr, Operand* o)
+{
+    Operand* other;
+    bool gp = (o->type == OT_Ind32) || (o->type == OT_Ind64);
+    // memory operands of scalar SSE may be decoded with 128 bit
+    bool sd = ((o->type == OT_Ind64) || (o->type == OT_Ind128)) &&
+              ((instr->ptLen == 0) || (instr->ptVexP == VEX_No));
+
+    switch(instr->type) {
+    case IT_MOV:
+    case IT_ADD:
+    case IT_SUB:
+    case IT_AND:
+    case IT_OR:
+    case IT_XOR:
+    case IT_CMP:
+    case IT_TEST:
+        return (gp && (instr->ptLen == 0)) ? SK_GP : SK_None;
+
+    case IT_MOVSX:
+    case IT_IMUL:
+        if ((o != &(instr->src)) || (instr->form == OF_1)) break;
+        return (gp && (instr->ptLen == 0)) ? SK_GP : SK_None;
+
+    case IT_INC:
+    case IT_DEC:
+    case IT_NEG:
+    case IT_IDIV1:
+        return (gp && (instr->ptLen == 0)) ? SK_GP : SK_None;
+
+    case IT_MOVSD:
+    case IT_MOVQ:
+        // load/store, converted to movq between xmm registers
+        if (instr->form != OF_2) break;
+        other = (o == &(instr->dst)) ? &(instr->src) : &(instr->dst);
+        if (!opIsReg(other) || (other->reg.rt != RT_XMM)) break;
+        return sd ? SK_XMM : SK_None;
+
+    case IT_ADDSD:
+    case IT_SUBSD:
+    case IT_MULSD:
+    case IT_DIVSD:
+    case IT_MINSD:
+    case IT_MAXSD:
+    case IT_SQRTSD:
+    case IT_COMISD:
+    case IT_UCOMISD:
+        if ((instr->form != OF_2) || (o != &(instr->src))) break;
+        return sd ? SK_XMM : SK_None;
+
+    default: break;
+    }
+    return SK_None;
+}
+
+static
+int findSlot(Slot* slot, int count, int off, int len)
+{
+    for(int i = 0; i < count; i++)
+        if ((slot[i].off == off) && (slot[i].len == len)) return i;
+    return -1;
+}
+
+// register an access, return new slot count
+static
+int addAccess(Slot* slot, int count, int off, int len, SlotKind k)
+{
+    int i = findSlot(slot, count, off, len);
+
+    if (i < 0) {
+        i = count++;
+        slot[i].off = off;
+        slot[i].len = len;
+        slot[i].kind = k;
+        slot[i].count = 0;
+        slot[i].reg.rt = RT_None;
+    }
+    else if (slot[i].kind != k)
+        slot[i].kind = SK_None;
+    slot[i].count++;
+
+    // overlapping slots are accessed with different widths: keep in memory
+    for(int j = 0; j < count; j++) {
+        if (j == i) continue;
+        if ((slot[j].off < off + len) && (off < slot[j].off + slot[j].len)) {
+            slot[i].kind = SK_None;
+            slot[j].kind = SK_None;
+        }
+    }
+    return count;
+}
+
+// hot slots first
+static
+int cmpSlotCount(const void* p1, const void* p2)
+{
+    const Slot* s1 = (const Slot*) p1;
+    const Slot* s2 = (const Slot*) p2;
+
+    if (s1->count != s2->count) return s2->count - s1->count;
+    return s1->off - s2->off;
+}
+
+// replace access to promoted slot in <instr>
+static
+void promoteAccess(Instr* instr, Slot* s)
+{
+    Operand* o = memOp(instr);
+    Instr i;
+
+    if ((s->kind == SK_XMM) &&
+        ((instr->type == IT_MOVSD) || (instr->type == IT_MOVQ))) {
+        // movq xmm2, xmm1 (F3 0F 7E): zero-extends like loading from memory
+        Operand dst, src;
+
+        if (o == &(instr->dst)) {
+            copyOperand(&dst, getRegOp(s->reg));
+            copyOperand(&src, &(instr->src));
+        }
+        else {
+            copyOperand(&dst, &(instr->dst));
+            copyOperand(&src, getRegOp(s->reg));
+        }
+        dst.type = OT_Reg64;
+        src.type = OT_Reg64;
+        initBinaryInstr(&i, IT_MOVQ, VT_None, &dst, &src);
+        i.vtype = VT_Implicit;
+        attachPassthrough(&i, VEX_No, PS_F3, OE_RM, SC_dstDyn, 0x0F, 0x7E, -1);
+        i.info_stack = SA_None;
+        copyInstr(instr, &i);
+        return;
+    }
+
+    copyOperand(o, getRegOp(s->reg));
+    if (s->kind == SK_XMM) {
+        // generator expects same operand types for scalar SSE
+        assert(o == &(instr->src));
+        o->type = instr->dst.type;
+    }
+    instr->info_stack = SA_None;
+}
+
+void optPassStackToReg(RContext* c)
+{
+    Rewriter* r = c->r;
+    LiveSet usedGP = 0;
+    uint32_t usedXMM = 0;
+    Effects e;
+    Slot* slot;
+    SlotKind k;
+    int i, j, slotCount, instrCount, nextGP, nextXMM;
+
+    if (r->showOptSteps)
+        printf("Run Stack Slot Promotion\n");
+
+    instrCount = 0;
+    for(i = 0; i < r->capBBCount; i++)
+        instrCount += r->capBB[i]->count;
+    if (instrCount == 0) return;
+    slot = (Slot*) arena_alloc(r->arena, sizeof(Slot) * instrCount);
+    slotCount = 0;
+
+    // collect registers used and stack slot accesses
+    for(i = 0; i < r->capBBCount; i++) {
+        CBB* cbb = r->capBB[i];
+        for(j = 0; j < cbb->count; j++) {
+            Instr* instr = cbb->instr + j;
+            Operand* o = memOp(instr);
+
+            getEffects(instr, &e);
+            if (e.use == LS_ALL) return; // unknown instruction
+            usedGP |= e.use | e.write;
+
+            // vector registers are not preserved by calls
+            if ((instr->type == IT_VZEROUPPER) ||
+                (instr->type == IT_VZEROALL) || (instr->type == IT_CALL))
+                usedXMM = ~0u;
+            if (opIsReg(&(instr->dst)) && regIsV(instr->dst.reg))
+                usedXMM |= 1u << regVIndex(instr->dst.reg);
+            if (opIsReg(&(instr->src)) && regIsV(instr->src.reg))
+                usedXMM |= 1u << regVIndex(instr->src.reg);
+            if (opIsReg(&(instr->src2)) && regIsV(instr->src2.reg))
+                usedXMM |= 1u << regVIndex(instr->src2.reg);
+
+            if (!o && (instr->type != IT_PUSH) && (instr->type != IT_POP))
+                continue;
+            if (instr->info_stack == SA_None) continue;
+            // unknown stack access, or stack address taken
+            if (instr->info_stack == SA_Unknown) return;
+            if (instr->type == IT_LEA) return;
+
+            k = o ? accessKind(instr, o) : SK_None;
+            if (k == SK_XMM)
+                instr->info_stackLen = 8; // scalar double
+            slotCount = addAccess(slot, slotCount,
+                                  instr->info_stackOff, instr->info_stackLen, k);
+        }
+    }
+
+    // assign free registers to hot slots first
+    qsort(slot, slotCount, sizeof(Slot), cmpSlotCount);
+    nextGP = 0;
+    nextXMM = PROMOTE_XMM_LAST;
+    for(i = 0; i < slotCount; i++) {
+        Slot* s = slot + i;
+        if (s->kind == SK_GP) {
+            while((nextGP < PROMOTE_GP_COUNT) &&
+                  (usedGP & LS_GP(promoteGP[nextGP])))
+                nextGP++;
+            if (nextGP == PROMOTE_GP_COUNT) continue;
+            s->reg = getReg((s->len == 8) ? RT_GP64 : RT_GP32,
+                            promoteGP[nextGP++]);
+        }
+        else if (s->kind == SK_XMM) {
+            while((nextXMM >= PROMOTE_XMM_FIRST) && (usedXMM & (1u << nextXMM)))
+                nextXMM--;
+            if (nextXMM < PROMOTE_XMM_FIRST) continue;
+            s->reg = getReg(RT_XMM, nextXMM--);
+        }
+        else
+            continue;
+
+        if (r->showOptSteps)
+            printf("  promoting stack slot %d (%d bytes, %d accesses) to %s\n",
+                   s->off, s->len, s->count, regName(s->reg));
+    }
+
+    for(i = 0; i < r->capBBCount; i++) {
+        CBB* cbb = r->capBB[i];
+        for(j = 0; j < cbb->count; j++) {
+            Instr* instr = cbb->instr + j;
+            int si;
+
+            if (instr->info_stack != SA_Slot) continue;
+            si = findSlot(slot, slotCount,
+                          instr->info_stackOff, instr->info_stackLen);
+            assert(si >= 0);
+            if (slot[si].reg.rt == RT_None) continue;
+            promoteAccess(instr, slot + si);
+        }
+    }
+}
+
+
+//----------------------------------------------------------
+// Elimination of frames of inlined functions
+//
+// Between the IT_HINT_CALL/IT_HINT_RET markers of an inlined function in
+// one CBB, saving of rbp in the prologue (push rbp; mov rbp,rsp) and its
+// restoring in the epilogue (mov rsp,rbp; pop rbp, from leave) are not
+// needed if rbp is used only as frame pointer. Accesses relative to rbp
+// are converted to be relative to rsp. The body must only access stack
+// slots below the saved rbp, with known stack pointer changes.
+//
+
+static
+bool opIsGP64(Operand* o, RegIndex ri)
+{
+    return (o->type == OT_Reg64) && (o->reg.rt == RT_GP64) &&
+           (o->reg.ri == ri);
+}
+
+static
+bool instrIsMovRR(Instr* instr, RegIndex dst, RegIndex src)
+{
+    return (instr->type == IT_MOV) && (instr->form == OF_2) &&
+           opIsGP64(&(instr->dst), dst) && opIsGP64(&(instr->src), src);
+}
+
+static
+bool instrIsPushPop(Instr* instr, InstrType it, RegIndex ri)
+{
+    return (instr->type == it) && (instr->form == OF_1) &&
+           opIsGP64(&(instr->dst), ri);
+}
+
+// index of next/previous instruction in <cbb> not removed, or -1
+static
+int nextKept(CBB* cbb, bool* removed, int i)
+{
+    for(i++; i < cbb->count; i++)
+        if (!removed[i]) return i;
+    return -1;
+}
+
+static
+int prevKept(bool* removed, int i)
+{
+    for(i--; i >= 0; i--)
+        if (!removed[i]) return i;
+    return -1;
+}
+
+// can instruction in body of inlined function stay with its frame
+// removed? <pushOff> is stack offset of saved rbp
+static
+bool frameBodyOk(Instr* instr, Effects* e, int pushOff)
+{
+    Operand* o = memOp(instr);
+    bool baseBP = o && (o->reg.rt == RT_GP64) && (o->reg.ri == RI_BP);
+    bool baseSP = o && (o->reg.rt == RT_GP64) && (o->reg.ri == RI_SP);
+
+    if (e->use == LS_ALL) return false;
+
+    // only known changes of stack pointer
+    if ((e->write & LS_GP(RI_SP)) && (e->rspDelta == 0)) return false;
+
+    // rbp only allowed as base of memory operands
+    if ((opIsReg(&(instr->dst)) && (gpIndex(instr->dst.reg) == RI_BP)) ||
+        (opIsReg(&(instr->src)) && (gpIndex(instr->src.reg) == RI_BP)) ||
+        (opIsReg(&(instr->src2)) && (gpIndex(instr->src2.reg) == RI_BP)))
+        return false;
+    if (o && (gpIndex(o->ireg) == RI_BP)) return false;
+    if (((e->use | e->write) & LS_GP(RI_BP)) && !baseBP) return false;
+
+    // stack accesses must be below saved rbp, relative to rsp or rbp
+    if (!o && (instr->type != IT_PUSH) && (instr->type != IT_POP))
+        return true;
+    if (instr->info_stack == SA_Unknown) return false;
+    if (instr->info_stack == SA_None)
+        return !baseSP && !baseBP;
+    if (o && !baseSP && !baseBP) return false;
+
+    return instr->info_stackOff + instr->info_stackLen <= pushOff;
+}
+
+// try to remove frame of inlined function between hints at <call> and <ret>
+static
+bool removeFrame(Rewriter* r, CBB* cbb, bool* removed, int call, int ret)
+{
+    Instr* instr = cbb->instr;
+    Effects e;
+    int push, mov, pop, restore, first, last, k;
+    int64_t depth;
+    bool hasFrame;
+
+    push = nextKept(cbb, removed, call);
+    if ((push < 0) || (push >= ret) ||
+        !instrIsPushPop(instr + push, IT_PUSH, RI_BP) ||
+        (instr[push].info_stack != SA_Slot))
+        return false;
+    mov = nextKept(cbb, removed, push);
+    hasFrame = (mov < ret) && instrIsMovRR(instr + mov, RI_BP, RI_SP);
+    first = hasFrame ? mov : push;
+
+    pop = prevKept(removed, ret);
+    if ((pop <= first) || !instrIsPushPop(instr + pop, IT_POP, RI_BP))
+        return false;
+    restore = prevKept(removed, pop);
+    if (!hasFrame || (restore <= first) ||
+        !instrIsMovRR(instr + restore, RI_SP, RI_BP))
+        restore = -1;
+    last = (restore >= 0) ? restore : pop;
+
+    // check body, tracking bytes pushed since frame setup
+    depth = 0;
+    for(k = first + 1; k < last; k++) {
+        if (removed[k]) continue;
+        getEffects(instr + k, &e);
+        if (!frameBodyOk(instr + k, &e, instr[push].info_stackOff))
+            return false;
+        depth -= e.rspDelta;
+    }
+    // without restoring, stack pointer must be at saved rbp
+    if ((restore < 0) && (depth != 0)) return false;
+
+    if (r->showOptSteps)
+        printf("  removing frame of inlined function in CBB (%s)\n",
+               cbb_prettyName(cbb));
+
+    depth = 0;
+    for(k = first + 1; k < last; k++) {
+        Operand* o;
+
+        if (removed[k]) continue;
+        o = memOp(instr + k);
+        if (hasFrame && o && (o->reg.rt == RT_GP64) && (o->reg.ri == RI_BP)) {
+            o->reg.ri = RI_SP;
+            o->val += depth;
+        }
+        getEffects(instr + k, &e);
+        depth -= e.rspDelta;
+    }
+
+    removed[push] = true;
+    removed[pop] = true;
+    if (hasFrame) removed[mov] = true;
+    if (restore >= 0) {
+        if (depth == 0)
+            removed[restore] = true;
+        else {
+            // release stack space without changing flags: lea d(%rsp),%rsp
+            Instr i;
+            Operand o;
+
+            o.type = OT_Ind64;
+            o.val = (uint64_t) depth;
+            o.reg = getReg(RT_GP64, RI_SP);
+            o.ireg.rt = RT_None;
+            o.scale = 0;
+            o.seg = OSO_None;
+            initBinaryInstr(&i, IT_LEA, VT_None,
+                            getRegOp(getReg(RT_GP64, RI_SP)), &o);
+            i.info_stack = SA_None;
+            copyInstr(instr + restore, &i);
+        }
+    }
+    return true;
+}
+
+void optPassInlinedFrames(RContext* c)
+{
+    Rewriter* r = c->r;
+    bool* removed;
+    int i, j, k, n, nesting;
+
+    if (r->showOptSteps)
+        printf("Run Inlined Frame Elimination\n");
+
+    for(i = 0; i < r->capBBCount; i++) {
+        CBB* cbb = r->capBB[i];
+        bool changed = false;
+
+        if (cbb->count == 0) continue;
+        removed = (bool*) arena_alloc(r->arena, cbb->count);
+        for(j = 0; j < cbb->count; j++)
+            removed[j] = false;
+
+        // inner functions are handled first, as their returns come first
+        for(j = 0; j < cbb->count; j++) {
+            if (cbb->instr[j].type != IT_HINT_RET) continue;
+            nesting = 0;
+            for(k = j - 1; k >= 0; k--) {
+                if (cbb->instr[k].type == IT_HINT_RET) nesting++;
+                if (cbb->instr[k].type != IT_HINT_CALL) continue;
+                if (nesting == 0) break;
+                nesting--;
+            }
+            if (k < 0) continue; // call in other CBB
+            if (removeFrame(r, cbb, removed, k, j))
+                changed = true;
+        }
+        if (!changed) continue;
+
+        n = 0;
+        for(j = 0; j < cbb->count; j++) {
+            if (removed[j]) continue;
+            if (n < j) cbb->instr[n] = cbb->instr[j];
+            n++;
+        }
+        cbb->count = n;
+    }
+}
+
+
+//----------------------------------------------------------
+// Peephole optimization
+//
+// A table of rules, each matching a window of adjacent instructions in
+// a CBB and replacing it with fewer or cheaper ones. Rules may depend on
+// registers and flags dead after the window (from liveness analysis).
+// The emulator produces such patterns at boundaries between static and
+// dynamic values.
+//
+
+// returns -1 if not matching, otherwise number of instructions written
+// back to <i> as replacement. <live> is liveness after the window
+typedef int (*PeepholeFunc)(Instr* i, LiveSet live);
+
+typedef struct _PeepholeRule {
+    const char* name;
+    int len; // window size
+    PeepholeFunc func;
+} PeepholeRule;
+
+// sign-extended value of immediate operand
+static
+int64_t immValue(Operand* o)
+{
+    switch(o->type) {
+    case OT_Imm8:  return (int8_t) o->val;
+    case OT_Imm16: return (int16_t) o->val;
+    case OT_Imm32: return (int32_t) o->val;
+    case OT_Imm64: return (int64_t) o->val;
+    default: assert(0);
+    }
+    return 0;
+}
+
+static
+bool opIsGP3264(Operand* o)
+{
+    return opIsGPReg(o) && ((o->type == OT_Reg32) || (o->type == OT_Reg64));
+}
+
+// add/sub with immediate to 32/64bit register: value added, or false
+static
+bool isAddImm(Instr* i, int64_t* v)
+{
+    if (((i->type != IT_ADD) && (i->type != IT_SUB)) ||
+        (i->form != OF_2) || !opIsGP3264(&(i->dst)) || !opIsImm(&(i->src)))
+        return false;
+    *v = immValue(&(i->src));
+    if (i->type == IT_SUB) *v = -*v;
+    return true;
+}
+
+// immediate for 32/64bit register <o> with value <v>
+static
+Operand* immFor(Operand* o, int64_t v)
+{
+    if (o->type == OT_Reg32)
+        return getImmOp(VT_32, (uint32_t) v);
+    return getImmOp(VT_64, (uint64_t) v);
+}
+
+static
+bool fitsImm32(int64_t v)
+{
+    return (v >= INT32_MIN) && (v <= INT32_MAX);
+}
+
+// mov r,imm1; add r,imm2  =>  mov r,imm1+imm2
+static
+int ruleMovAdd(Instr* i, LiveSet live)
+{
+    int64_t v;
+
+    if (live & LS_FLAGS) return -1;
+    if ((i[0].type != IT_MOV) || !opIsGP3264(&(i[0].dst)) ||
+        !opIsImm(&(i[0].src)))
+        return -1;
+    if (!isAddImm(i + 1, &v) || !opIsEqual(&(i[0].dst), &(i[1].dst)))
+        return -1;
+
+    v += immValue(&(i[0].src));
+    copyOperand(&(i[0].src), immFor(&(i[0].dst), v));
+    return 1;
+}
+
+// add r,a; add r,b  =>  add r,a+b (e.g. stack pointer adjustments)
+static
+int ruleAddAdd(Instr* i, LiveSet live)
+{
+    int64_t v1, v2;
+    Operand o;
+
+    if (live & LS_FLAGS) return -1;
+    if (!isAddImm(i, &v1) || !isAddImm(i + 1, &v2) ||
+        !opIsEqual(&(i[0].dst), &(i[1].dst)))
+        return -1;
+    v1 += v2;
+    if (i[0].dst.type == OT_Reg32) v1 = (int32_t) v1;
+    if (v1 == 0) {
+        // 32bit operation still clears upper half
+        if (i[0].dst.type == OT_Reg32) return -1;
+        return 0;
+    }
+    if (!fitsImm32(v1) || !fitsImm32(-v1)) return -1;
+
+    copyOperand(&o, &(i[0].dst));
+    if (v1 > 0)
+        initBinaryInstr(i, IT_ADD, VT_None, &o, getImmOp(VT_32, v1));
+    else
+        initBinaryInstr(i, IT_SUB, VT_None, &o, getImmOp(VT_32, -v1));
+    i->info_stack = SA_None;
+    return 1;
+}
+
+// add/sub/or/xor r,0; and r,-1; imul r,r,1  =>  removed (64bit only)
+// imul r1,r2,1  =>  mov r1,r2
+static
+int ruleNeutral(Instr* i, LiveSet live)
+{
+    Instr orig;
+    int64_t v;
+
+    if (live & LS_FLAGS) return -1;
+
+    if ((i->type == IT_IMUL) && (i->form == OF_3) &&
+        opIsGP3264(&(i->dst)) && opIsImm(&(i->src2)) &&
+        (immValue(&(i->src2)) == 1)) {
+        if (opIsEqual(&(i->dst), &(i->src)) && (i->dst.type == OT_Reg64))
+            return 0;
+        // source may be a memory operand: keep stack annotation
+        copyInstr(&orig, i);
+        initBinaryInstr(i, IT_MOV, VT_None, &(orig.dst), &(orig.src));
+        i->info_stack = orig.info_stack;
+        i->info_stackOff = orig.info_stackOff;
+        i->info_stackLen = orig.info_stackLen;
+        return 1;
+    }
+
+    if ((i->form != OF_2) || !opIsGPReg(&(i->dst)) ||
+        (i->dst.type != OT_Reg64) || !opIsImm(&(i->src)))
+        return -1;
+    v = immValue(&(i->src));
+    switch(i->type) {
+    case IT_ADD:
+    case IT_SUB:
+    case IT_OR:
+    case IT_XOR:
+        return (v == 0) ? 0 : -1;
+    case IT_AND:
+        return (v == -1) ? 0 : -1;
+    default: break;
+    }
+    return -1;
+}
+
+// lea (r1),r2  =>  mov r1,r2 or removed
+static
+int ruleLeaBase(Instr* i, LiveSet live)
+{
+    Operand* src = &(i->src);
+    Operand dst, o;
+
+    (void) live;
+    if ((i->type != IT_LEA) || (i->dst.type != OT_Reg64) ||
+        (src->val != 0) || (src->scale != 0) || (src->seg != OSO_None) ||
+        (src->reg.rt != RT_GP64))
+        return -1;
+    if (src->reg.ri == i->dst.reg.ri) return 0;
+
+    copyOperand(&dst, &(i->dst));
+    copyOperand(&o, getRegOp(src->reg));
+    initBinaryInstr(i, IT_MOV, VT_None, &dst, &o);
+    i->info_stack = SA_None;
+    return 1;
+}
+
+// mov r,0  =>  xor r32,r32 (shorter, but changes flags)
+static
+int ruleMovZero(Instr* i, LiveSet live)
+{
+    Operand o;
+
+    if (live & LS_FLAGS) return -1;
+    if ((i->type != IT_MOV) || !opIsGP3264(&(i->dst)) ||
+        !opIsImm(&(i->src)) || (i->src.val != 0))
+        return -1;
+
+    copyOperand(&o, getRegOp(getReg(RT_GP32, i->dst.reg.ri)));
+    initBinaryInstr(i, IT_XOR, VT_None, &o, &o);
+    i->info_stack = SA_None;
+    return 1;
+}
+
+static PeepholeRule peepholeRules[] = {
+    { "mov/add imm", 2, ruleMovAdd },
+    { "add/add imm", 2, ruleAddAdd },
+    { "neutral op",  1, ruleNeutral },
+    { "lea base",    1, ruleLeaBase },
+    { "mov 0",       1, ruleMovZero },
+    { 0, 0, 0 }
+};
+
+// registers/flags live after each instruction of <cbb>, from results of
+// analyzeLiveness
+static
+LiveSet* liveAfterInstrs(Rewriter* r, CBB* cbb)
+{
+    Effects e;
+    LiveSet live, *liveAfter;
+    int64_t limit;
+    int i;
+
+    liveAfter = (LiveSet*) arena_alloc(r->arena, sizeof(LiveSet) * cbb->count);
+    liveOut(cbb, &live, &limit);
+    for(i = cbb->count - 1; i >= 0; i--) {
+        liveAfter[i] = live;
+        getEffects(cbb->instr + i, &e);
+        transfer(&e, &live, &limit);
+    }
+    return liveAfter;
+}
+
+// apply rules to <cbb> once, return number of rewrites
+static
+int peepholeCBB(Rewriter* r, CBB* cbb)
+{
+    LiveSet* liveAfter;
+    Instr window[2];
+    int i, j, k, n, count = 0;
+
+    if (cbb->count == 0) return 0;
+
+    liveAfter = liveAfterInstrs(r, cbb);
+
+    // rewritten instructions are written back in-place, never more
+    n = 0;
+    for(i = 0; i < cbb->count; ) {
+        PeepholeRule* rule;
+        int res = -1;
+
+        for(rule = peepholeRules; rule->name; rule++) {
+            if (i + rule->len > cbb->count) continue;
+            for(j = 0; j < rule->len; j++)
+                copyInstr(window + j, cbb->instr + i + j);
+            res = rule->func(window, liveAfter[i + rule->len - 1]);
+            if (res >= 0) break;
+        }
+        if (res < 0) {
+            if (n < i) cbb->instr[n] = cbb->instr[i];
+            n++;
+            i++;
+            continue;
+        }
+
+        if (r->showOptSteps)
+            printf("  peephole '%s' at '%s' in CBB (%s)\n", rule->name,
+                   instr2string(cbb->instr + i, 0, cbb->fc),
+                   cbb_prettyName(cbb));
+        for(k = 0; k < res; k++)
+            cbb->instr[n++] = window[k];
+        i += rule->len;
+        count++;
+    }
+    cbb->count = n;
+
+    return count;
+}
+
+void optPassPeephole(RContext* c)
+{
+    Rewriter* r = c->r;
+    int i, count;
+
+    if (r->showOptSteps)
+        printf("Run Peephole Optimization\n");
+
+    // rewrites may enable further ones
+    do {
+        analyzeLiveness(r);
+        count = 0;
+        for(i = 0; i < r->capBBCount; i++)
+            count += peepholeCBB(r, r->capBB[i]);
+    } while(count > 0);
+}
+
+
+//----------------------------------------------------------
+// Strength reduction
+//
+// Multiplication with a constant which became an immediate on capturing
+// is replaced by shift and lea sequences. Signed division of a sign
+// extended dividend (cdq/cqo) by a constant materialized into the divisor
+// register just before idiv is replaced by shifts for powers of 2 and by
+// a multiply-high with a "magic" number otherwise (see Hacker's Delight,
+// chapter 10). Only positive divisors fitting into 31 bits are handled.
+//
+
+#define REDUCE_MAXLEN 16
+
+// append instruction <it> with operands <o1>/<o2> to <seq>
+static
+void emitOp(Instr* seq, int* n, InstrType it, Operand* o1, Operand* o2)
+{
+    Instr* i = seq + (*n)++;
+
+    assert(*n <= REDUCE_MAXLEN);
+    if (o2)
+        initBinaryInstr(i, it, VT_None, o1, o2);
+    else
+        initUnaryInstr(i, it, o1);
+    i->info_stack = SA_None;
+}
+
+// immediate of width of <o>, shift counts use imm8
+static
+void emitImm(Instr* seq, int* n, InstrType it, Operand* o, int64_t v)
+{
+    Operand imm;
+
+    if ((it == IT_SHL) || (it == IT_SHR) || (it == IT_SAR))
+        copyOperand(&imm, getImmOp(VT_8, v));
+    else if (o->type == OT_Reg32)
+        copyOperand(&imm, getImmOp(VT_32, (uint32_t) v));
+    else
+        copyOperand(&imm, getImmOp(VT_64, v));
+    emitOp(seq, n, it, o, &imm);
+}
+
+// lea r,[r+r*(f-1)] with f in {3,5,9}
+static
+void emitLeaMul(Instr* seq, int* n, Operand* r, int f)
+{
+    Operand m;
+
+    m.type = (r->type == OT_Reg32) ? OT_Ind32 : OT_Ind64;
+    m.reg = getReg(RT_GP64, r->reg.ri);
+    m.ireg = m.reg;
+    m.scale = f - 1;
+    m.val = 0;
+    m.seg = OSO_None;
+    emitOp(seq, n, IT_LEA, r, &m);
+}
+
+static
+int log2Exact(uint64_t v)
+{
+    int k = 0;
+
+    if ((v == 0) || (v & (v - 1))) return -1;
+    while(v > 1) {
+        v = v >> 1;
+        k++;
+    }
+    return k;
+}
+
+static
+int leaFactor(int64_t v)
+{
+    return ((v == 3) || (v == 5) || (v == 9)) ? (int) v : 0;
+}
+
+// imul r,imm  =>  neg / shl / lea / lea+shl / lea+lea (flags dead)
+// imul r1,r2,imm  =>  mov r1,r2 and the same
+static
+int reduceMul(Instr* instr, LiveSet live, Instr* seq)
+{
+    Operand r, *imm;
+    int64_t v;
+    int n = 0, k, f1, f2;
+
+    if ((instr->type != IT_IMUL) || (instr->ptLen > 0) ||
+        !opIsGP3264(&(instr->dst)))
+        return -1;
+    if (instr->form == OF_2)
+        imm = &(instr->src);
+    else if ((instr->form == OF_3) && opIsGP3264(&(instr->src)))
+        imm = &(instr->src2);
+    else
+        return -1;
+    if (!opIsImm(imm) || (live & LS_FLAGS)) return -1;
+
+    copyOperand(&r, &(instr->dst));
+    v = immValue(imm);
+    if (r.type == OT_Reg32) v = (int32_t) v;
+    if ((v < 2) && (v != -1)) return -1;
+
+    if ((instr->form == OF_3) && !opIsEqual(&r, &(instr->src)))
+        emitOp(seq, &n, IT_MOV, &r, &(instr->src));
+    if (v == -1) {
+        emitOp(seq, &n, IT_NEG, &r, 0);
+        return n;
+    }
+
+    // strip power of 2
+    k = 0;
+    while((v & 1) == 0) {
+        v = v >> 1;
+        k++;
+    }
+    f1 = leaFactor(v);
+    if (v == 1) {
+        emitImm(seq, &n, IT_SHL, &r, k);
+        return n;
+    }
+    if (f1) {
+        emitLeaMul(seq, &n, &r, f1);
+        if (k > 0) emitImm(seq, &n, IT_SHL, &r, k);
+        return n;
+    }
+    if (k > 0) return -1;
+    for(f1 = 3; f1 <= 9; f1 += 2) {
+        f2 = leaFactor(v / f1);
+        if (!leaFactor(f1) || (v % f1) || !f2) continue;
+        emitLeaMul(seq, &n, &r, f1);
+        emitLeaMul(seq, &n, &r, f2);
+        return n;
+    }
+    return -1;
+}
+
+// magic multiplier <m> and shift <s> for signed division by <d> >= 2
+// with <w>-bit operands
+static
+void divMagic(int w, uint64_t d, int64_t* m, int* s)
+{
+    uint64_t mask = (w == 64) ? ~0ul : 0xfffffffful;
+    uint64_t two = 1ul << (w - 1);
+    uint64_t anc, q1, r1, q2, r2, delta;
+    int p = w - 1;
+
+    anc = two - 1 - two % d;
+    q1 = two / anc;
+    r1 = two - q1 * anc;
+    q2 = two / d;
+    r2 = two - q2 * d;
+    do {
+        p++;
+        q1 = (2 * q1) & mask;
+        r1 = (2 * r1) & mask;
+        if (r1 >= anc) {
+            q1 = (q1 + 1) & mask;
+            r1 = (r1 - anc) & mask;
+        }
+        q2 = (2 * q2) & mask;
+        r2 = (2 * r2) & mask;
+        if (r2 >= d) {
+            q2 = (q2 + 1) & mask;
+            r2 = (r2 - d) & mask;
+        }
+        delta = d - r2;
+    } while((q1 < delta) || ((q1 == delta) && (r1 == 0)));
+
+    *m = (int64_t) ((q2 + 1) & mask);
+    if (w == 32) *m = (int32_t) *m;
+    *s = p - w;
+}
+
+// search backwards from idiv at <idx> for constant in divisor register
+// and sign extension of dividend, return divisor or 0
+static
+int64_t divConstant(CBB* cbb, int idx)
+{
+    Instr* div = cbb->instr + idx;
+    int ri = gpIndex(div->dst.reg);
+    ValType cqtoType = (div->dst.type == OT_Reg64) ? VT_128 : VT_64;
+    LiveSet ad = LS_GP(RI_A) | LS_GP(RI_D);
+    bool sext = false;
+    int64_t d = 0;
+    Effects e;
+
+    for(int i = idx - 1; i >= 0; i--) {
+        Instr* instr = cbb->instr + i;
+
+        getEffects(instr, &e);
+        if (e.use == LS_ALL) return 0;
+        if (!sext && (instr->type == IT_CQTO)) {
+            if (instr->vtype != cqtoType) return 0;
+            sext = true;
+        }
+        else if (!sext && (e.write & ad)) return 0;
+
+        if ((d == 0) && (e.write & LS_GP(ri))) {
+            if ((instr->type != IT_MOV) || (instr->ptLen > 0) ||
+                !opIsEqual(&(instr->dst), &(div->dst)) ||
+                !opIsImm(&(instr->src)))
+                return 0;
+            d = immValue(&(instr->src));
+            if (div->dst.type == OT_Reg32) d = (int32_t) d;
+            if ((d < 2) || (d > INT32_MAX)) return 0;
+        }
+        if (sext && (d != 0)) return d;
+    }
+    return 0;
+}
+
+// idiv r with r = d and edx:eax/rdx:rax sign extended (flags undefined)
+static
+int reduceDiv(CBB* cbb, int idx, LiveSet live, Instr* seq)
+{
+    Instr* instr = cbb->instr + idx;
+    Operand a, dx, r;
+    int64_t d, m;
+    int n = 0, w, k, s, ri;
+    bool remLive, rLive;
+
+    if ((instr->type != IT_IDIV1) || (instr->ptLen > 0) ||
+        !opIsGP3264(&(instr->dst)))
+        return -1;
+    w = (instr->dst.type == OT_Reg64) ? 64 : 32;
+    ri = gpIndex(instr->dst.reg);
+    if ((ri == RI_A) || (ri == RI_D)) return -1;
+    d = divConstant(cbb, idx);
+    if (d == 0) return -1;
+
+    copyOperand(&r, &(instr->dst));
+    copyOperand(&a, getRegOp(getReg(getGPRegType(opValType(&r)), RI_A)));
+    copyOperand(&dx, getRegOp(getReg(getGPRegType(opValType(&r)), RI_D)));
+    remLive = (live & LS_GP(RI_D)) != 0;
+    rLive = (live & LS_GP(ri)) != 0;
+
+    k = log2Exact(d);
+    if (k > 0) {
+        // edx: all bits set for negative dividend, used as bias d-1
+        emitImm(seq, &n, IT_SHR, &dx, w - k);
+        emitOp(seq, &n, IT_ADD, &a, &dx);
+        if (remLive) {
+            emitOp(seq, &n, IT_MOV, &r, &a);
+            emitImm(seq, &n, IT_AND, &r, d - 1);
+            emitOp(seq, &n, IT_SUB, &r, &dx);
+            emitOp(seq, &n, IT_MOV, &dx, &r);
+        }
+        emitImm(seq, &n, IT_SAR, &a, k);
+    }
+    else {
+        divMagic(w, d, &m, &s);
+        emitOp(seq, &n, IT_MOV, &r, &a);
+        emitImm(seq, &n, IT_MOV, &a, m);
+        emitOp(seq, &n, IT_IMUL, &r, 0);
+        if (m < 0) emitOp(seq, &n, IT_ADD, &dx, &r);
+        if (s > 0) emitImm(seq, &n, IT_SAR, &dx, s);
+        emitOp(seq, &n, IT_MOV, &a, &r);
+        emitImm(seq, &n, IT_SHR, &a, w - 1);
+        emitOp(seq, &n, IT_ADD, &dx, &a);
+        emitOp(seq, &n, IT_MOV, &a, &dx);
+        if (remLive) {
+            emitImm(seq, &n, IT_IMUL, &a, d);
+            emitOp(seq, &n, IT_SUB, &r, &a);
+            emitOp(seq, &n, IT_MOV, &a, &dx);
+            emitOp(seq, &n, IT_MOV, &dx, &r);
+        }
+    }
+    if (rLive) emitImm(seq, &n, IT_MOV, &r, d);
+    return n;
+}
+
+// replacement for instruction <idx> of <cbb>, or -1
+static
+int reduceInstr(CBB* cbb, int idx, LiveSet live, Instr* seq)
+{
+    int n = reduceMul(cbb->instr + idx, live, seq);
+
+    if (n < 0) n = reduceDiv(cbb, idx, live, seq);
+    return n;
+}
+
+// return number of reduced instructions
+static
+int reduceCBB(Rewriter* r, CBB* cbb)
+{
+    LiveSet* liveAfter;
+    Instr seq[REDUCE_MAXLEN];
+    Instr* newInstr;
+    int i, j, n, count = 0, newCount = 0;
+
+    if (cbb->count == 0) return 0;
+
+    liveAfter = liveAfterInstrs(r, cbb);
+    for(i = 0; i < cbb->count; i++) {
+        n = reduceInstr(cbb, i, liveAfter[i], seq);
+        if (n >= 0) count++;
+        newCount += (n >= 0) ? n : 1;
+    }
+    if (count == 0) return 0;
+
+    // sequences may be longer: instructions are copied
+    newInstr = newCapInstrs(r, newCount);
+    j = 0;
+    for(i = 0; i < cbb->count; i++) {
+        n = reduceInstr(cbb, i, liveAfter[i], seq);
+        if (n < 0) {
+            copyInstr(newInstr + j++, cbb->instr + i);
+            continue;
+        }
+        if (r->showOptSteps)
+            printf("  reducing '%s' in CBB (%s) to %d instructions\n",
+                   instr2string(cbb->instr + i, 0, cbb->fc),
+                   cbb_prettyName(cbb), n);
+        for(int k = 0; k < n; k++)
+            copyInstr(newInstr + j++, seq + k);
+    }
+    assert(j == newCount);
+    cbb->instr = newInstr;
+    cbb->count = newCount;
+
+    return count;
+}
+
+void optPassStrengthReduce(RContext* c)
+{
+    Rewriter* r = c->r;
+
+    if (r->showOptSteps)
+        printf("Run Strength Reduction\n");
+
+    analyzeLiveness(r);
+    for(int i = 0; i < r->capBBCount; i++)
+        reduceCBB(r, r->capBB[i]);
+}
@@ -272,7 +272,7 @@ const char* regName(Reg r)
 
 char* prettyAddress(uint64_t a, FunctionConfig* fc)
 {
-    static char buf[100];
+    static __thread char buf[100];
 
     if (fc) {
         // use name from registered, labeled memory ranges
@@ -301,7 +301,7 @@ char* prettyAddress(uint64_t a, FunctionConfig* fc)
 // if <fc> is not-null, use it to print immediates/displacement
 char* op2string(Operand* o, Instr* instr, FunctionConfig* fc)
 {
-    static char buf[30];
+    static __thread char buf[30];
     int off = 0;
     ValType t = instr->vtype;
     uint64_t val;
@@ -627,11 +627,14 @@ const char* instrName(InstrType it, int* pOpCount)
 
 char* instr2string(Instr* instr, int align, FunctionConfig* fc)
 {
-    static char buf[100];
+    static __thread char buf[100];
     const char* n;
     int oc = 0, off = 0;
 
     n = instrName(instr->type, &oc);
+    // sign-extend eax into edx (32bit) vs. rax into rdx
+    if ((instr->type == IT_CQTO) && (instr->vtype == VT_64))
+        n = "cltd";
 
     if (align)
         off += sprintf(buf, "%-7s", n);
@@ -668,7 +671,7 @@ char* instr2string(Instr* instr, int align, FunctionConfig* fc)
             typeVisible = true;
     }
     // is type implicitly known via instruction name?
-    if (instr->vtype == VT_Implicit)
+    if ((instr->vtype == VT_Implicit) || (instr->type == IT_CQTO))
         typeVisible = true;
 
     if (vt == VT_None) {
@@ -743,7 +746,7 @@ char* instr2string(Instr* instr, int align, FunctionConfig* fc)
 
 char* bytes2string(Instr* instr, int start, int count)
 {
-    static char buf[100];
+    static __thread char buf[100];
     int off = 0, i, j;
     for(i = start, j=0; (i < instr->len) && (j<count); i++, j++) {
         uint8_t b = ((uint8_t*) instr->addr)[i];
@@ -778,8 +781,8 @@ void printDecodedBBs(Rewriter* r)
     int i;
     for(i=0; i< r->decBBCount; i++) {
         printf("BB %s (%d instructions):\n",
-               prettyAddress(r->decBB[i].addr, r->decBB[i].fc),
-               r->decBB[i].count);
-        dbrew_print_decoded(r->decBB + i, r->printBytes);
+               prettyAddress(r->decBB[i]->addr, r->decBB[i]->fc),
+               r->decBB[i]->count);
+        dbrew_print_decoded(r->decBB[i], r->printBytes);
     }
 }
@@ -114,13 +114,11 @@ typedef enum _VecRegType {
     VRT_PtrDoubleX4, // pointer to double => pointer to 4 doubles
 } VecRegType;
 
-// maintain expansion state of 16 vector registers
-VecRegType vrt[16];
-
+// <vrt> is expansion state of 16 vector registers
 static
-void doVec(RContext* c, Instr* dst, Instr* src)
+void doVec(RContext* c, VecRegType* vrt, Instr* dst, Instr* src)
 {
-    static Error e;
+    Rewriter* r = c->r;
     RegIndex ri1, ri2;
     VecRegType vrt1, vrt2;
 
@@ -169,17 +167,17 @@ void doVec(RContext* c, Instr* dst, Instr* src)
     case IT_RET:
         break;
     default:
-        setError(&e, ET_UnsupportedInstr, EM_Rewriter, c->r,
+        setError(&r->error, ET_UnsupportedInstr, EM_Rewriter, r,
                  "Cannot handle instruction for vector expansion");
-        c->e = &e;
+        c->e = &r->error;
     break;
     }
 }
 
 static
-void vecPass(RContext* c, CBB* cbb)
+void vecPass(RContext* c, VecRegType* vrt, CBB* cbb)
 {
-    Instr *first = 0, *instr;
+    Instr* first;
     Rewriter* r = c->r;
     int i;
 
@@ -190,14 +188,9 @@ void vecPass(RContext* c, CBB* cbb)
                cbb->dec_addr, cbb->esID);
     }
 
-    for(i = 0; i < cbb->count; i++) {
-        instr = newCapInstr(c);
-        if (!instr) return;
-        if (!first) first = instr;
-
-        doVec(c, instr, cbb->instr + i);
-    }
-    assert(first != 0);
+    first = newCapInstrs(r, cbb->count);
+    for(i = 0; i < cbb->count; i++)
+        doVec(c, vrt, first + i, cbb->instr + i);
     cbb->instr = first;
 }
 
@@ -205,12 +198,12 @@ void vecPass(RContext* c, CBB* cbb)
 void runVectorization(RContext* c)
 {
     int i;
-    VecRegType retType;
+    VecRegType vrt[16], retType;
     Rewriter* r = c->r;
 
     assert(r->vreq != VR_None);
 
-    // tagging for xmm/ymm registers
+    // tagging for xmm/ymm registers, local to allow concurrent rewriting
     for(i=0; i<16; i++) vrt[i] = VRT_Unknown;
     retType = VRT_Unknown;
 
@@ -246,7 +239,7 @@ void runVectorization(RContext* c)
     }
 
     assert(r->capBBCount == 1);
-    vecPass(c, r->capBB);
+    vecPass(c, vrt, r->capBB[0]);
     if (c->e) return;
 
     // check for expanded return value
@@ -0,0 +1,64 @@
+//!compile = {cc} {ccflags} -O2 -pthread -o {outfile} {infile} {dbrew}
+
+// Background rewriting: the returned trampoline can be called at once,
+// and switches from the original to the rewritten code when finished
+
+#include <dbrew.h>
+#include <stdio.h>
+
+typedef long (*poly_t)(long*, long, long);
+
+__attribute__ ((noinline))
+long poly(long* c, long n, long x)
+{
+    long i, sum = 0;
+
+    for(i = n - 1; i >= 0; i--)
+        sum = sum * x + c[i];
+    return sum;
+}
+
+long coeff1[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+long coeff2[4] = { 4, 3, 2, 1 };
+
+int main(void)
+{
+    Rewriter* r = dbrew_new();
+    poly_t p1, p2;
+    uint64_t code;
+    int i, wrong = 0;
+
+    dbrew_set_function(r, (uint64_t) poly);
+    dbrew_config_parcount(r, 3);
+    dbrew_config_staticpar(r, 0);
+    dbrew_config_staticpar(r, 1);
+
+    p1 = (poly_t) dbrew_rewrite_async(r, coeff1, 8, 0);
+    printf("trampoline: %s\n", (p1 != poly) ? "yes" : "no");
+
+    // calls while rewriting is in progress
+    for(i = 0; i < 100000; i++)
+        if (p1(coeff1, 8, i) != poly(coeff1, 8, i)) wrong++;
+
+    code = dbrew_rewrite_wait(r);
+    printf("rewritten: %s, wrong results %d\n",
+           (code != (uint64_t) poly) ? "yes" : "no", wrong);
+    printf("results: %ld/%ld\n", poly(coeff1, 8, 3), p1(coeff1, 8, 3));
+
+    // another request of same rewriter gets its own trampoline
+    p2 = (poly_t) dbrew_rewrite_async(r, coeff2, 4, 0);
+    code = dbrew_rewrite_wait(r);
+    printf("new trampoline: %s, rewritten: %s\n",
+           (p1 != p2) ? "yes" : "no",
+           (code != (uint64_t) poly) ? "yes" : "no");
+    printf("results: %ld/%ld %ld/%ld\n",
+           poly(coeff1, 8, 2), p1(coeff1, 8, 2),
+           poly(coeff2, 4, 2), p2(coeff2, 4, 2));
+
+    // freeing the rewriter waits for a pending rewrite
+    dbrew_rewrite_async(r, coeff2, 2, 0);
+    dbrew_free(r);
+    printf("done\n");
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+//!compile = {cc} {ccflags} -O2 -o {outfile} {infile} {dbrew}
+
+// Capture budget: when exhausted, the rest of the function gets captured
+// without specialization instead of failing, with loops kept rolled.
+// If the code size budget cannot be met, the original function is used
+
+#include <dbrew.h>
+#include <stdio.h>
+
+typedef unsigned long (*hash_t)(const unsigned long*, long, unsigned long);
+
+// FNV-1a style hash of a key known at rewrite time, with dynamic seed
+__attribute__ ((noinline))
+unsigned long hash(const unsigned long* key, long len, unsigned long seed)
+{
+    unsigned long h = seed;
+    long i;
+
+    for(i = 0; i < len; i++) {
+        h ^= key[i];
+        h *= 0x1000193UL;
+    }
+    return h;
+}
+
+unsigned long key[800];
+
+static
+int rewrite(int maxInstrs, int maxCodeSize, uint64_t maxSteps, int maxMillis,
+            int* wrong, int* original)
+{
+    Rewriter* r = dbrew_new();
+    hash_t p;
+    int size;
+
+    dbrew_set_function(r, (uint64_t) hash);
+    dbrew_config_parcount(r, 3);
+    dbrew_config_staticpar(r, 0);
+    dbrew_config_staticpar(r, 1);
+    dbrew_set_capture_budget(r, maxInstrs, maxCodeSize, maxSteps, maxMillis);
+
+    p = (hash_t) dbrew_rewrite(r, key, 800, 0UL);
+    if (p == hash)
+        (*original)++;
+    if ((p(key, 800, 0UL) != hash(key, 800, 0UL)) ||
+        (p(key, 800, 12345UL) != hash(key, 800, 12345UL)))
+        (*wrong)++;
+    size = dbrew_generated_size(r);
+
+    dbrew_free(r);
+    return size;
+}
+
+int main(void)
+{
+    int unrolled, size, wrong = 0, original = 0;
+    long i;
+
+    for(i = 0; i < 800; i++)
+        key[i] = 7 * i + 3;
+
+    unrolled = rewrite(0, 0, 0, 0, &wrong, &original);
+    size = rewrite(100, 0, 0, 0, &wrong, &original);
+    printf("instructions: smaller %s\n", (size < unrolled) ? "yes" : "no");
+    size = rewrite(0, 0, 500, 0, &wrong, &original);
+    printf("steps: smaller %s\n", (size < unrolled) ? "yes" : "no");
+    size = rewrite(0, 2000, 0, 0, &wrong, &original);
+    printf("code size: within budget %s\n", (size <= 2000) ? "yes" : "no");
+    // result depends on speed, but always is a rewritten function
+    rewrite(0, 0, 0, 1, &wrong, &original);
+    printf("original functions: %d\n", original);
+    // no rewritten code can be that small
+    rewrite(0, 8, 0, 0, &wrong, &original);
+    printf("code size too small: original functions %d\n", original);
+    printf("wrong results: %d\n", wrong);
+
+    return 0;
+}
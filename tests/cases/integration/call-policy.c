@@ -0,0 +1,110 @@
+//!compile = {cc} {ccflags} -O2 -o {outfile} {infile} {dbrew}
+
+// Call policies: calls kept in the rewritten code (with varargs and
+// floating-point arguments for printf), replaced by another function.
+// Calls to targets unknown at rewrite time fall back to the original
+// function, and calls getting stack data are inlined even if to be kept
+
+#include <dbrew.h>
+#include <stdio.h>
+
+typedef long (*op_t)(long);
+typedef long (*kernel_t)(long, long, op_t);
+
+__attribute__ ((noinline))
+long scale(long x, long f)
+{
+    return x * f + 1;
+}
+
+__attribute__ ((noinline))
+long twice(long x)
+{
+    return 2 * x;
+}
+
+__attribute__ ((noinline))
+long thrice(long x)
+{
+    return 3 * x;
+}
+
+__attribute__ ((noinline))
+long negate(long x)
+{
+    return -x;
+}
+
+__attribute__ ((noinline))
+long load(long* p)
+{
+    return *p + 1;
+}
+
+__attribute__ ((noinline))
+long pair(long n)
+{
+    long v[2] = { n, 2 * n };
+
+    return load(v) + load(v + 1);
+}
+
+double ratio = 0.5;
+
+__attribute__ ((noinline))
+long kernel(long n, long x, op_t op)
+{
+    long i, sum = 0;
+
+    for(i = 0; i < n; i++)
+        sum += scale(x, i) + twice(i);
+    printf("kernel: n %ld, ratio %.2f\n", n, ratio * 3);
+    return sum + 2 * op(x);
+}
+
+int main(void)
+{
+    Rewriter* r = dbrew_new();
+    kernel_t k;
+    op_t p;
+    long res, expected;
+
+    dbrew_set_function(r, (uint64_t) kernel);
+    dbrew_config_parcount(r, 3);
+    dbrew_config_staticpar(r, 0);
+    dbrew_config_function_setcall(r, (uint64_t) printf, DBREW_CALL_KEEP, 0);
+
+    // indirect call to unknown target: not rewritten
+    k = (kernel_t) dbrew_rewrite(r, 4, 5, negate);
+    res = k(4, 5, negate);
+    printf("unknown target: rewritten %s, %ld/%ld\n",
+           (k != kernel) ? "yes" : "no", kernel(4, 5, negate), res);
+
+    // scale, twice and op inlined
+    dbrew_config_staticpar(r, 2);
+    k = (kernel_t) dbrew_rewrite(r, 4, 5, negate);
+    res = k(4, 5, negate);
+    printf("inlined: rewritten %s, %ld/%ld\n",
+           (k != kernel) ? "yes" : "no", kernel(4, 5, negate), res);
+
+    // call to scale kept, thrice called instead of twice (also via op)
+    dbrew_config_function_setcall(r, (uint64_t) scale, DBREW_CALL_KEEP, 0);
+    dbrew_config_function_setcall(r, (uint64_t) twice,
+                                  DBREW_CALL_REPLACE, (uint64_t) thrice);
+    k = (kernel_t) dbrew_rewrite(r, 4, 5, twice);
+    res = k(4, 7, twice);
+    expected = 4 + 7 * 6 + 3 * 6 + 2 * 21;
+    printf("kept: rewritten %s, %ld/%ld\n",
+           (k != kernel) ? "yes" : "no", expected, res);
+
+    // load gets address of stack data: inlined instead of kept
+    dbrew_set_function(r, (uint64_t) pair);
+    dbrew_config_parcount(r, 1);
+    dbrew_config_function_setcall(r, (uint64_t) load, DBREW_CALL_KEEP, 0);
+    p = (op_t) dbrew_rewrite(r, 3);
+    printf("stack data: rewritten %s, %ld/%ld\n",
+           (p != pair) ? "yes" : "no", pair(3), p(3));
+
+    dbrew_free(r);
+    return 0;
+}
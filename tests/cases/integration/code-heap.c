@@ -0,0 +1,58 @@
+//!compile = {cc} {ccflags} -O2 -o {outfile} {infile} {dbrew}
+
+// Code storage grows beyond initial capacity; code generated by earlier
+// rewrites stays valid until released. Bad releases are ignored
+
+#include <dbrew.h>
+#include <stdio.h>
+
+#define COUNT 300
+
+typedef long (*func_t)(long, long);
+
+__attribute__ ((noinline))
+long func(long a, long b)
+{
+    return (a ^ b) + a;
+}
+
+int main(void)
+{
+    Rewriter* r = dbrew_new();
+    func_t f[COUNT];
+    int i, wrong = 0, rewritten = 0;
+
+    // only a small initial code buffer
+    dbrew_set_capture_capacity(r, 0, 0, 100);
+    dbrew_set_function(r, (uint64_t) func);
+    dbrew_config_parcount(r, 2);
+    dbrew_config_staticpar(r, 0);
+
+    for(i = 0; i < COUNT; i++) {
+        f[i] = (func_t) dbrew_rewrite(r, i, 1);
+        if (f[i] != func) rewritten++;
+    }
+    for(i = 0; i < COUNT; i++)
+        if (f[i](i, 3) != func(i, 3)) wrong++;
+    printf("rewritten %d, wrong results %d\n", rewritten, wrong);
+
+    // releasing twice or via an address within a function is ignored
+    for(i = 1; i < COUNT; i += 2) {
+        dbrew_release_code(r, (uint64_t) f[i]);
+        dbrew_release_code(r, (uint64_t) f[i]);
+        dbrew_release_code(r, (uint64_t) f[i - 1] + 1);
+    }
+    wrong = 0;
+    for(i = 0; i < COUNT; i += 2)
+        if (f[i](i, 3) != func(i, 3)) wrong++;
+    printf("after bad releases: wrong results %d\n", wrong);
+
+    for(i = 0; i < COUNT; i++)
+        dbrew_release_code(r, (uint64_t) f[i]);
+
+    f[0] = (func_t) dbrew_rewrite(r, 7, 1);
+    printf("after release: %ld/%ld\n", func(7, 5), f[0](7, 5));
+
+    dbrew_free(r);
+    return 0;
+}
@@ -0,0 +1,59 @@
+//!compile = {cc} {ccflags} -O2 -o {outfile} {infile} {dbrew}
+
+// Loads from a memory range registered as constant are folded:
+// the coefficients of the polynomial become immediates
+
+#include <dbrew.h>
+#include <stdio.h>
+
+typedef long (*poly_t)(long);
+
+const long coeff[4] = { 3, 1, 4, 1 };
+long n = 4;
+
+__attribute__ ((noinline))
+long poly(long x)
+{
+    long i, sum = 0;
+
+    for(i = n - 1; i >= 0; i--)
+        sum = sum * x + coeff[i];
+    return sum;
+}
+
+static
+int rewrite(Rewriter* r, bool registerData, poly_t* p)
+{
+    dbrew_set_function(r, (uint64_t) poly);
+    dbrew_config_parcount(r, 1);
+    // loop bound is static, coefficients only if registered
+    dbrew_config_set_memrange(r, "n", false, (uint64_t) &n, sizeof(n));
+    if (registerData)
+        dbrew_config_set_memrange(r, "coeff", false,
+                                  (uint64_t) coeff, sizeof(coeff));
+    *p = (poly_t) dbrew_rewrite(r, 0);
+    return dbrew_generated_size(r);
+}
+
+int main(void)
+{
+    Rewriter* r1 = dbrew_new();
+    Rewriter* r2 = dbrew_new();
+    poly_t p1, p2;
+    int s1, s2, wrong = 0;
+
+    s1 = rewrite(r1, false, &p1);
+    s2 = rewrite(r2, true, &p2);
+
+    for(long x = -10; x < 10; x++) {
+        if (p1(x) != poly(x)) wrong++;
+        if (p2(x) != poly(x)) wrong++;
+    }
+    printf("rewritten: %s/%s, smaller with constant data: %s, wrong %d\n",
+           (p1 != poly) ? "yes" : "no", (p2 != poly) ? "yes" : "no",
+           (s2 < s1) ? "yes" : "no", wrong);
+
+    dbrew_free(r1);
+    dbrew_free(r2);
+    return 0;
+}
@@ -0,0 +1,27 @@
+//!args=--run
+// static vector registers are loaded RIP-relative from a constant pool
+// behind the generated code: xmm0 and xmm3 share one 16-byte constant,
+// xmm4 uses an 8-byte one
+        .intel_syntax noprefix
+        .text
+        .globl  f1
+        .type   f1, @function
+f1:
+        mov rax, 0x4000000000000000
+        mov [rsp-16], rax
+        mov rax, 0x4008000000000000
+        mov [rsp-8], rax
+        movupd xmm0, [rsp-16]
+        movupd xmm3, [rsp-16]
+        movq xmm1, rsi
+        movq xmm2, rsi
+        movlhps xmm1, xmm2
+        mulpd xmm1, xmm0
+        addpd xmm1, xmm3
+        mov rax, 0x4000000000000000
+        movq xmm4, rax
+        addsd xmm1, xmm4
+        movupd [rsp-32], xmm1
+        mov rax, [rsp-32]
+        add rax, [rsp-24]
+        ret
@@ -0,0 +1,27 @@
+//!args=--run
+// dead code elimination: unused register moves and flag results,
+// stores below the stack pointer at return are removed
+        .intel_syntax noprefix
+        .text
+        .globl  f1
+        .type   f1, @function
+f1:
+        push rbx
+        sub rsp, 16
+        mov rax, rsi
+        add rax, 1
+        mov rcx, rsi
+        mov r9, rsi
+        mov [rsp+8], rsi
+        mov rbx, [rsp+8]
+        mov [rsp], rax
+        cmp rsi, 5
+        add rax, rbx
+        test rsi, rsi
+        jz 1f
+        add rax, r9
+1:
+        mov r10, rax
+        add rsp, 16
+        pop rbx
+        ret
@@ -0,0 +1,83 @@
+//!compile = {cc} {ccflags} -o {outfile} {infile} {dbrew}
+
+// Full unrolling with more captured blocks and deeper inlined calls than
+// the initial sizes of the capture structures, and the capture limits
+
+#include <dbrew.h>
+#include <stdio.h>
+
+// x plus sum of i < n with i < x; as assembly to not depend on compiler
+long bits(long n, long x);
+__asm__(
+    "    .text\n"
+    "bits:\n"
+    "    mov %rsi,%rax\n"
+    "    xor %ecx,%ecx\n"
+    "1:  cmp %rdi,%rcx\n"
+    "    jge 3f\n"
+    "    cmp %rcx,%rsi\n"
+    "    jle 2f\n"
+    "    add %rcx,%rax\n"
+    "2:  add $1,%rcx\n"
+    "    jmp 1b\n"
+    "3:  ret\n"
+);
+
+// (n+1) * x, using recursion depth n
+long rec(long n, long x);
+__asm__(
+    "    .text\n"
+    "rec:\n"
+    "    test %rdi,%rdi\n"
+    "    jne 1f\n"
+    "    mov %rsi,%rax\n"
+    "    ret\n"
+    "1:  push %rbx\n"
+    "    mov %rsi,%rbx\n"
+    "    sub $1,%rdi\n"
+    "    call rec\n"
+    "    add %rbx,%rax\n"
+    "    pop %rbx\n"
+    "    ret\n"
+);
+
+typedef long (*func_t)(long, long);
+
+int main(void)
+{
+    Rewriter* r = dbrew_new();
+    func_t f;
+
+    dbrew_set_capture_capacity(r, 1000, 0, 0);
+    dbrew_set_function(r, (uint64_t) bits);
+    dbrew_config_parcount(r, 2);
+    dbrew_config_staticpar(r, 0);
+    f = (func_t) dbrew_rewrite(r, 40, 0);
+    printf("bits: rewritten %s, %ld/%ld\n", (f != bits) ? "yes" : "no",
+           bits(40, 25), f(40, 25));
+
+    dbrew_set_function(r, (uint64_t) rec);
+    dbrew_config_parcount(r, 2);
+    dbrew_config_staticpar(r, 0);
+    f = (func_t) dbrew_rewrite(r, 12, 0);
+    printf("rec: rewritten %s, %ld/%ld\n", (f != rec) ? "yes" : "no",
+           rec(12, 3), f(12, 3));
+
+    // exceeding limits falls back to original function
+    dbrew_set_capture_limits(r, 8, 0);
+    f = (func_t) dbrew_rewrite(r, 12, 0);
+    printf("rec, depth limit 8: rewritten %s, %ld/%ld\n",
+           (f != rec) ? "yes" : "no", rec(12, 3), f(12, 3));
+
+    dbrew_set_function(r, (uint64_t) bits);
+    dbrew_config_parcount(r, 2);
+    dbrew_config_staticpar(r, 0);
+    dbrew_set_capture_limits(r, 0, 10);
+    f = (func_t) dbrew_rewrite(r, 40, 0);
+    printf("bits, state limit 10: rewritten %s, %ld/%ld\n",
+           (f != bits) ? "yes" : "no",
+           bits(40, 25), f(40, 25));
+
+    dbrew_free(r);
+    return 0;
+}
@@ -0,0 +1,26 @@
+//!args=--run
+// double arithmetic on static values is folded. Static values are loaded
+// as constants only when used together with unknown data: xmm0 before
+// the last mulsd, the stack slot before the first addsd, and xmm4 (zeroed
+// by xorpd) before the last addsd
+        .intel_syntax noprefix
+        .text
+        .globl  f1
+        .type   f1, @function
+f1:
+        mov rax, 0x4000000000000000
+        movq xmm0, rax
+        mov rax, 0x4008000000000000
+        movq xmm1, rax
+        mulsd xmm0, xmm1
+        addsd xmm0, xmm0
+        sqrtsd xmm2, xmm0
+        maxsd xmm0, xmm2
+        movsd [rsp-8], xmm0
+        movq xmm3, rsi
+        addsd xmm3, [rsp-8]
+        mulsd xmm3, xmm0
+        xorpd xmm4, xmm4
+        addsd xmm3, xmm4
+        movq rax, xmm3
+        ret
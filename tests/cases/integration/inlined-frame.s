@@ -0,0 +1,25 @@
+//!args=--run
+// frame pointer setup and teardown of an inlined function is removed,
+// with rbp-relative accesses converted to rsp-relative ones
+        .intel_syntax noprefix
+        .text
+        .globl  f1
+        .type   f1, @function
+f1:
+        push rbx
+        mov rbx, rsi
+        call helper
+        add rax, rbx
+        pop rbx
+        ret
+helper:
+        push rbp
+        mov rbp, rsp
+        sub rsp, 16
+        mov [rbp-16], rsi
+        push rsi
+        mov eax, [rbp-16]
+        pop rcx
+        add rax, rcx
+        leave
+        ret
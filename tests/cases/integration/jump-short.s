@@ -0,0 +1,20 @@
+//!args=--run
+// branch relaxation: short Jcc and Jmp forms wherever targets are in reach
+.intel_syntax noprefix
+    .text
+    .globl  f1
+    .type   f1, @function
+f1:
+    mov eax, esi
+1:
+    test esi, 1
+    jz 2f
+    add eax, esi
+2:
+    test esi, 2
+    jz 3f
+    add eax, 1
+3:
+    dec esi
+    jnz 1b
+    ret
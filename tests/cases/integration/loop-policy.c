@@ -0,0 +1,76 @@
+//!compile = {cc} {ccflags} -O2 -o {outfile} {infile} {dbrew}
+
+// Loop policies: with static trip count, loops get fully unrolled by
+// default. Kept rolled, code size does not depend on the trip count
+
+#include <dbrew.h>
+#include <stdio.h>
+
+typedef struct {
+    long count;
+    long f[4];
+} Coeff;
+
+typedef long (*apply_t)(Coeff*, long*, long);
+
+__attribute__ ((noinline))
+long apply(Coeff* c, long* x, long n)
+{
+    long i, j, s = 0;
+
+    for(i = 0; i < n; i++)
+        for(j = 0; j < c->count; j++)
+            s += c->f[j] * x[i + j];
+    return s;
+}
+
+Coeff coeff = { 3, { 2, 5, 7, 0 } };
+long x[1010];
+
+static
+int rewrite(DBrewLoopPolicy policy, int count, long n, int* wrong)
+{
+    Rewriter* r = dbrew_new();
+    apply_t p;
+    int size;
+
+    dbrew_set_function(r, (uint64_t) apply);
+    dbrew_config_parcount(r, 3);
+    dbrew_config_staticpar(r, 0);
+    dbrew_config_staticpar(r, 2);
+    dbrew_config_loops(r, policy, count);
+
+    p = (apply_t) dbrew_rewrite(r, &coeff, x, n);
+    if ((p == apply) || (p(&coeff, x, n) != apply(&coeff, x, n)))
+        (*wrong)++;
+    size = dbrew_generated_size(r);
+
+    dbrew_free(r);
+    return size;
+}
+
+int main(void)
+{
+    static const char* name[] = { "unroll", "rolled", "partial", "peel" };
+    int i, unrolled, size, wrong = 0;
+    long j;
+
+    for(j = 0; j < 1010; j++)
+        x[j] = 3 * j + 1;
+
+    unrolled = rewrite(DBREW_LOOP_UNROLL, 1, 1000, &wrong);
+    for(i = DBREW_LOOP_ROLLED; i <= DBREW_LOOP_PEEL; i++) {
+        size = rewrite((DBrewLoopPolicy) i, 4, 1000, &wrong);
+        printf("%s: smaller %s, same size for other trip count %s\n",
+               name[i], (size < unrolled) ? "yes" : "no",
+               (size == rewrite((DBrewLoopPolicy) i, 4, 500, &wrong)) ?
+                   "yes" : "no");
+    }
+    // short loops still get unrolled
+    printf("peel short loop: %s\n",
+           (rewrite(DBREW_LOOP_PEEL, 4, 3, &wrong) ==
+            rewrite(DBREW_LOOP_UNROLL, 1, 3, &wrong)) ? "unrolled" : "rolled");
+    printf("wrong results: %d\n", wrong);
+
+    return 0;
+}
@@ -10,8 +10,10 @@ f1:
     lea rdx,[rip+wdata]
     mov qword ptr [rdx],1
     // TODO: add test with movabs + 64bit immediate
-    // uncomment if accessing read-only mem range is handled
-    // mov rax, [rdata+8]
     mov rax, [wdata]
+    // read-only mem range: value gets folded
+    add rax, [rdata+8]
+    mov rcx, [rdata]
+    lea rax, [rax+rcx*4]
     ret
 
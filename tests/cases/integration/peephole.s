@@ -0,0 +1,20 @@
+//!args=--run
+// peephole rules: merged stack adjustments, lea without displacement,
+// setting 0 to be subtracted from becomes xor as flags are dead
+        .intel_syntax noprefix
+        .text
+        .globl  f1
+        .type   f1, @function
+f1:
+        push rbx
+        sub rsp, 8
+        sub rsp, 16
+        lea rax, [rsi]
+        add rsp, 16
+        add rsp, 8
+        mov ecx, 0
+        sub rcx, rsi
+        add rax, rcx
+        add rax, rsi
+        pop rbx
+        ret
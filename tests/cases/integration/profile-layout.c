@@ -0,0 +1,75 @@
+//!compile = {cc} {ccflags} -O2 -o {outfile} {infile} {dbrew}
+
+// Profile-guided block layout: instrumented code counts branch
+// directions, relayout regenerates with the hot path as fall-through.
+// The relayouted code is printed: the rare branch for negative elements
+// has to be placed after the loop
+
+#include <dbrew.h>
+#include <stdio.h>
+
+typedef long (*sum_t)(long*, long);
+
+// rarely, an element is negative
+__attribute__ ((noinline))
+long sum(long* a, long n)
+{
+    long i, s = 0;
+
+    for(i = 0; i < n; i++) {
+        if (a[i] < 0)
+            s -= 1000 * a[i];
+        else
+            s += a[i];
+    }
+    return s;
+}
+
+long data[100];
+
+int main(void)
+{
+    Rewriter* r = dbrew_new();
+    Rewriter* r2;
+    sum_t p, q;
+    long i, x;
+    int wrong = 0;
+
+    for(i = 0; i < 100; i++)
+        data[i] = (i % 37 == 5) ? -i : i;
+
+    dbrew_set_function(r, (uint64_t) sum);
+    dbrew_config_parcount(r, 2);
+    dbrew_profile_enable(r, true);
+
+    p = (sum_t) dbrew_rewrite(r, data, 100);
+    for(i = 0; i < 1000; i++)
+        if (p(data, i % 100) != sum(data, i % 100)) wrong++;
+    x = p(data, 100);
+
+    q = (sum_t) dbrew_profile_relayout(r);
+    printf("profiled: %s, relayout: %s\n",
+           (p != sum) ? "yes" : "no",
+           ((q != sum) && (q != p)) ? "yes" : "no");
+    for(i = 0; i < 1000; i++)
+        if (q(data, i % 100) != sum(data, i % 100)) wrong++;
+    printf("results: %ld/%ld/%ld, wrong %d\n",
+           sum(data, 100), x, q(data, 100), wrong);
+
+    // nothing profiled anymore: returns current code
+    printf("again: %s\n", (dbrew_profile_relayout(r) == (uint64_t) q) ? "same" : "new");
+
+    r2 = dbrew_new();
+    dbrew_printer_showbytes(r2, false);
+    dbrew_config_function_setname(r2, (uint64_t) q, "gen");
+    dbrew_config_function_setsize(r2, (uint64_t) q, dbrew_generated_size(r));
+    dbrew_decode_print(r2, (uint64_t) q,
+                       dbrew_generated_size(r) - dbrew_generated_data_size(r));
+    dbrew_free(r2);
+
+    // instrumented code is still owned by us
+    dbrew_release_code(r, (uint64_t) p);
+
+    dbrew_free(r);
+    return 0;
+}
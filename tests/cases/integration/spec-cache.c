@@ -0,0 +1,62 @@
+//!compile = {cc} {ccflags} -O2 -o {outfile} {infile} {dbrew}
+
+// Specialization cache: repeated rewriting with same static parameter
+// reuses code, changed data read via static pointer triggers a rewrite
+
+#include <dbrew.h>
+#include <stdio.h>
+
+typedef long (*kernel_t)(long*, long);
+
+long coeff1[3] = { 1, 2, 3 };
+long coeff2[3] = { 4, 5, 6 };
+
+__attribute__ ((noinline))
+long kernel(long* c, long x)
+{
+    return c[0] + c[1] * x + c[2] * x * x;
+}
+
+static
+void stats(Rewriter* r, const char* what)
+{
+    int entries;
+    uint64_t hits, misses;
+
+    dbrew_cache_stats(r, &entries, &hits, &misses);
+    printf("%-24s entries %d, hits %lu, misses %lu\n",
+           what, entries, hits, misses);
+}
+
+int main(void)
+{
+    Rewriter* r = dbrew_new();
+    kernel_t k1, k2, k3;
+
+    dbrew_set_function(r, (uint64_t) kernel);
+    dbrew_config_parcount(r, 2);
+    dbrew_config_staticpar(r, 0);
+    dbrew_cache_enable(r, 4, 0);
+
+    k1 = (kernel_t) dbrew_rewrite(r, coeff1, 0);
+    stats(r, "rewrite coeff1:");
+    k2 = (kernel_t) dbrew_rewrite(r, coeff1, 5);
+    stats(r, "rewrite coeff1 again:");
+    printf("same code: %s\n", (k1 == k2) ? "yes" : "no");
+
+    k3 = (kernel_t) dbrew_rewrite(r, coeff2, 0);
+    stats(r, "rewrite coeff2:");
+    printf("same code: %s\n", (k1 == k3) ? "yes" : "no");
+
+    coeff1[1] = 7;
+    k2 = (kernel_t) dbrew_rewrite(r, coeff1, 0);
+    stats(r, "rewrite modified coeff1:");
+    printf("results: %ld/%ld %ld/%ld\n",
+           kernel(coeff1, 2), k2(coeff1, 2), kernel(coeff2, 2), k3(coeff2, 2));
+
+    dbrew_cache_flush(r);
+    stats(r, "after flush:");
+
+    dbrew_free(r);
+    return 0;
+}
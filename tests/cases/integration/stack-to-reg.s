@@ -0,0 +1,29 @@
+//!args=--run
+// stack slots with known offset used only by plain accesses are
+// promoted to free GP and XMM registers. A slot read with different
+// width stays in memory
+        .intel_syntax noprefix
+        .text
+        .globl  f1
+        .type   f1, @function
+f1:
+        push rbp
+        mov rbp, rsp
+        mov [rbp-8], rsi
+        mov DWORD PTR [rbp-12], 3
+        mov rax, [rbp-8]
+        add rax, [rbp-8]
+        add [rbp-12], eax
+        movq xmm0, rsi
+        movsd [rbp-24], xmm0
+        movsd xmm1, [rbp-24]
+        addsd xmm1, [rbp-24]
+        movq rcx, xmm1
+        add rax, rcx
+        movsxd rcx, DWORD PTR [rbp-12]
+        add rax, rcx
+        mov [rbp-32], rsi
+        mov ecx, [rbp-32]
+        add rax, rcx
+        pop rbp
+        ret
@@ -0,0 +1,65 @@
+//!compile = {cc} {ccflags} -O2 -o {outfile} {infile} {dbrew}
+
+// Strength reduction: with static divisor/factor, idiv and imul are
+// replaced by shift/lea/multiply-high sequences. Check results for
+// dividends of both signs, including extreme values
+
+#include <dbrew.h>
+#include <limits.h>
+#include <stdio.h>
+
+typedef long (*kernel_t)(long, long);
+
+// products and sum may wrap around: computed unsigned
+__attribute__ ((noinline))
+long kernel(long d, long x)
+{
+    unsigned long q = (unsigned long) (x / d), m = (unsigned long) (x % d);
+
+    return (long) (q * 1000 + m + (unsigned long) x * (unsigned long) d +
+                   (unsigned long) ((int) x / (int) d));
+}
+
+long divisor[] = { 2, 3, 7, 8, 10, 45, 641, 1024, 1000003, -3 };
+
+long value[] = { 0, 1, -1, 5, -5, 123456789, -123456789,
+                 LONG_MAX, LONG_MIN + 1, INT_MAX, INT_MIN };
+
+int main(void)
+{
+    Rewriter* r = dbrew_new();
+    int i, j, k, wrong = 0, checked = 0;
+
+    dbrew_set_function(r, (uint64_t) kernel);
+    dbrew_config_parcount(r, 2);
+    dbrew_config_staticpar(r, 0);
+
+    for(i = 0; i < (int) (sizeof(divisor) / sizeof(long)); i++) {
+        long d = divisor[i];
+        kernel_t k1 = (kernel_t) dbrew_rewrite(r, d, 0);
+
+        if (k1 == kernel) {
+            printf("rewriting failed for %ld\n", d);
+            continue;
+        }
+        for(j = 0; j < (int) (sizeof(value) / sizeof(long)); j++) {
+            for(k = -3; k <= 3; k++) {
+                long x;
+
+                if (((value[j] == LONG_MAX) && (k * d > 0)) ||
+                    ((value[j] == LONG_MIN + 1) && (k * d < 0)))
+                    continue;
+                x = value[j] + k * d;
+                checked++;
+                if (k1(d, x) != kernel(d, x)) {
+                    printf("wrong for %ld/%ld: %ld/%ld\n",
+                           x, d, kernel(d, x), k1(d, x));
+                    wrong++;
+                }
+            }
+        }
+    }
+    printf("checked %d, wrong %d\n", checked, wrong);
+
+    return 0;
+}
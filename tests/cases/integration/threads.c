@@ -0,0 +1,86 @@
+//!compile = {cc} {ccflags} -O2 -pthread -o {outfile} {infile} {dbrew}
+
+// Independent rewriters running concurrently in multiple threads,
+// half of them sharing the global specialization cache
+
+#include <dbrew.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#define THREADS 8
+#define ROUNDS 50
+
+typedef long (*poly_t)(long*, long, long);
+
+__attribute__ ((noinline))
+long poly(long* c, long n, long x)
+{
+    long i, sum = 0;
+
+    for(i = n - 1; i >= 0; i--)
+        sum = sum * x + c[i];
+    return sum;
+}
+
+long coeff[THREADS][8];
+
+typedef struct {
+    int id;
+    int failed, wrong;
+} Job;
+
+static
+void* run(void* arg)
+{
+    Job* job = (Job*) arg;
+    Rewriter* r = dbrew_new();
+    long* c = coeff[job->id];
+    poly_t p;
+    int i;
+
+    dbrew_set_function(r, (uint64_t) poly);
+    dbrew_config_parcount(r, 3);
+    dbrew_config_staticpar(r, 0);
+    dbrew_config_staticpar(r, 1);
+    if (job->id & 1)
+        dbrew_cache_enable_global(r);
+
+    for(i = 0; i < ROUNDS; i++) {
+        long n = 1 + (i % 8);
+        p = (poly_t) dbrew_rewrite(r, c, n, 0);
+        if (p == poly)
+            job->failed++;
+        else if (p(c, n, i) != poly(c, n, i))
+            job->wrong++;
+    }
+
+    dbrew_free(r);
+    return 0;
+}
+
+int main(void)
+{
+    pthread_t t[THREADS];
+    Job job[THREADS];
+    int i, j, failed = 0, wrong = 0;
+
+    for(i = 0; i < THREADS; i++)
+        for(j = 0; j < 8; j++)
+            coeff[i][j] = i + j + 1;
+
+    for(i = 0; i < THREADS; i++) {
+        job[i].id = i;
+        job[i].failed = 0;
+        job[i].wrong = 0;
+        pthread_create(&t[i], 0, run, &job[i]);
+    }
+    for(i = 0; i < THREADS; i++) {
+        pthread_join(t[i], 0);
+        failed += job[i].failed;
+        wrong += job[i].wrong;
+    }
+
+    printf("%d threads, %d rewrites each: failed %d, wrong %d\n",
+           THREADS, ROUNDS, failed, wrong);
+    return 0;
+}
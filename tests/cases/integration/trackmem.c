@@ -0,0 +1,68 @@
+//!compile = {cc} {ccflags} -O2 -o {outfile} {infile} {dbrew}
+
+// Tracking memory content: values stored into a scratch buffer are known
+// when read back, also on different paths after a branch
+
+#include <dbrew.h>
+#include <stdio.h>
+
+typedef long (*kernel_t)(long, long);
+
+// global scratch buffer, accessed via static addresses
+volatile long buf[4];
+long res[4];
+
+__attribute__ ((noinline))
+long kernel(long n, long x)
+{
+    int i;
+
+    // table of powers of n
+    buf[0] = 1;
+    for(i = 1; i < 4; i++)
+        buf[i] = buf[i - 1] * n;
+    // only on one path, the table gets modified
+    if (x > 0)
+        buf[1] = 0;
+    return ((buf[3] * x + buf[2]) * x + buf[1]) * x + buf[0];
+}
+
+static
+int rewrite(Rewriter* r, bool track, kernel_t* k)
+{
+    dbrew_set_function(r, (uint64_t) kernel);
+    dbrew_config_parcount(r, 2);
+    dbrew_config_staticpar(r, 0);
+    dbrew_config_trackmem(r, track);
+    *k = (kernel_t) dbrew_rewrite(r, 3, 0);
+    return dbrew_generated_size(r);
+}
+
+int main(void)
+{
+    Rewriter* r1 = dbrew_new();
+    Rewriter* r2 = dbrew_new();
+    kernel_t k1, k2;
+    int s1, s2, i, wrong = 0;
+
+    s1 = rewrite(r1, false, &k1);
+    s2 = rewrite(r2, true, &k2);
+
+    for(long x = -5; x < 5; x++) {
+        long r = kernel(3, x);
+        for(i = 0; i < 4; i++)
+            res[i] = buf[i];
+        if (k1(3, x) != r) wrong++;
+        if (k2(3, x) != r) wrong++;
+        // stores still are done
+        for(i = 0; i < 4; i++)
+            if (buf[i] != res[i]) wrong++;
+    }
+    printf("rewritten: %s/%s, smaller with tracking: %s, wrong %d\n",
+           (k1 != kernel) ? "yes" : "no", (k2 != kernel) ? "yes" : "no",
+           (s2 < s1) ? "yes" : "no", wrong);
+
+    dbrew_free(r1);
+    dbrew_free(r2);
+    return 0;
+}
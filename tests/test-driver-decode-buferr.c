@@ -1,4 +1,4 @@
-//!compile = as -c -o {ofile} {infile} && {cc} {ccflags} -o {outfile} {ofile} {driver} ../libdbrew.a -I../include
+//!compile = as -c -o {ofile} {infile} && {cc} {ccflags} -o {outfile} {ofile} {driver} ../libdbrew.a -lpthread -I../include
 
 #include <stdio.h>
 #include <stdbool.h>
@@ -15,7 +15,7 @@ int main()
 {
     // Decode the function.
     Rewriter* r = dbrew_new();
-    dbrew_set_decoding_capacity(r,1,1); // force decode buffer overflow
+    dbrew_set_decoding_capacity(r,1,1); // decode buffers have to grow
     // to get rid of changing addresses, assume gen code to be 800 bytes max
     dbrew_config_function_setname(r, (uintptr_t) f1, "f1");
     dbrew_config_function_setsize(r, (uintptr_t) f1, 800);
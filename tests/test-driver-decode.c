@@ -1,4 +1,4 @@
-//!compile = as -c -o {ofile} {infile} && {cc} {ccflags} -o {outfile} {ofile} {driver} ../libdbrew.a -I../include
+//!compile = as -c -o {ofile} {infile} && {cc} {ccflags} -o {outfile} {ofile} {driver} ../libdbrew.a -lpthread -I../include
 
 #include <stdio.h>
 #include <stdbool.h>
@@ -1,4 +1,4 @@
-//!compile = {cc} {ccflags} -std=c99 -g -o {outfile} {infile} {driver} ../libdbrew.a -I../include -I../include/priv
+//!compile = {cc} {ccflags} -std=c99 -g -o {outfile} {infile} {driver} ../libdbrew.a -lpthread -I../include -I../include/priv
 
 #include <stdio.h>
 #include <stdbool.h>
@@ -25,7 +25,7 @@ int main()
     // terminator and is not runnable, we only want to ensure that the produced
     // instruction is correct.
     CBB* cbb = getCaptureBB(&c, 0, -1);
-    Instr* instr = newCapInstr(&c);
+    Instr* instr = newCapInstrs(c.r, 1);
     if ((cbb != 0) && (instr != 0)) {
         cbb->instr = instr;
         cbb->count++;
@@ -1,4 +1,4 @@
-//!compile = {cc} {ccflags} -c -o {ofile} {infile} && {cc} {ccflags} -o {outfile} {ofile} {driver} ../libdbrew.a -I../include
+//!compile = {cc} {ccflags} -c -o {ofile} {infile} && {cc} {ccflags} -o {outfile} {ofile} {driver} ../libdbrew.a -lpthread -I../include
 
 #include <stdio.h>
 #include <stdbool.h>
@@ -44,7 +44,11 @@ int runtest(Rewriter*r, long parameter, bool doRun, bool showBytes)
     dbrew_config_function_setsize(r2, (uint64_t) ff, dbrew_generated_size(r));
     dbrew_config_set_memrange(r2, "rdata", false, (uint64_t) rdata, 16);
     dbrew_config_set_memrange(r2, "wdata", true, (uint64_t) wdata, 16);
-    dbrew_decode_print(r2, (uint64_t) ff, dbrew_generated_size(r));
+    // data behind code (constant pool) is not decoded, only referenced
+    dbrew_config_set_memrange(r2, "gen", false, (uint64_t) ff,
+                              dbrew_generated_size(r));
+    dbrew_decode_print(r2, (uint64_t) ff,
+                       dbrew_generated_size(r) - dbrew_generated_data_size(r));
 
     if (!doRun) return 0;
 